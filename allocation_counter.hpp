@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Counts heap allocations made through operator new, to check that the
+// render loop doesn't allocate. The counter of the calling thread is kept
+// apart from the total so worker threads don't show up in it.
+//
+// The replacement operators are defined in the one file that defines
+// ALLOCATION_COUNTER_IMPLEMENTATION before including this header.
+inline std::atomic<uint64_t> heap_allocations{0};
+inline thread_local uint64_t thread_heap_allocations = 0;
+
+#ifdef ALLOCATION_COUNTER_IMPLEMENTATION
+
+static void *countedAllocation(std::size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  thread_heap_allocations++;
+  void *pointer = std::malloc(size == 0 ? 1 : size);
+  if (pointer == NULL)
+    throw std::bad_alloc();
+  return pointer;
+}
+
+static void *countedAlignedAllocation(std::size_t size,
+                                      std::align_val_t alignment) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  thread_heap_allocations++;
+  const std::size_t align = static_cast<std::size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment
+  void *pointer =
+      std::aligned_alloc(align, (size + align - 1) / align * align);
+  if (pointer == NULL)
+    throw std::bad_alloc();
+  return pointer;
+}
+
+void *operator new(std::size_t size) { return countedAllocation(size); }
+void *operator new[](std::size_t size) { return countedAllocation(size); }
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return countedAlignedAllocation(size, alignment);
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return countedAlignedAllocation(size, alignment);
+}
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete[](void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+void operator delete[](void *pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+void operator delete(void *pointer, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+void operator delete[](void *pointer, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+void operator delete(void *pointer, std::size_t, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+void operator delete[](void *pointer, std::size_t, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+
+#endif
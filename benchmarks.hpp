@@ -0,0 +1,536 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <stb_image.h>
+
+#include "frustum_culling.hpp"
+#include "gpu_culling.hpp"
+#include "mipmap.hpp"
+#include "occlusion_culling.hpp"
+#include "ring_buffer.hpp"
+#include "shader.hpp"
+#include "uniform_blocks.hpp"
+
+#include <GLFW/glfw3.h>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Micro-benchmarks run from the command line instead of the demo, see main().
+// They print the average of a few runs in milliseconds.
+
+inline double benchmarkMs(int runs, const std::function<void()> &body) {
+  body(); // warm up caches and the driver
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++)
+    body();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / runs;
+}
+
+// creates an invisible window with a current context for benchmarks that
+// need GL, returns NULL on failure
+inline GLFWwindow *createBenchmarkContext() {
+  glfwInit();
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#ifdef __APPLE__
+  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+  GLFWwindow *window = glfwCreateWindow(64, 64, "benchmark", NULL, NULL);
+  if (window == NULL) {
+    std::cerr << "Failed to create GLFW window\n";
+    glfwTerminate();
+    return NULL;
+  }
+  glfwMakeContextCurrent(window);
+  if (!gladLoadGL()) {
+    std::cerr << "Failed to initialize GLAD\n";
+    glfwTerminate();
+    return NULL;
+  }
+  return window;
+}
+
+// CPU mip chain generation (scalar, SIMD, sRGB aware) and uploading the chain
+// to immutable storage against uploading the base level and calling
+// glGenerateMipmap
+inline int benchmarkMipmaps(const std::string &filename) {
+  int width, height, components;
+  unsigned char *pixels =
+      stbi_load(filename.c_str(), &width, &height, &components, 4);
+  if (!pixels) {
+    std::cout << "Texture failed to load at path: " << filename << std::endl;
+    return 1;
+  }
+  constexpr int RUNS = 10;
+  std::cout << "BENCHMARK:: " << filename << " " << width << "x" << height
+            << std::endl;
+
+  TextureImage chain;
+  const double simd_ms = benchmarkMs(RUNS, [&] {
+    chain = generateMipChain(pixels, width, height, false);
+  });
+  const double srgb_ms = benchmarkMs(
+      RUNS, [&] { generateMipChain(pixels, width, height, true); });
+  // the same chain with the scalar reference filter, into a scratch copy
+  std::vector<uint8_t> scratch = chain.data;
+  const double scalar_ms = benchmarkMs(RUNS, [&] {
+    for (uint32_t i = 1; i < chain.levels.size(); i++) {
+      const TextureImage::Level &parent = chain.levels[i - 1];
+      downsampleBoxScalar(scratch.data() + parent.offset, parent.width,
+                          parent.height,
+                          scratch.data() + chain.levels[i].offset);
+    }
+  });
+  std::cout << "BENCHMARK:: cpu box filter, scalar " << scalar_ms
+            << " ms, simd " << simd_ms << " ms, simd srgb " << srgb_ms
+            << " ms" << std::endl;
+
+  GLFWwindow *window = createBenchmarkContext();
+  if (window == NULL) {
+    stbi_image_free(pixels);
+    return 1;
+  }
+
+  // glFinish makes the driver side work part of the measurement
+  const double generate_ms = benchmarkMs(RUNS, [&] {
+    uint32_t texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glFinish();
+    glDeleteTextures(1, &texture);
+  });
+  const double storage_ms = benchmarkMs(RUNS, [&] {
+    uint32_t texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, chain.levels.size(), GL_RGBA8, width,
+                   height);
+    for (uint32_t i = 0; i < chain.levels.size(); i++) {
+      const TextureImage::Level &level = chain.levels[i];
+      glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, level.width, level.height,
+                      GL_RGBA, GL_UNSIGNED_BYTE,
+                      chain.data.data() + level.offset);
+    }
+    glFinish();
+    glDeleteTextures(1, &texture);
+  });
+  std::cout << "BENCHMARK:: glTexImage2D + glGenerateMipmap " << generate_ms
+            << " ms, glTexStorage2D + precomputed chain " << storage_ms
+            << " ms" << std::endl;
+
+  stbi_image_free(pixels);
+  glfwTerminate();
+  return 0;
+}
+
+// cost of setting the per frame uniforms render_loop used to set one by one
+// (lights, camera and matrices): by name with a driver lookup per call, by
+// name through the uniform table, through pre-resolved Uniform handles, and
+// as the two uniform block updates that replaced them, with glBufferSubData
+// and written into a RingBuffer
+inline int benchmarkUniforms() {
+  GLFWwindow *window = createBenchmarkContext();
+  if (window == NULL)
+    return 1;
+
+  const std::vector<std::string> vec3_names = {
+      "dir_light_direction",  "dir_light_ambient",    "dir_light_diffuse",
+      "dir_light_specular",   "spot_light_position",  "spot_light_direction",
+      "spot_light_ambient",   "spot_light_diffuse",   "spot_light_specular",
+      "point_light_position", "point_light_ambient",  "point_light_diffuse",
+      "point_light_specular", "camera_pos"};
+  const std::vector<std::string> float_names = {
+      "material_shininess",   "spot_light_constant",
+      "spot_light_linear",    "spot_light_quadratic",
+      "spot_light_cut_off",   "spot_light_outer_cut_off",
+      "point_light_constant", "point_light_linear",
+      "point_light_quadratic"};
+  const std::vector<std::string> mat4_names = {"model", "view", "projection"};
+
+  // a program declaring the uniforms the way shader.vert/frag did before the
+  // uniform blocks, every one of them is used so none gets optimized out
+  std::string vertex_code = "#version 460\nuniform mat3 normal_matrix;\n";
+  std::string sum = "vec3(0.0)";
+  for (const std::string &name : vec3_names) {
+    vertex_code += "uniform vec3 " + name + ";\n";
+    sum += " + " + name;
+  }
+  for (const std::string &name : float_names) {
+    vertex_code += "uniform float " + name + ";\n";
+    sum += " + vec3(" + name + ")";
+  }
+  for (const std::string &name : mat4_names)
+    vertex_code += "uniform mat4 " + name + ";\n";
+  vertex_code += "void main() {\n  gl_Position = projection * view * model * "
+                 "vec4(normal_matrix * (" +
+                 sum + "), 1.0);\n}\n";
+  const std::string fragment_code = "#version 460\nout vec4 frag_color;\n"
+                                    "void main() { frag_color = vec4(1.0); }\n";
+
+  Shader shader;
+  shader.initSource(vertex_code, fragment_code);
+  shader.use();
+  // every run sets the same values, only the last mode filters them
+  GLState::shared().filtering = false;
+
+  std::vector<Uniform<glm::vec3>> vec3_uniforms;
+  for (const std::string &name : vec3_names)
+    vec3_uniforms.push_back(shader.uniform<glm::vec3>(name));
+  std::vector<Uniform<float>> float_uniforms;
+  for (const std::string &name : float_names)
+    float_uniforms.push_back(shader.uniform<float>(name));
+  std::vector<Uniform<glm::mat4>> mat4_uniforms;
+  for (const std::string &name : mat4_names)
+    mat4_uniforms.push_back(shader.uniform<glm::mat4>(name));
+  const Uniform<glm::mat3> normal_matrix =
+      shader.uniform<glm::mat3>("normal_matrix");
+
+  UniformBuffer<CameraBlock> camera_ubo;
+  UniformBuffer<LightBlock> light_ubo;
+  camera_ubo.init(CAMERA_BLOCK_BINDING);
+  light_ubo.init(LIGHT_BLOCK_BINDING);
+  RingBuffer frame_data;
+  frame_data.init(1 << 16);
+
+  constexpr int RUNS = 10;
+  // one frame worth of setters each
+  constexpr int FRAMES = 10000;
+  const glm::vec3 v(0.5f);
+  const glm::mat3 m3(1.0f);
+  const glm::mat4 m4(1.0f);
+
+  const double lookup_ms = benchmarkMs(RUNS, [&] {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (const std::string &name : vec3_names)
+        glUniform3fv(glGetUniformLocation(shader.ID, name.c_str()), 1, &v[0]);
+      for (const std::string &name : float_names)
+        glUniform1f(glGetUniformLocation(shader.ID, name.c_str()), 1.0f);
+      for (const std::string &name : mat4_names)
+        glUniformMatrix4fv(glGetUniformLocation(shader.ID, name.c_str()), 1,
+                           GL_FALSE, &m4[0][0]);
+      glUniformMatrix3fv(glGetUniformLocation(shader.ID, "normal_matrix"), 1,
+                         GL_FALSE, &m3[0][0]);
+    }
+    glFinish();
+  });
+  const double table_ms = benchmarkMs(RUNS, [&] {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (const std::string &name : vec3_names)
+        shader.setVec3(name, v);
+      for (const std::string &name : float_names)
+        shader.setFloat(name, 1.0f);
+      for (const std::string &name : mat4_names)
+        shader.setMat4(name, m4);
+      shader.setMat3("normal_matrix", m3);
+    }
+    glFinish();
+  });
+  const double handle_ms = benchmarkMs(RUNS, [&] {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (const Uniform<glm::vec3> &uniform : vec3_uniforms)
+        uniform.set(v);
+      for (const Uniform<float> &uniform : float_uniforms)
+        uniform.set(1.0f);
+      for (const Uniform<glm::mat4> &uniform : mat4_uniforms)
+        uniform.set(m4);
+      normal_matrix.set(m3);
+    }
+    glFinish();
+  });
+  // the model and normal matrices stay plain uniforms with the blocks
+  const double block_ms = benchmarkMs(RUNS, [&] {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      CameraBlock camera_block = {};
+      camera_block.view = m4;
+      camera_block.projection = m4;
+      camera_block.camera_pos = v;
+      camera_ubo.update(camera_block);
+      LightBlock light_block = {};
+      light_block.spot_light.position = v;
+      light_ubo.update(light_block);
+      mat4_uniforms[0].set(m4);
+      normal_matrix.set(m3);
+    }
+    glFinish();
+  });
+
+  const double ring_ms = benchmarkMs(RUNS, [&] {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      frame_data.beginFrame();
+      CameraBlock camera_block = {};
+      camera_block.view = m4;
+      camera_block.projection = m4;
+      camera_block.camera_pos = v;
+      frame_data.bindUniform(CAMERA_BLOCK_BINDING, camera_block);
+      LightBlock light_block = {};
+      light_block.spot_light.position = v;
+      frame_data.bindUniform(LIGHT_BLOCK_BINDING, light_block);
+      mat4_uniforms[0].set(m4);
+      normal_matrix.set(m3);
+      frame_data.endFrame();
+    }
+    glFinish();
+  });
+
+  GLState::shared().filtering = true;
+  const double filtered_ms = benchmarkMs(RUNS, [&] {
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (const Uniform<glm::vec3> &uniform : vec3_uniforms)
+        uniform.set(v);
+      for (const Uniform<float> &uniform : float_uniforms)
+        uniform.set(1.0f);
+      for (const Uniform<glm::mat4> &uniform : mat4_uniforms)
+        uniform.set(m4);
+      normal_matrix.set(m3);
+    }
+    glFinish();
+  });
+
+  const double per_frame = 1000.0 / FRAMES; // ms per run -> us per frame
+  std::cout << "BENCHMARK:: " << vec3_names.size() + float_names.size() +
+                                     mat4_names.size() + 1
+            << " uniforms per frame, glGetUniformLocation "
+            << lookup_ms * per_frame << " us, uniform table "
+            << table_ms * per_frame << " us, Uniform handles "
+            << handle_ms * per_frame << " us, uniform blocks "
+            << block_ms * per_frame << " us, ring buffer blocks "
+            << ring_ms * per_frame << " us (" << frame_data.fence_waits
+            << " fence waits in " << frame_data.frames
+            << " frames), filtered Uniform handles "
+            << filtered_ms * per_frame << " us" << std::endl;
+
+  camera_ubo.release();
+  light_ubo.release();
+  frame_data.release();
+  GLState::shared().deleteProgram(shader.ID);
+  glfwTerminate();
+  return 0;
+}
+
+// frustum culling of a million random boxes and their spheres, scalar and
+// with the SIMD lanes of the build. no GL involved.
+inline int benchmarkCulling() {
+  constexpr int RUNS = 20;
+  constexpr uint32_t COUNT = 1000000;
+
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  std::uniform_real_distribution<float> extent(0.1f, 2.0f);
+  BoxBatch boxes;
+  SphereBatch spheres;
+  for (uint32_t i = 0; i < COUNT; i++) {
+    const glm::vec3 center(position(random), position(random),
+                           position(random));
+    const glm::vec3 half(extent(random), extent(random), extent(random));
+    boxes.push({center - half, center + half});
+    spheres.push({center, glm::length(half)});
+  }
+  const Frustum frustum(
+      glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 100.0f) *
+      glm::lookAt(glm::vec3(0.0f, 0.0f, 3.0f), glm::vec3(0.0f),
+                  glm::vec3(0.0f, 1.0f, 0.0f)));
+
+  std::vector<uint32_t> visible(COUNT);
+  size_t box_count = 0, sphere_count = 0;
+  const double box_scalar_ms = benchmarkMs(RUNS, [&] {
+    box_count = cullBoxesScalar(frustum, boxes, visible.data());
+  });
+  const double box_simd_ms = benchmarkMs(RUNS, [&] {
+    box_count = cullBoxes(frustum, boxes, visible.data());
+  });
+  const double sphere_scalar_ms = benchmarkMs(RUNS, [&] {
+    sphere_count = cullSpheresScalar(frustum, spheres, visible.data());
+  });
+  const double sphere_simd_ms = benchmarkMs(RUNS, [&] {
+    sphere_count = cullSpheres(frustum, spheres, visible.data());
+  });
+  std::cout << "BENCHMARK:: " << COUNT << " bounds, " << CULL_LANES
+            << " SIMD lanes, boxes scalar " << box_scalar_ms << " ms, SIMD "
+            << box_simd_ms << " ms (" << box_count
+            << " visible), spheres scalar " << sphere_scalar_ms
+            << " ms, SIMD " << sphere_simd_ms << " ms (" << sphere_count
+            << " visible)" << std::endl;
+  return 0;
+}
+
+// renders one triangle into an OcclusionBuffer, no GL involved, and checks
+// that a box behind it is culled while boxes in front of it, or behind it
+// but just beside its silhouette, are not. the boxes beside it are 1/32 of
+// a buffer pixel wide and slid over two pixels in such steps, so some of
+// them lie in the uncovered part of the pixels the triangle's edge crosses.
+// returns 1 if any box gets the wrong answer.
+inline int checkOcclusion() {
+  constexpr uint32_t STEPS = 64;
+  const glm::vec3 camera(0.0f, 0.0f, 5.0f);
+  const glm::mat4 projection = glm::perspective(
+      glm::radians(45.0f), float(OcclusionBuffer::WIDTH) /
+                               OcclusionBuffer::HEIGHT, 0.1f, 100.0f);
+  const glm::mat4 view_projection =
+      projection * glm::lookAt(camera, glm::vec3(0.0f),
+                               glm::vec3(0.0f, 1.0f, 0.0f));
+
+  // a triangle at z = 0 whose right edge is the line x = 1
+  OccluderMesh occluder;
+  occluder.positions = {glm::vec3(-3.0f, -3.0f, 0.0f),
+                        glm::vec3(1.0f, -3.0f, 0.0f),
+                        glm::vec3(1.0f, 3.0f, 0.0f)};
+  occluder.indices = {0, 1, 2};
+  OcclusionBuffer buffer;
+  buffer.begin(view_projection);
+  buffer.addOccluder(occluder, glm::mat4(1.0f));
+  buffer.render();
+
+  const bool behind_culled = buffer.occluded(
+      {glm::vec3(-0.3f, -0.8f, -2.3f), glm::vec3(0.3f, -0.2f, -1.7f)});
+  const bool in_front_culled = buffer.occluded(
+      {glm::vec3(-0.3f, -0.8f, 1.0f), glm::vec3(0.3f, -0.2f, 1.2f)});
+
+  // window x of the edge, and the world x at view distance depth of a
+  // window x
+  const float scale = projection[0][0];
+  const float edge_x =
+      (scale * 1.0f / 5.0f * 0.5f + 0.5f) * OcclusionBuffer::WIDTH;
+  auto worldX = [&](float window_x, float depth) {
+    return (window_x / OcclusionBuffer::WIDTH * 2.0f - 1.0f) * depth / scale;
+  };
+  uint32_t beside_culled = 0;
+  for (uint32_t i = 1; i <= STEPS; i++) {
+    // the far face reaches furthest left on screen, the near face right
+    const float left = worldX(edge_x + 2.0f * i / STEPS, 7.01f);
+    const float right = worldX(edge_x + 2.0f * (i + 0.5f) / STEPS, 7.0f);
+    if (buffer.occluded({glm::vec3(left, -0.2f, -2.01f),
+                         glm::vec3(right, 0.2f, -2.0f)}))
+      beside_culled++;
+  }
+
+  const bool passed = behind_culled && !in_front_culled && beside_culled == 0;
+  std::cout << "OCCLUSION_CHECK:: box behind the occluder "
+            << (behind_culled ? "culled" : "kept") << ", box in front "
+            << (in_front_culled ? "culled" : "kept") << ", " << beside_culled
+            << " of " << STEPS << " boxes beside its silhouette culled, "
+            << (passed ? "passed" : "FAILED") << std::endl;
+  return passed ? 0 : 1;
+}
+
+// GPUCullSet::cull() over growing numbers of instances of a three mesh model
+// in two batches: the GL calls and time of recording it, the time until the
+// GPU is done, and the time culling the same instances on the CPU takes as
+// Model::Draw() does. the visible count is checked against cullBoxes(), the
+// depth pyramid is cleared to the far plane so nothing is occluded. runs on
+// Mesa's llvmpipe with MESA_GL_VERSION_OVERRIDE=4.6 and a virtual display,
+// where the compute shaders run inside glDispatchCompute and only the number
+// of calls shows the recording staying flat.
+inline int benchmarkGPUCulling() {
+  GLFWwindow *window = createBenchmarkContext();
+  if (window == NULL)
+    return 1;
+  constexpr int RUNS = 20;
+
+  const BoundingBox mesh_bounds[3] = {
+      {glm::vec3(-1.0f), glm::vec3(0.0f)},
+      {glm::vec3(0.0f), glm::vec3(1.0f)},
+      {glm::vec3(-1.0f, 0.0f, -1.0f), glm::vec3(1.0f)}};
+  const BoundingBox bounds = {glm::vec3(-1.0f), glm::vec3(1.0f)};
+  std::vector<MeshCullData> meshes;
+  for (uint32_t i = 0; i < 3; i++) {
+    MeshCullData mesh = {};
+    mesh.bounds_min = glm::vec4(mesh_bounds[i].min, 1.0f);
+    mesh.bounds_max = glm::vec4(mesh_bounds[i].max, 1.0f);
+    mesh.index_count = 36;
+    mesh.base_instance = i;
+    mesh.batch = i < 2 ? 0 : 1;
+    mesh.first_command = i < 2 ? 0 : 2;
+    meshes.push_back(mesh);
+  }
+  GPUCullSet culling;
+  culling.init(meshes, 2, 3, bounds);
+  RingBuffer frame_data;
+  frame_data.init(1 << 16);
+
+  const glm::mat4 view_projection =
+      glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 100.0f) *
+      glm::lookAt(glm::vec3(0.0f, 0.0f, 3.0f), glm::vec3(0.0f),
+                  glm::vec3(0.0f, 1.0f, 0.0f));
+  GPUCulling::shared().beginFrame(view_projection);
+  glClearDepth(1.0);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  GPUCulling::shared().buildPyramid(64, 64);
+
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  std::vector<InstanceData> instances;
+  BoxBatch boxes;
+  std::vector<uint32_t> visible;
+  for (uint32_t count : {1000u, 10000u, 100000u, 1000000u}) {
+    while (instances.size() < count)
+      instances.push_back(instanceData(glm::translate(
+          glm::mat4(1.0f),
+          glm::vec3(position(random), position(random), position(random)))));
+    visible.resize(count);
+    uint32_t instance_buffer;
+    glGenBuffers(1, &instance_buffer);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, instance_buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, count * sizeof(InstanceData),
+                    instances.data(), 0);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    // GL state calls of one frame, their number is all that has to stay
+    // flat where compute runs inside the dispatch call
+    auto frame = [&] {
+      GLState::shared().beginFrame();
+      frame_data.beginFrame();
+      culling.cull(frame_data, instance_buffer, count);
+      frame_data.endFrame();
+    };
+    const double record_ms = benchmarkMs(RUNS, frame);
+    GLState::shared().beginFrame();
+    const GLState::Counters &calls = GLState::shared().last_frame;
+    const uint64_t state_calls =
+        calls.programs.issued + calls.vertex_arrays.issued +
+        calls.textures.issued + calls.buffers.issued + calls.uniforms.issued;
+    const double gpu_ms = benchmarkMs(RUNS, [&] {
+      frame();
+      glFinish();
+    });
+    // what Model::Draw() does for the same instances every frame
+    const double cpu_ms = benchmarkMs(RUNS, [&] {
+      boxes.clear();
+      for (uint32_t i = 0; i < count; i++)
+        boxes.push(transformBox(bounds, instances[i].model));
+      cullBoxes(GPUCulling::shared().frustum, boxes, visible.data());
+    });
+    CullCounts counts, mesh_counts;
+    culling.readCounts(counts, mesh_counts);
+    const size_t expected = cullBoxes(GPUCulling::shared().frustum, boxes,
+                                      visible.data());
+    std::cout << "BENCHMARK:: " << count << " instances, " << state_calls
+              << " state calls recorded in " << record_ms
+              << " ms, done on the GPU in " << gpu_ms << " ms, CPU culling "
+              << cpu_ms << " ms, " << counts.visible << " visible ("
+              << (counts.visible == expected ? "matches" : "differs from")
+              << " the CPU's " << expected << ")" << std::endl;
+    GLState::shared().deleteBuffers(1, &instance_buffer);
+  }
+
+  culling.release();
+  frame_data.release();
+  GPUCulling::shared().shutdown();
+  glfwTerminate();
+  return 0;
+}
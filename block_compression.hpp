@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// CPU encoders for the BCn block compressed formats used by cooked textures.
+// Every encoder turns a 4x4 block of RGBA8 pixels into one compressed block:
+//   BC1  8 bytes, RGB with 2 bit indices into a 4 color palette
+//   BC3 16 bytes, BC4 encoded alpha followed by a BC1 color block
+//   BC4  8 bytes, single channel with 3 bit indices into an 8 value ramp
+//   BC5 16 bytes, two BC4 blocks for red and green (normal maps)
+// The encoders favour speed over quality: endpoints come from the principal
+// axis of the block colors, there is no iterative refinement.
+enum class BlockFormat { BC1, BC3, BC4, BC5 };
+
+inline uint32_t blockBytes(BlockFormat format) {
+  return format == BlockFormat::BC1 || format == BlockFormat::BC4 ? 8 : 16;
+}
+
+// size of a whole image in the given format, partial blocks are padded
+inline size_t compressedSize(BlockFormat format, uint32_t width,
+                             uint32_t height) {
+  return size_t((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+inline uint16_t packRGB565(const float color[3]) {
+  int r = std::clamp(int(color[0] * 31.0f / 255.0f + 0.5f), 0, 31);
+  int g = std::clamp(int(color[1] * 63.0f / 255.0f + 0.5f), 0, 63);
+  int b = std::clamp(int(color[2] * 31.0f / 255.0f + 0.5f), 0, 31);
+  return uint16_t((r << 11) | (g << 5) | b);
+}
+
+inline void unpackRGB565(uint16_t packed, float color[3]) {
+  int r = (packed >> 11) & 31;
+  int g = (packed >> 5) & 63;
+  int b = packed & 31;
+  color[0] = float((r << 3) | (r >> 2));
+  color[1] = float((g << 2) | (g >> 4));
+  color[2] = float((b << 3) | (b >> 2));
+}
+
+// block: 16 RGBA8 pixels in row order, out: 8 bytes. BC1 blocks inside BC3
+// always use the 4 color mode.
+inline void encodeBC1Block(const uint8_t block[64], uint8_t out[8]) {
+  // mean and covariance of the block colors
+  float mean[3] = {0.0f, 0.0f, 0.0f};
+  for (int i = 0; i < 16; i++)
+    for (int c = 0; c < 3; c++)
+      mean[c] += block[i * 4 + c];
+  for (int c = 0; c < 3; c++)
+    mean[c] /= 16.0f;
+
+  float cov[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+  for (int i = 0; i < 16; i++) {
+    float r = block[i * 4 + 0] - mean[0];
+    float g = block[i * 4 + 1] - mean[1];
+    float b = block[i * 4 + 2] - mean[2];
+    cov[0] += r * r;
+    cov[1] += r * g;
+    cov[2] += r * b;
+    cov[3] += g * g;
+    cov[4] += g * b;
+    cov[5] += b * b;
+  }
+
+  // principal axis by power iteration
+  float axis[3] = {1.0f, 1.0f, 1.0f};
+  for (int iteration = 0; iteration < 4; iteration++) {
+    float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    float length = std::max({std::fabs(x), std::fabs(y), std::fabs(z)});
+    if (length < 1e-6f)
+      break;
+    axis[0] = x / length;
+    axis[1] = y / length;
+    axis[2] = z / length;
+  }
+
+  // endpoints are the extreme projections onto the axis
+  float min_dot = 1e30f, max_dot = -1e30f;
+  int min_i = 0, max_i = 0;
+  for (int i = 0; i < 16; i++) {
+    float d = block[i * 4 + 0] * axis[0] + block[i * 4 + 1] * axis[1] +
+              block[i * 4 + 2] * axis[2];
+    if (d < min_dot) {
+      min_dot = d;
+      min_i = i;
+    }
+    if (d > max_dot) {
+      max_dot = d;
+      max_i = i;
+    }
+  }
+
+  float max_color[3], min_color[3];
+  for (int c = 0; c < 3; c++) {
+    max_color[c] = block[max_i * 4 + c];
+    min_color[c] = block[min_i * 4 + c];
+  }
+  uint16_t color0 = packRGB565(max_color);
+  uint16_t color1 = packRGB565(min_color);
+  // color0 > color1 selects the 4 color mode
+  if (color0 < color1)
+    std::swap(color0, color1);
+
+  uint32_t indices = 0;
+  if (color0 != color1) {
+    float palette[4][3];
+    unpackRGB565(color0, palette[0]);
+    unpackRGB565(color1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+      palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+      palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+
+    for (int i = 0; i < 16; i++) {
+      float best = 1e30f;
+      uint32_t best_index = 0;
+      for (uint32_t p = 0; p < 4; p++) {
+        float error = 0.0f;
+        for (int c = 0; c < 3; c++) {
+          float d = block[i * 4 + c] - palette[p][c];
+          error += d * d;
+        }
+        if (error < best) {
+          best = error;
+          best_index = p;
+        }
+      }
+      indices |= best_index << (i * 2);
+    }
+  }
+
+  out[0] = color0 & 0xff;
+  out[1] = color0 >> 8;
+  out[2] = color1 & 0xff;
+  out[3] = color1 >> 8;
+  std::memcpy(out + 4, &indices, 4);
+}
+
+// encodes one channel of the block, out: 8 bytes
+inline void encodeBC4Block(const uint8_t block[64], int channel,
+                           uint8_t out[8]) {
+  uint8_t lo = 255, hi = 0;
+  for (int i = 0; i < 16; i++) {
+    lo = std::min(lo, block[i * 4 + channel]);
+    hi = std::max(hi, block[i * 4 + channel]);
+  }
+
+  // hi > lo selects the 8 value ramp
+  out[0] = hi;
+  out[1] = lo;
+  uint64_t indices = 0;
+  if (hi != lo) {
+    float ramp[8];
+    ramp[0] = hi;
+    ramp[1] = lo;
+    for (int r = 1; r < 7; r++)
+      ramp[r + 1] = ((7 - r) * float(hi) + r * float(lo)) / 7.0f;
+
+    for (int i = 0; i < 16; i++) {
+      float value = block[i * 4 + channel];
+      float best = 1e30f;
+      uint64_t best_index = 0;
+      for (uint64_t r = 0; r < 8; r++) {
+        float error = std::fabs(value - ramp[r]);
+        if (error < best) {
+          best = error;
+          best_index = r;
+        }
+      }
+      indices |= best_index << (i * 3);
+    }
+  }
+
+  for (int b = 0; b < 6; b++)
+    out[2 + b] = (indices >> (b * 8)) & 0xff;
+}
+
+// compresses a whole RGBA8 image, edge blocks repeat the last row/column
+inline std::vector<uint8_t> compressImage(BlockFormat format,
+                                          const uint8_t *rgba, uint32_t width,
+                                          uint32_t height) {
+  std::vector<uint8_t> result(compressedSize(format, width, height));
+  const uint32_t blocks_x = (width + 3) / 4;
+  const uint32_t blocks_y = (height + 3) / 4;
+  const uint32_t block_size = blockBytes(format);
+
+  for (uint32_t by = 0; by < blocks_y; by++) {
+    for (uint32_t bx = 0; bx < blocks_x; bx++) {
+      uint8_t block[64];
+      for (uint32_t y = 0; y < 4; y++) {
+        uint32_t sy = std::min(by * 4 + y, height - 1);
+        for (uint32_t x = 0; x < 4; x++) {
+          uint32_t sx = std::min(bx * 4 + x, width - 1);
+          std::memcpy(block + (y * 4 + x) * 4,
+                      rgba + (size_t(sy) * width + sx) * 4, 4);
+        }
+      }
+
+      uint8_t *out = result.data() + (size_t(by) * blocks_x + bx) * block_size;
+      switch (format) {
+      case BlockFormat::BC1:
+        encodeBC1Block(block, out);
+        break;
+      case BlockFormat::BC3:
+        encodeBC4Block(block, 3, out);
+        encodeBC1Block(block, out + 8);
+        break;
+      case BlockFormat::BC4:
+        encodeBC4Block(block, 0, out);
+        break;
+      case BlockFormat::BC5:
+        encodeBC4Block(block, 0, out);
+        encodeBC4Block(block, 1, out + 8);
+        break;
+      }
+    }
+  }
+  return result;
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "block_compression.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// S3TC is an extension rather than core GL, but every desktop driver exposes
+// it
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// A texture with its whole mip chain in one blob. Either block compressed,
+// read from a DDS or KTX2 container, or GL_RGBA8 levels produced by the CPU
+// mip generator in mipmap.hpp.
+struct TextureImage {
+  struct Level {
+    uint32_t width;
+    uint32_t height;
+    size_t offset;
+    size_t size;
+  };
+
+  // GL internal format, 0 when no image is held
+  GLenum format = 0;
+  std::vector<Level> levels;
+  std::vector<uint8_t> data;
+
+  bool compressed() const { return format != 0 && format != GL_RGBA8; }
+};
+
+inline GLenum glFormatFor(BlockFormat format) {
+  switch (format) {
+  case BlockFormat::BC1:
+    return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  case BlockFormat::BC3:
+    return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  case BlockFormat::BC4:
+    return GL_COMPRESSED_RED_RGTC1;
+  case BlockFormat::BC5:
+    return GL_COMPRESSED_RG_RGTC2;
+  }
+  return 0;
+}
+
+// bytes per 4x4 block of a compressed GL format, 0 if it isn't one we handle
+inline uint32_t glBlockBytes(GLenum format) {
+  switch (format) {
+  case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_RED_RGTC1:
+    return 8;
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+  case GL_COMPRESSED_RG_RGTC2:
+  case GL_COMPRESSED_RGBA_BPTC_UNORM:
+  case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+    return 16;
+  }
+  return 0;
+}
+
+// levels of a full mip chain down to 1x1
+inline uint32_t mipLevelCount(uint32_t width, uint32_t height) {
+  uint32_t levels = 1;
+  while ((width | height) >> levels)
+    levels++;
+  return levels;
+}
+
+// fills in the level table of a tightly packed mip chain, with header_only
+// the data blob isn't expected to hold the levels. level counts beyond a
+// full chain come from a corrupt file and are rejected.
+inline bool layoutLevels(TextureImage &image, uint32_t width,
+                         uint32_t height, uint32_t level_count,
+                         size_t data_offset = 0, bool header_only = false) {
+  const uint32_t block_bytes = glBlockBytes(image.format);
+  if (block_bytes == 0 || width == 0 || height == 0 || level_count == 0 ||
+      level_count > mipLevelCount(width, height))
+    return false;
+
+  size_t offset = data_offset;
+  for (uint32_t i = 0; i < level_count; i++) {
+    TextureImage::Level level;
+    level.width = std::max(width >> i, 1u);
+    level.height = std::max(height >> i, 1u);
+    level.offset = offset;
+    level.size =
+        size_t((level.width + 3) / 4) * ((level.height + 3) / 4) * block_bytes;
+    offset += level.size;
+    image.levels.push_back(level);
+  }
+  return header_only || offset <= image.data.size();
+}
+
+// reads a whole file, or only its first max_bytes
+inline std::vector<uint8_t> readFileBytes(const std::string &path,
+                                          size_t max_bytes = SIZE_MAX) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return {};
+  if (max_bytes != SIZE_MAX) {
+    std::vector<uint8_t> bytes(max_bytes);
+    file.read(reinterpret_cast<char *>(bytes.data()), max_bytes);
+    bytes.resize(file.gcount());
+    return bytes;
+  }
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file),
+                              std::istreambuf_iterator<char>());
+}
+
+template <typename T> T readLE(const uint8_t *bytes) {
+  T value;
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// DDS ------------------------------------------------------------------------
+
+constexpr uint32_t DDS_MAGIC = 0x20534444; // "DDS "
+constexpr uint32_t DDS_HEADER_SIZE = 124;
+constexpr uint32_t DDS_DX10_HEADER_SIZE = 20;
+constexpr uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4,
+                   DDSD_PIXELFORMAT = 0x1000, DDSD_MIPMAPCOUNT = 0x20000,
+                   DDSD_LINEARSIZE = 0x80000;
+constexpr uint32_t DDPF_FOURCC = 0x4;
+constexpr uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000,
+                   DDSCAPS_MIPMAP = 0x400000;
+
+constexpr uint32_t fourCC(const char code[5]) {
+  return uint32_t(uint8_t(code[0])) | uint32_t(uint8_t(code[1])) << 8 |
+         uint32_t(uint8_t(code[2])) << 16 | uint32_t(uint8_t(code[3])) << 24;
+}
+
+// DXGI_FORMAT values of the DX10 extension header
+enum DXGIFormat : uint32_t {
+  DXGI_FORMAT_BC1_UNORM = 71,
+  DXGI_FORMAT_BC3_UNORM = 77,
+  DXGI_FORMAT_BC4_UNORM = 80,
+  DXGI_FORMAT_BC5_UNORM = 83,
+  DXGI_FORMAT_BC7_UNORM = 98,
+  DXGI_FORMAT_BC7_UNORM_SRGB = 99,
+};
+
+inline GLenum glFormatFromDXGI(uint32_t format) {
+  switch (format) {
+  case DXGI_FORMAT_BC1_UNORM:
+    return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  case DXGI_FORMAT_BC3_UNORM:
+    return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  case DXGI_FORMAT_BC4_UNORM:
+    return GL_COMPRESSED_RED_RGTC1;
+  case DXGI_FORMAT_BC5_UNORM:
+    return GL_COMPRESSED_RG_RGTC2;
+  case DXGI_FORMAT_BC7_UNORM:
+    return GL_COMPRESSED_RGBA_BPTC_UNORM;
+  case DXGI_FORMAT_BC7_UNORM_SRGB:
+    return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+  }
+  return 0;
+}
+
+inline uint32_t dxgiFromBlockFormat(BlockFormat format) {
+  switch (format) {
+  case BlockFormat::BC1:
+    return DXGI_FORMAT_BC1_UNORM;
+  case BlockFormat::BC3:
+    return DXGI_FORMAT_BC3_UNORM;
+  case BlockFormat::BC4:
+    return DXGI_FORMAT_BC4_UNORM;
+  case BlockFormat::BC5:
+    return DXGI_FORMAT_BC5_UNORM;
+  }
+  return 0;
+}
+
+// with header_only just the format and level table are filled in, which only
+// needs the first few bytes of the file
+inline bool readDDS(const std::string &path, TextureImage &image,
+                    bool header_only = false) {
+  image = TextureImage();
+  image.data = readFileBytes(
+      path, header_only ? 4 + DDS_HEADER_SIZE + DDS_DX10_HEADER_SIZE
+                        : SIZE_MAX);
+  const std::vector<uint8_t> &bytes = image.data;
+  if (bytes.size() < 4 + DDS_HEADER_SIZE ||
+      readLE<uint32_t>(&bytes[0]) != DDS_MAGIC ||
+      readLE<uint32_t>(&bytes[4]) != DDS_HEADER_SIZE)
+    return false;
+
+  const uint8_t *header = &bytes[4];
+  const uint32_t height = readLE<uint32_t>(header + 8);
+  const uint32_t width = readLE<uint32_t>(header + 12);
+  const uint32_t mip_count = std::max(readLE<uint32_t>(header + 24), 1u);
+  const uint32_t pf_flags = readLE<uint32_t>(header + 76);
+  const uint32_t pf_four_cc = readLE<uint32_t>(header + 80);
+  if (!(pf_flags & DDPF_FOURCC))
+    return false;
+
+  size_t data_offset = 4 + DDS_HEADER_SIZE;
+  if (pf_four_cc == fourCC("DX10")) {
+    if (bytes.size() < data_offset + DDS_DX10_HEADER_SIZE)
+      return false;
+    image.format = glFormatFromDXGI(readLE<uint32_t>(&bytes[data_offset]));
+    data_offset += DDS_DX10_HEADER_SIZE;
+  } else if (pf_four_cc == fourCC("DXT1")) {
+    image.format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  } else if (pf_four_cc == fourCC("DXT5")) {
+    image.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  } else if (pf_four_cc == fourCC("ATI1") || pf_four_cc == fourCC("BC4U")) {
+    image.format = GL_COMPRESSED_RED_RGTC1;
+  } else if (pf_four_cc == fourCC("ATI2") || pf_four_cc == fourCC("BC5U")) {
+    image.format = GL_COMPRESSED_RG_RGTC2;
+  }
+
+  if (!layoutLevels(image, width, height, mip_count, data_offset,
+                    header_only)) {
+    image = TextureImage();
+    return false;
+  }
+  if (header_only)
+    image.data.clear();
+  return true;
+}
+
+// writes a mip chain produced by compressImage(), always with a DX10 header
+inline bool writeDDS(const std::string &path, BlockFormat format,
+                     uint32_t width, uint32_t height,
+                     const std::vector<std::vector<uint8_t>> &levels) {
+  uint8_t header[4 + DDS_HEADER_SIZE + DDS_DX10_HEADER_SIZE] = {};
+  auto put = [&header](size_t offset, uint32_t value) {
+    std::memcpy(header + offset, &value, 4);
+  };
+
+  put(0, DDS_MAGIC);
+  put(4, DDS_HEADER_SIZE);
+  put(8, DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT |
+             DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE);
+  put(12, height);
+  put(16, width);
+  put(20, levels.empty() ? 0 : levels[0].size());
+  put(28, levels.size());
+  put(4 + 72, 32);          // pixel format size
+  put(4 + 76, DDPF_FOURCC); // pixel format flags
+  put(4 + 80, fourCC("DX10"));
+  put(4 + 104, DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | DDSCAPS_MIPMAP);
+
+  const size_t dx10 = 4 + DDS_HEADER_SIZE;
+  put(dx10 + 0, dxgiFromBlockFormat(format));
+  put(dx10 + 4, 3); // D3D10_RESOURCE_DIMENSION_TEXTURE2D
+  put(dx10 + 12, 1); // array size
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  for (const std::vector<uint8_t> &level : levels)
+    file.write(reinterpret_cast<const char *>(level.data()), level.size());
+  return bool(file);
+}
+
+// KTX2 -----------------------------------------------------------------------
+
+constexpr uint8_t KTX2_IDENTIFIER[12] = {0xAB, 'K',  'T',  'X',  ' ',  '2',
+                                         '0',  0xBB, '\r', '\n', 0x1A, '\n'};
+constexpr size_t KTX2_HEADER_SIZE = 80;
+
+// VkFormat values of the formats we can upload
+inline GLenum glFormatFromVk(uint32_t format) {
+  switch (format) {
+  case 131: // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  case 137: // VK_FORMAT_BC3_UNORM_BLOCK
+    return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  case 139: // VK_FORMAT_BC4_UNORM_BLOCK
+    return GL_COMPRESSED_RED_RGTC1;
+  case 141: // VK_FORMAT_BC5_UNORM_BLOCK
+    return GL_COMPRESSED_RG_RGTC2;
+  case 145: // VK_FORMAT_BC7_UNORM_BLOCK
+    return GL_COMPRESSED_RGBA_BPTC_UNORM;
+  case 146: // VK_FORMAT_BC7_SRGB_BLOCK
+    return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+  }
+  return 0;
+}
+
+// only plain 2D textures without supercompression are supported, see
+// readDDS() for header_only
+inline bool readKTX2(const std::string &path, TextureImage &image,
+                     bool header_only = false) {
+  // the level index holds at most 32 levels
+  image = TextureImage();
+  image.data =
+      readFileBytes(path, header_only ? KTX2_HEADER_SIZE + 32 * 24 : SIZE_MAX);
+  const std::vector<uint8_t> &bytes = image.data;
+  if (bytes.size() < KTX2_HEADER_SIZE ||
+      std::memcmp(bytes.data(), KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0)
+    return false;
+
+  const uint8_t *header = bytes.data() + sizeof(KTX2_IDENTIFIER);
+  image.format = glFormatFromVk(readLE<uint32_t>(header + 0));
+  const uint32_t width = readLE<uint32_t>(header + 8);
+  const uint32_t height = readLE<uint32_t>(header + 12);
+  const uint32_t depth = readLE<uint32_t>(header + 16);
+  const uint32_t layers = readLE<uint32_t>(header + 20);
+  const uint32_t faces = readLE<uint32_t>(header + 24);
+  const uint32_t level_count = std::max(readLE<uint32_t>(header + 28), 1u);
+  const uint32_t supercompression = readLE<uint32_t>(header + 32);
+  if (image.format == 0 || width == 0 || height == 0 || depth > 1 ||
+      layers > 1 || faces != 1 || supercompression != 0 ||
+      level_count > mipLevelCount(width, height) ||
+      bytes.size() < KTX2_HEADER_SIZE + size_t(level_count) * 24) {
+    image = TextureImage();
+    return false;
+  }
+
+  // level index right after the header, levels are stored smallest first
+  // in the file but the index is ordered by level. every level has to hold
+  // exactly the blocks the upload expects and lie within the file.
+  const uint32_t block_bytes = glBlockBytes(image.format);
+  for (uint32_t i = 0; i < level_count; i++) {
+    const uint8_t *entry = bytes.data() + KTX2_HEADER_SIZE + i * 24;
+    TextureImage::Level level;
+    level.width = std::max(width >> i, 1u);
+    level.height = std::max(height >> i, 1u);
+    level.offset = readLE<uint64_t>(entry + 0);
+    level.size = readLE<uint64_t>(entry + 8);
+    const bool outside = level.offset > bytes.size() ||
+                         level.size > bytes.size() - level.offset;
+    if ((!header_only && outside) ||
+        level.size != size_t((level.width + 3) / 4) *
+                          ((level.height + 3) / 4) * block_bytes) {
+      image = TextureImage();
+      return false;
+    }
+    image.levels.push_back(level);
+  }
+  if (header_only)
+    image.data.clear();
+  return true;
+}
+
+// looks for a cooked "<name>.ktx2" or "<name>.dds" next to the source image
+inline bool readCompressedSibling(const std::string &filename,
+                                  TextureImage &image,
+                                  bool header_only = false) {
+  const size_t dot = filename.find_last_of('.');
+  const size_t slash = filename.find_last_of('/');
+  const std::string stem =
+      dot != std::string::npos && (slash == std::string::npos || dot > slash)
+          ? filename.substr(0, dot)
+          : filename;
+  return readKTX2(stem + ".ktx2", image, header_only) ||
+         readDDS(stem + ".dds", image, header_only);
+}
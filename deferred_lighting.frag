@@ -0,0 +1,253 @@
+#version 460
+
+// lighting pass of the deferred shading, see DeferredShading in
+// deferred_shading.hpp. runs once per pixel the geometry pass covered and
+// lights it like shader.frag lights a fragment, from the surface in the
+// G-buffer. compiled per light set, DIR_LIGHT, POINT_LIGHTS and SPOT_LIGHT
+// like shader.frag.
+
+// the light structs are laid out to pack into std140 without padding
+// between members, see uniform_blocks.hpp
+struct DirLight {
+    vec3 direction;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+struct PointLight {
+    vec3 position;
+    float constant;
+
+    vec3 ambient;
+    float linear;
+    vec3 diffuse;
+    float quadratic;
+    vec3 specular;
+    float radius;
+};
+
+struct SpotLight {
+    vec3  position;
+    float cut_off;
+    vec3  direction;
+    float outer_cut_off;
+
+    vec3 ambient;
+    float constant;
+    vec3 diffuse;
+    float linear;
+    vec3 specular;
+    float quadratic;
+};
+
+layout (location = 0) out vec4 frag_color;
+
+// see DeferredShading::allocate()
+layout (binding = 4) uniform sampler2D gbuffer_albedo_specular;
+layout (binding = 5) uniform sampler2D gbuffer_normal;
+layout (binding = 6) uniform sampler2D gbuffer_depth;
+
+// clip space back to world space
+uniform mat4 inverse_view_projection;
+uniform float shininess;
+
+// the surface of the pixel, read once in main()
+vec3 frag_pos;
+vec3 diffuse_texel;
+vec3 specular_texel;
+
+// per frame camera data, see CameraBlock in uniform_blocks.hpp
+layout (std140, binding = 0) uniform camera_block {
+    mat4 view;
+    mat4 projection;
+    vec3 camera_pos;
+};
+
+// per frame light data, see LightBlock in uniform_blocks.hpp
+layout (std140, binding = 1) uniform light_block {
+    DirLight dir_light;
+    SpotLight spot_light;
+    uvec3 cluster_grid;
+    uint point_light_count;
+    vec2 cluster_tile_size;
+    float cluster_scale;
+    float cluster_bias;
+    float cluster_near;
+    float cluster_far;
+};
+
+layout (std430, binding = 7) readonly buffer point_light_buffer {
+    PointLight point_lights[];
+};
+
+// the point lights touching each cluster, see LightClusters in
+// light_clusters.hpp
+const uint MAX_CLUSTER_LIGHTS = 127u;
+
+struct LightCluster {
+    uint count;
+    uint lights[MAX_CLUSTER_LIGHTS];
+};
+
+layout (std430, binding = 8) readonly buffer light_cluster_buffer {
+    LightCluster clusters[];
+};
+
+uint cluster_index();
+vec3 octahedral_decode(vec2 encoded);
+vec3 calc_dir_light(DirLight light, vec3 normal, vec3 view_dir);
+vec3 calc_point_light(PointLight light, vec3 normal, vec3 frag_pos, vec3 view_dir);
+vec3 calc_spot_light(SpotLight light, vec3 normal, vec3 frag_pos, vec3 view_dir);
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gbuffer_depth, texel, 0).r;
+    // nothing was drawn here
+    if (depth == 1.0)
+        discard;
+    gl_FragDepth = depth;
+
+    // position from the depth
+    vec2 screen_size = vec2(textureSize(gbuffer_depth, 0));
+    vec3 ndc = vec3(gl_FragCoord.xy / screen_size, depth) * 2.0 - 1.0;
+    vec4 world_pos = inverse_view_projection * vec4(ndc, 1.0);
+    frag_pos = world_pos.xyz / world_pos.w;
+
+    vec4 albedo_specular = texelFetch(gbuffer_albedo_specular, texel, 0);
+    diffuse_texel = albedo_specular.rgb;
+    specular_texel = vec3(albedo_specular.a);
+
+    // properties
+    vec3 norm = octahedral_decode(texelFetch(gbuffer_normal, texel, 0).rg);
+    vec3 view_dir = normalize(camera_pos - frag_pos);
+
+    vec3 result = vec3(0.0);
+
+#ifdef DIR_LIGHT
+    // directional lighting
+    result += calc_dir_light(dir_light, norm, view_dir);
+#endif
+
+#ifdef POINT_LIGHTS
+    // point lights of the cluster
+    uint cluster = cluster_index();
+    uint light_count = min(clusters[cluster].count, MAX_CLUSTER_LIGHTS);
+    for (uint i = 0u; i < light_count; i++)
+        result += calc_point_light(point_lights[clusters[cluster].lights[i]],
+                                   norm, frag_pos, view_dir);
+#endif
+
+#ifdef SPOT_LIGHT
+    // spot light
+    result += calc_spot_light(spot_light, norm, frag_pos, view_dir);
+#endif
+
+    frag_color = vec4(result, 1.0);
+}
+
+// inverse of octahedral_encode() in gbuffer.frag
+vec3 octahedral_decode(vec2 encoded)
+{
+    vec2 folded = encoded * 2.0 - 1.0;
+    vec3 n = vec3(folded, 1.0 - abs(folded.x) - abs(folded.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) *
+               vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+// cluster of the fragment from its pixel and view space depth
+uint cluster_index()
+{
+    float depth = -(view * vec4(frag_pos, 1.0)).z;
+    uvec3 cell;
+    cell.xy = uvec2(gl_FragCoord.xy / cluster_tile_size);
+    cell.z = uint(max(log(depth) * cluster_scale + cluster_bias, 0.0));
+    cell = min(cell, cluster_grid - 1u);
+    return cell.x + cluster_grid.x * (cell.y + cluster_grid.y * cell.z);
+}
+
+vec3 calc_dir_light(DirLight light, vec3 normal, vec3 view_dir)
+{
+    vec3 light_dir = normalize(-light.direction);
+
+    // diffuse shading
+    float diff = max(dot(normal, light_dir), 0.0);
+
+    // specular shading
+    vec3 reflect_dir = reflect(-light_dir, normal);
+    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), shininess);
+
+    // combine results
+    vec3 ambient  = light.ambient  * diffuse_texel;
+    vec3 diffuse  = light.diffuse  * diff * diffuse_texel;
+    vec3 specular = light.specular * spec * specular_texel;
+
+    return (ambient + diffuse + specular);
+}
+
+vec3 calc_point_light(PointLight light, vec3 normal, vec3 frag_pos, vec3 view_dir)
+{
+    vec3 light_dir = normalize(light.position - frag_pos);
+
+    // diffuse shading
+    float diff = max(dot(normal, light_dir), 0.0);
+
+    // specular shading
+    vec3 reflect_dir = reflect(-light_dir, normal);
+    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), shininess);
+
+    // attenuation
+    float distance    = length(light.position - frag_pos);
+    float attenuation = 1.0 / (light.constant + light.linear * distance +
+    light.quadratic * (distance * distance));
+    // fade out towards the radius the light was assigned to clusters with
+    float falloff = clamp(1.0 - pow(distance / light.radius, 4.0), 0.0, 1.0);
+    attenuation *= falloff * falloff;
+
+    // combine results
+    vec3 ambient  = light.ambient  * diffuse_texel;
+    vec3 diffuse  = light.diffuse  * diff * diffuse_texel;
+    vec3 specular = light.specular * spec * specular_texel;
+
+    ambient  *= attenuation;
+    diffuse  *= attenuation;
+    specular *= attenuation;
+
+    return (ambient + diffuse + specular);
+}
+
+vec3 calc_spot_light(SpotLight light, vec3 normal, vec3 frag_pos, vec3 view_dir)
+{
+    vec3 light_dir = normalize(light.position - frag_pos);
+
+    // diffuse shading
+    float diff = max(dot(normal, light_dir), 0.0);
+
+    // specular shading
+    vec3 reflect_dir = reflect(-light_dir, normal);
+    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), shininess);
+
+    // attenuation
+    float distance = length(light.position - frag_pos);
+    float attenuation = 1.0 / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
+
+    // spotlight intensity
+    float theta = dot(light_dir, normalize(-light.direction));
+    float epsilon = light.cut_off - light.outer_cut_off;
+    float intensity = clamp((theta - light.outer_cut_off) / epsilon, 0.0, 1.0);
+
+    // combine results
+    vec3 ambient = light.ambient * diffuse_texel;
+    vec3 diffuse = light.diffuse * diff * diffuse_texel;
+    vec3 specular = light.specular * spec * specular_texel;
+
+    ambient *= attenuation * intensity;
+    diffuse *= attenuation * intensity;
+    specular *= attenuation * intensity;
+
+    return (ambient + diffuse + specular);
+}
@@ -0,0 +1,9 @@
+#version 460
+
+// one triangle covering the screen, see DeferredShading in
+// deferred_shading.hpp
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "gl_state.hpp"
+#include "shader.hpp"
+#include "shader_permutations.hpp"
+
+#include <cstdint>
+#include <iostream>
+
+// texture units the lighting pass reads the G-buffer from, below the depth
+// pyramid of gpu_culling.hpp
+constexpr uint32_t GBUFFER_ALBEDO_SPECULAR_UNIT = 4;
+constexpr uint32_t GBUFFER_NORMAL_UNIT = 5;
+constexpr uint32_t GBUFFER_DEPTH_UNIT = 6;
+
+// Deferred shading. The geometry pass draws the meshes with a variant of
+// geometry_programs (shader.vert with gbuffer.frag) into a G-buffer of 8
+// bytes per pixel next to the depth:
+//
+//   albedo_specular  RGBA8  diffuse texel, specular texel in alpha
+//   normal           RG16   world space normal, octahedral encoded
+//   depth            DEPTH_COMPONENT32F, the position is rebuilt from it
+//
+// The lighting pass then runs the variant of lighting_programs
+// (deferred_lighting.vert/.frag) for the lights of the frame once per
+// covered pixel of the target framebuffer with a single triangle over the
+// screen. It
+// lights the pixel like shader.frag does, point lights from its cluster of
+// light_clusters.hpp, and writes the G-buffer depth so what is drawn
+// forward afterwards is still depth tested. Textures are sampled and lights
+// evaluated once per pixel, not once per fragment drawn over it.
+class DeferredShading {
+public:
+  // variants by material and by light features
+  ShaderPermutations geometry_programs;
+  ShaderPermutations lighting_programs;
+
+  uint32_t framebuffer = 0;
+  uint32_t albedo_specular = 0, normal = 0, depth = 0;
+  uint32_t width = 0, height = 0;
+
+  DeferredShading() {}
+  DeferredShading(const DeferredShading &) = delete;
+  DeferredShading &operator=(const DeferredShading &) = delete;
+
+  void init() {
+    geometry_programs.init("shader.vert", "gbuffer.frag",
+                           SHADER_MATERIAL_FEATURES);
+    lighting_programs.init("deferred_lighting.vert", "deferred_lighting.frag",
+                           SHADER_LIGHT_FEATURES);
+    // the screen triangle has no attributes, core profile still wants a VAO
+    glGenVertexArrays(1, &empty_vertex_array);
+  }
+
+  // binds the G-buffer, sized width x height, and clears it. the geometry
+  // pass draws with geometry_programs after this.
+  void beginGeometry(uint32_t target_width, uint32_t target_height) {
+    GLint bound = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &bound);
+    target_framebuffer = bound;
+    if (target_width != width || target_height != height)
+      allocate(target_width, target_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  }
+
+  // lights the G-buffer into the framebuffer that was bound before
+  // beginGeometry() with the lights in features. camera_block and
+  // light_block have to be bound and the lights assigned to their clusters.
+  void light(const glm::mat4 &view_projection, float material_shininess,
+             uint32_t features) {
+    glBindFramebuffer(GL_FRAMEBUFFER, target_framebuffer);
+    GLState &state = GLState::shared();
+    state.bindTexture(GBUFFER_ALBEDO_SPECULAR_UNIT, GL_TEXTURE_2D,
+                      albedo_specular);
+    state.bindTexture(GBUFFER_NORMAL_UNIT, GL_TEXTURE_2D, normal);
+    state.bindTexture(GBUFFER_DEPTH_UNIT, GL_TEXTURE_2D, depth);
+    features &= lighting_programs.used_features;
+    const Shader &program = lighting_programs.variant(features);
+    LightingUniforms &uniforms = lighting_uniforms[features];
+    if (!uniforms.inverse_view_projection.resolvedOn(program.ID)) {
+      uniforms.inverse_view_projection =
+          program.uniform<glm::mat4>("inverse_view_projection");
+      uniforms.shininess = program.uniform<float>("shininess");
+    }
+    program.use();
+    uniforms.inverse_view_projection.set(glm::inverse(view_projection));
+    uniforms.shininess.set(material_shininess);
+    state.bindVertexArray(empty_vertex_array);
+    // every pixel the geometry pass covered takes its depth
+    glDepthFunc(GL_ALWAYS);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glDepthFunc(GL_LESS);
+  }
+
+  void release() {
+    releaseTargets();
+    if (empty_vertex_array != 0)
+      GLState::shared().deleteVertexArrays(1, &empty_vertex_array);
+    empty_vertex_array = 0;
+    geometry_programs.release();
+    lighting_programs.release();
+  }
+
+private:
+  // resolved when a lighting variant is first used
+  struct LightingUniforms {
+    Uniform<glm::mat4> inverse_view_projection;
+    Uniform<float> shininess;
+  };
+  LightingUniforms lighting_uniforms[SHADER_VARIANTS];
+  uint32_t empty_vertex_array = 0;
+  uint32_t target_framebuffer = 0;
+
+  void allocate(uint32_t target_width, uint32_t target_height) {
+    releaseTargets();
+    width = target_width;
+    height = target_height;
+    albedo_specular = createTarget(GBUFFER_ALBEDO_SPECULAR_UNIT, GL_RGBA8);
+    normal = createTarget(GBUFFER_NORMAL_UNIT, GL_RG16);
+    depth = createTarget(GBUFFER_DEPTH_UNIT, GL_DEPTH_COMPONENT32F);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, albedo_specular, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                           GL_TEXTURE_2D, normal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                           GL_TEXTURE_2D, depth, 0);
+    const GLenum attachments[] = {GL_COLOR_ATTACHMENT0,
+                                  GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2, attachments);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+      std::cout << "ERROR::DEFERRED_SHADING::GBUFFER_INCOMPLETE" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  uint32_t createTarget(uint32_t unit, GLenum format) {
+    uint32_t texture;
+    glGenTextures(1, &texture);
+    GLState::shared().bindTexture(unit, GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return texture;
+  }
+
+  void releaseTargets() {
+    if (framebuffer != 0)
+      glDeleteFramebuffers(1, &framebuffer);
+    for (uint32_t *texture : {&albedo_specular, &normal, &depth})
+      if (*texture != 0)
+        GLState::shared().deleteTextures(1, texture);
+    framebuffer = albedo_specular = normal = depth = 0;
+    width = height = 0;
+  }
+};
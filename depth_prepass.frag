@@ -0,0 +1,6 @@
+#version 460
+
+// the depth pre-pass only writes depth, see depth_prepass.hpp
+void main()
+{
+}
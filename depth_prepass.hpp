@@ -0,0 +1,88 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "gpu_timer.hpp"
+#include "render_queue.hpp"
+#include "shader.hpp"
+
+#include <cstdint>
+
+// Depth pre-pass. Opaque meshes are queued twice, into RENDER_PASS_DEPTH
+// with program (depth_prepass.vert/.frag) drawing the position only stream
+// of their GeometryBuffer, and into RENDER_PASS_OPAQUE as usual. begin()
+// turns color writes off for the depth pass and submits a marker sorting
+// ahead of every opaque draw, which turns them back on and switches to
+// GL_EQUAL without depth writes. The shading fragment shader then only runs
+// for the nearest surface of every pixel, whatever the overdraw.
+//
+// The fragment shader invocations of every frame are counted with pipeline
+// statistics queries, per pass with the pre-pass and in total without it.
+class DepthPrepass {
+public:
+  Shader program;
+  bool enabled = false;
+
+  PipelineCounter fragments_without_prepass;
+  PipelineCounter prepass_fragments;
+  PipelineCounter shaded_fragments;
+
+  DepthPrepass() {}
+  DepthPrepass(const DepthPrepass &) = delete;
+  DepthPrepass &operator=(const DepthPrepass &) = delete;
+
+  void init() {
+    program.init("depth_prepass.vert", "depth_prepass.frag");
+    fragments_without_prepass.init(GL_FRAGMENT_SHADER_INVOCATIONS);
+    prepass_fragments.init(GL_FRAGMENT_SHADER_INVOCATIONS);
+    shaded_fragments.init(GL_FRAGMENT_SHADER_INVOCATIONS);
+  }
+
+  // the depth program if the pre-pass is on, for Model::Draw()
+  const Shader *depthProgram() const { return enabled ? &program : NULL; }
+
+  // call right before queue.execute()
+  void begin(RenderQueue &queue) {
+    if (!enabled) {
+      fragments_without_prepass.begin();
+      return;
+    }
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    prepass_fragments.begin();
+    DepthPrepass *prepass = this;
+    queue.submit(RenderQueue::key(RENDER_PASS_OPAQUE, 0, 0, 0, 0),
+                 beginShading, prepass);
+  }
+
+  // call right after queue.execute(), restores the default depth state
+  void end() {
+    if (!enabled) {
+      fragments_without_prepass.end();
+      return;
+    }
+    shaded_fragments.end();
+    glDepthMask(GL_TRUE);
+    glDepthFunc(GL_LESS);
+  }
+
+  void release() {
+    fragments_without_prepass.release();
+    prepass_fragments.release();
+    shaded_fragments.release();
+    if (program.ID != 0)
+      GLState::shared().deleteProgram(program.ID);
+    program.ID = 0;
+  }
+
+private:
+  // the marker between the depth and the opaque pass, program 0 sorts it
+  // first
+  static void beginShading(const void *payload) {
+    DepthPrepass &prepass = **static_cast<DepthPrepass *const *>(payload);
+    prepass.prepass_fragments.end();
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_EQUAL);
+    prepass.shaded_fragments.begin();
+  }
+};
@@ -0,0 +1,59 @@
+#version 460
+
+// vertex shader of the depth pre-pass, see depth_prepass.hpp. reads the
+// position only stream and has to give every vertex exactly the depth
+// shader.vert gives it: the main pass only keeps fragments of equal depth.
+// both compute gl_Position with the same expressions and declare it
+// invariant.
+
+layout (location = 0) in vec3 a_pos;
+
+invariant gl_Position;
+
+// per frame camera data, see CameraBlock in uniform_blocks.hpp
+layout (std140, binding = 0) uniform camera_block {
+    mat4 view;
+    mat4 projection;
+    vec3 camera_pos;
+};
+
+// per mesh data, see MeshDrawData in mesh.hpp
+struct DrawData {
+    vec4 position_scale;
+    vec4 position_offset;
+    uint material;
+};
+
+layout (std430, binding = 0) readonly buffer draw_data_buffer {
+    DrawData draws[];
+};
+
+// per instance transforms, see InstanceData in mesh.hpp
+struct InstanceData {
+    mat4 model;
+    mat4 normal_matrix;
+};
+
+layout (std430, binding = 1) readonly buffer instance_data_buffer {
+    InstanceData instances[];
+};
+
+// see shader.vert
+uniform bool gpu_culled;
+
+layout (std430, binding = 3) readonly buffer visible_instance_buffer {
+    uint visible_instances[];
+};
+
+void main()
+{
+    DrawData draw = draws[gl_BaseInstance];
+    uint instance_index = uint(gl_InstanceID);
+    if (gpu_culled)
+        instance_index = visible_instances[instance_index];
+    InstanceData instance = instances[instance_index];
+
+    vec3 pos = draw.position_offset.xyz + a_pos * draw.position_scale.xyz;
+    vec4 world_pos = instance.model * vec4(pos, 1.0);
+    gl_Position = projection * view * world_pos;
+}
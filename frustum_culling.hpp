@@ -0,0 +1,297 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct BoundingBox {
+  glm::vec3 min = glm::vec3(0.0f);
+  glm::vec3 max = glm::vec3(0.0f);
+};
+
+struct BoundingSphere {
+  glm::vec3 center = glm::vec3(0.0f);
+  float radius = 0.0f;
+};
+
+// bounds of the Position of count vertices of any layout
+template <typename VertexT>
+BoundingBox boundingBox(const VertexT *vertices, size_t count) {
+  BoundingBox box;
+  if (count == 0)
+    return box;
+  box.min = box.max = vertices[0].Position;
+  for (size_t i = 1; i < count; i++) {
+    box.min = glm::min(box.min, vertices[i].Position);
+    box.max = glm::max(box.max, vertices[i].Position);
+  }
+  return box;
+}
+
+// sphere around the center of box holding every vertex, tighter than the
+// sphere around the box's corners
+template <typename VertexT>
+BoundingSphere boundingSphere(const VertexT *vertices, size_t count,
+                              const BoundingBox &box) {
+  BoundingSphere sphere;
+  sphere.center = 0.5f * (box.min + box.max);
+  float radius2 = 0.0f;
+  for (size_t i = 0; i < count; i++) {
+    const glm::vec3 d = vertices[i].Position - sphere.center;
+    radius2 = std::max(radius2, glm::dot(d, d));
+  }
+  sphere.radius = std::sqrt(radius2);
+  return sphere;
+}
+
+// sphere moved by model, scaled by the largest scale of its axes
+inline BoundingSphere transformSphere(const BoundingSphere &sphere,
+                                      const glm::mat4 &model) {
+  const float scale2 =
+      std::max({glm::dot(glm::vec3(model[0]), glm::vec3(model[0])),
+                glm::dot(glm::vec3(model[1]), glm::vec3(model[1])),
+                glm::dot(glm::vec3(model[2]), glm::vec3(model[2]))});
+  return {glm::vec3(model * glm::vec4(sphere.center, 1.0f)),
+          sphere.radius * std::sqrt(scale2)};
+}
+
+// world space box around box moved by model (Arvo)
+inline BoundingBox transformBox(const BoundingBox &box,
+                                const glm::mat4 &model) {
+  const glm::vec3 center = 0.5f * (box.min + box.max);
+  const glm::vec3 half = 0.5f * (box.max - box.min);
+  const glm::vec3 moved = glm::vec3(model * glm::vec4(center, 1.0f));
+  glm::vec3 extent(0.0f);
+  for (int column = 0; column < 3; column++)
+    extent += glm::abs(glm::vec3(model[column])) * half[column];
+  return {moved - extent, moved + extent};
+}
+
+// The six clip planes of a projection * view matrix (Gribb/Hartmann), with
+// normalized normals pointing inwards: a point p is inside a plane when
+// dot(plane, vec4(p, 1)) >= 0.
+struct Frustum {
+  glm::vec4 planes[6];
+
+  Frustum() : Frustum(glm::mat4(1.0f)) {}
+
+  explicit Frustum(const glm::mat4 &view_projection) {
+    const glm::mat4 m = glm::transpose(view_projection);
+    planes[0] = m[3] + m[0]; // left
+    planes[1] = m[3] - m[0]; // right
+    planes[2] = m[3] + m[1]; // bottom
+    planes[3] = m[3] - m[1]; // top
+    planes[4] = m[3] + m[2]; // near
+    planes[5] = m[3] - m[2]; // far
+    for (glm::vec4 &plane : planes)
+      plane /= glm::length(glm::vec3(plane));
+  }
+
+  bool visible(const BoundingSphere &sphere) const {
+    for (const glm::vec4 &plane : planes)
+      if (glm::dot(glm::vec3(plane), sphere.center) + plane.w < -sphere.radius)
+        return false;
+    return true;
+  }
+
+  // tests the corner of the box furthest along each plane's normal
+  bool visible(const BoundingBox &box) const {
+    for (const glm::vec4 &plane : planes) {
+      const glm::vec3 corner(plane.x >= 0.0f ? box.max.x : box.min.x,
+                             plane.y >= 0.0f ? box.max.y : box.min.y,
+                             plane.z >= 0.0f ? box.max.z : box.min.z);
+      if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+        return false;
+    }
+    return true;
+  }
+};
+
+// bounding volumes in structure of arrays layout, so the culling functions
+// below can test a register full of them against a plane at once
+struct SphereBatch {
+  std::vector<float> x, y, z, radius;
+
+  size_t size() const { return x.size(); }
+  void clear() {
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+  }
+  void push(const BoundingSphere &sphere) {
+    x.push_back(sphere.center.x);
+    y.push_back(sphere.center.y);
+    z.push_back(sphere.center.z);
+    radius.push_back(sphere.radius);
+  }
+};
+
+struct BoxBatch {
+  std::vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+
+  size_t size() const { return min_x.size(); }
+  void clear() {
+    for (std::vector<float> *v :
+         {&min_x, &min_y, &min_z, &max_x, &max_y, &max_z})
+      v->clear();
+  }
+  void push(const BoundingBox &box) {
+    min_x.push_back(box.min.x);
+    min_y.push_back(box.min.y);
+    min_z.push_back(box.min.z);
+    max_x.push_back(box.max.x);
+    max_y.push_back(box.max.y);
+    max_z.push_back(box.max.z);
+  }
+};
+
+// Lanes of the widest vector unit the build targets: 8 floats with AVX, 4
+// with SSE2 (every x86-64 build), none elsewhere, where only the scalar
+// loops run.
+#if defined(__AVX__)
+constexpr size_t CULL_LANES = 8;
+typedef __m256 CullFloats;
+inline CullFloats cullLoad(const float *p) { return _mm256_loadu_ps(p); }
+inline CullFloats cullSplat(float value) { return _mm256_set1_ps(value); }
+inline CullFloats cullAdd(CullFloats a, CullFloats b) {
+  return _mm256_add_ps(a, b);
+}
+inline CullFloats cullMulAdd(CullFloats a, CullFloats b, CullFloats c) {
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+}
+// bit i set where lane i of a < b
+inline uint32_t cullLessMask(CullFloats a, CullFloats b) {
+  return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+}
+#elif defined(__SSE2__)
+constexpr size_t CULL_LANES = 4;
+typedef __m128 CullFloats;
+inline CullFloats cullLoad(const float *p) { return _mm_loadu_ps(p); }
+inline CullFloats cullSplat(float value) { return _mm_set1_ps(value); }
+inline CullFloats cullAdd(CullFloats a, CullFloats b) {
+  return _mm_add_ps(a, b);
+}
+inline CullFloats cullMulAdd(CullFloats a, CullFloats b, CullFloats c) {
+  return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+inline uint32_t cullLessMask(CullFloats a, CullFloats b) {
+  return _mm_movemask_ps(_mm_cmplt_ps(a, b));
+}
+#else
+constexpr size_t CULL_LANES = 0;
+#endif
+
+// writes the indices of the spheres inside the frustum to visible, which
+// has room for all of them, and returns how many there are
+inline size_t cullSpheresScalar(const Frustum &frustum,
+                                const SphereBatch &spheres, uint32_t *visible,
+                                size_t first = 0) {
+  size_t count = 0;
+  for (size_t i = first; i < spheres.size(); i++) {
+    const BoundingSphere sphere = {
+        glm::vec3(spheres.x[i], spheres.y[i], spheres.z[i]),
+        spheres.radius[i]};
+    if (frustum.visible(sphere))
+      visible[count++] = i;
+  }
+  return count;
+}
+
+inline size_t cullBoxesScalar(const Frustum &frustum, const BoxBatch &boxes,
+                              uint32_t *visible, size_t first = 0) {
+  size_t count = 0;
+  for (size_t i = first; i < boxes.size(); i++) {
+    const BoundingBox box = {
+        glm::vec3(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i]),
+        glm::vec3(boxes.max_x[i], boxes.max_y[i], boxes.max_z[i])};
+    if (frustum.visible(box))
+      visible[count++] = i;
+  }
+  return count;
+}
+
+inline size_t cullSpheres(const Frustum &frustum, const SphereBatch &spheres,
+                          uint32_t *visible) {
+  size_t count = 0, i = 0;
+#if defined(__AVX__) || defined(__SSE2__)
+  constexpr uint32_t ALL_LANES = (1u << CULL_LANES) - 1;
+  const CullFloats zero = cullSplat(0.0f);
+  for (; i + CULL_LANES <= spheres.size(); i += CULL_LANES) {
+    const CullFloats x = cullLoad(&spheres.x[i]);
+    const CullFloats y = cullLoad(&spheres.y[i]);
+    const CullFloats z = cullLoad(&spheres.z[i]);
+    const CullFloats radius = cullLoad(&spheres.radius[i]);
+    uint32_t outside = 0;
+    // outside where the distance to the plane is below -radius
+    for (const glm::vec4 &plane : frustum.planes) {
+      CullFloats distance = cullAdd(radius, cullSplat(plane.w));
+      distance = cullMulAdd(x, cullSplat(plane.x), distance);
+      distance = cullMulAdd(y, cullSplat(plane.y), distance);
+      distance = cullMulAdd(z, cullSplat(plane.z), distance);
+      outside |= cullLessMask(distance, zero);
+      if (outside == ALL_LANES)
+        break;
+    }
+    for (uint32_t inside = ~outside & ALL_LANES; inside != 0;
+         inside &= inside - 1)
+      visible[count++] = i + __builtin_ctz(inside);
+  }
+#endif
+  return count + cullSpheresScalar(frustum, spheres, visible + count, i);
+}
+
+// the corner furthest along a plane's normal is picked per plane, not per
+// box, by choosing between the min and max arrays
+inline size_t cullBoxes(const Frustum &frustum, const BoxBatch &boxes,
+                        uint32_t *visible) {
+  size_t count = 0, i = 0;
+#if defined(__AVX__) || defined(__SSE2__)
+  constexpr uint32_t ALL_LANES = (1u << CULL_LANES) - 1;
+  const std::vector<float> *corner[6][3];
+  for (uint32_t p = 0; p < 6; p++) {
+    const glm::vec4 &plane = frustum.planes[p];
+    corner[p][0] = plane.x >= 0.0f ? &boxes.max_x : &boxes.min_x;
+    corner[p][1] = plane.y >= 0.0f ? &boxes.max_y : &boxes.min_y;
+    corner[p][2] = plane.z >= 0.0f ? &boxes.max_z : &boxes.min_z;
+  }
+  const CullFloats zero = cullSplat(0.0f);
+  for (; i + CULL_LANES <= boxes.size(); i += CULL_LANES) {
+    uint32_t outside = 0;
+    for (uint32_t p = 0; p < 6; p++) {
+      const glm::vec4 &plane = frustum.planes[p];
+      CullFloats distance = cullMulAdd(cullLoad(&(*corner[p][0])[i]),
+                                       cullSplat(plane.x), cullSplat(plane.w));
+      distance = cullMulAdd(cullLoad(&(*corner[p][1])[i]), cullSplat(plane.y),
+                            distance);
+      distance = cullMulAdd(cullLoad(&(*corner[p][2])[i]), cullSplat(plane.z),
+                            distance);
+      outside |= cullLessMask(distance, zero);
+      if (outside == ALL_LANES)
+        break;
+    }
+    for (uint32_t inside = ~outside & ALL_LANES; inside != 0;
+         inside &= inside - 1)
+      visible[count++] = i + __builtin_ctz(inside);
+  }
+#endif
+  return count + cullBoxesScalar(frustum, boxes, visible + count, i);
+}
+
+// drawn and culled counts of one kind of object, culled by the frustum or
+// occluded by something in front
+struct CullCounts {
+  uint64_t visible = 0;
+  uint64_t culled = 0;
+  uint64_t occluded = 0;
+};
@@ -0,0 +1,83 @@
+#version 460
+#extension GL_ARB_bindless_texture : enable
+
+// geometry pass of the deferred shading, see DeferredShading in
+// deferred_shading.hpp. writes the surface of the fragment, lighting it is
+// left to deferred_lighting.frag.
+
+layout (location = 0) in vec3 normal;
+layout (location = 1) in vec3 frag_pos;
+layout (location = 2) in vec2 tex_coords;
+layout (location = 3) flat in uint material_index;
+
+// diffuse texel, specular texel in alpha
+layout (location = 0) out vec4 albedo_specular;
+// octahedral encoded world space normal
+layout (location = 1) out vec2 octahedral_normal;
+
+// textures bound per mesh, used when material_textures is false
+uniform sampler2D texture_diffuse1;
+uniform sampler2D texture_specular1;
+
+// textures of the material at material_index, see material_table.hpp
+uniform bool material_textures;
+
+const int MATERIAL_DIFFUSE = 0;
+const int MATERIAL_SPECULAR = 1;
+
+struct MaterialData {
+    uvec2 handles[2];
+    int arrays[2];
+    int layers[2];
+};
+
+layout (std430, binding = 2) readonly buffer material_buffer {
+    MaterialData materials[];
+};
+
+layout (binding = 8) uniform sampler2DArray texture_arrays[8];
+
+vec4 sample_material(int slot)
+{
+    MaterialData material = materials[material_index];
+#ifdef GL_ARB_bindless_texture
+    if (material.handles[slot] != uvec2(0))
+        return texture(sampler2D(material.handles[slot]), tex_coords);
+#endif
+    int array = material.arrays[slot];
+    if (array < 0)
+        return vec4(1.0);
+    return texture(texture_arrays[array], vec3(tex_coords, material.layers[slot]));
+}
+
+// the unit vector n folded onto the octahedron |x| + |y| + |z| = 1 and
+// unfolded into the square [0, 1]^2
+vec2 octahedral_encode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 folded = n.xy;
+    if (n.z < 0.0)
+        folded = (1.0 - abs(n.yx)) *
+                 vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return folded * 0.5 + 0.5;
+}
+
+void main()
+{
+    // without HAS_SPECULAR_MAP the specular texel is white, like in
+    // shader.frag
+    vec3 diffuse_texel, specular_texel = vec3(1.0);
+    if (material_textures) {
+        diffuse_texel = vec3(sample_material(MATERIAL_DIFFUSE));
+#ifdef HAS_SPECULAR_MAP
+        specular_texel = vec3(sample_material(MATERIAL_SPECULAR));
+#endif
+    } else {
+        diffuse_texel = vec3(texture(texture_diffuse1, tex_coords));
+#ifdef HAS_SPECULAR_MAP
+        specular_texel = vec3(texture(texture_specular1, tex_coords));
+#endif
+    }
+    albedo_specular = vec4(diffuse_texel, specular_texel.r);
+    octahedral_normal = octahedral_encode(normalize(normal));
+}
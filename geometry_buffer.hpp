@@ -0,0 +1,263 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "gl_state.hpp"
+#include "vertex_format.hpp"
+#include "vertex_layout.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Layout of one entry of a GL_DRAW_INDIRECT_BUFFER for
+// glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+  uint32_t count;
+  uint32_t instanceCount;
+  uint32_t firstIndex;
+  int32_t baseVertex;
+  uint32_t baseInstance;
+};
+
+// first fit allocator for ranges of elements, freed ranges are merged with
+// their neighbours
+class RangeAllocator {
+public:
+  constexpr static uint32_t INVALID = std::numeric_limits<uint32_t>::max();
+
+  // returns the offset of the range, or INVALID if nothing fits
+  uint32_t allocate(uint32_t size) {
+    for (auto range = free_ranges.begin(); range != free_ranges.end();
+         ++range) {
+      if (range->second < size)
+        continue;
+      const uint32_t offset = range->first;
+      const uint32_t remaining = range->second - size;
+      free_ranges.erase(range);
+      if (remaining > 0)
+        free_ranges[offset + size] = remaining;
+      return offset;
+    }
+    return INVALID;
+  }
+
+  void free(uint32_t offset, uint32_t size) {
+    if (size == 0)
+      return;
+    auto next = free_ranges.lower_bound(offset);
+    if (next != free_ranges.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == offset) {
+        offset = previous->first;
+        size += previous->second;
+        free_ranges.erase(previous);
+      }
+    }
+    if (next != free_ranges.end() && offset + size == next->first) {
+      size += next->second;
+      free_ranges.erase(next);
+    }
+    free_ranges[offset] = size;
+  }
+
+  // makes [capacity, new_capacity) available
+  void grow(uint32_t new_capacity) {
+    free(capacity, new_capacity - capacity);
+    capacity = new_capacity;
+  }
+
+  void reset() {
+    free_ranges.clear();
+    capacity = 0;
+  }
+
+  uint32_t size() const { return capacity; }
+
+private:
+  // offset -> size
+  std::map<uint32_t, uint32_t> free_ranges;
+  uint32_t capacity = 0;
+};
+
+// where a mesh lives inside a GeometryBuffer. indices are relative to the
+// mesh, the draw adds first_vertex as the base vertex.
+struct GeometryAllocation {
+  uint32_t first_vertex = RangeAllocator::INVALID;
+  uint32_t vertex_count = 0;
+  uint32_t first_index = 0;
+  uint32_t index_count = 0;
+
+  bool valid() const { return first_vertex != RangeAllocator::INVALID; }
+
+  DrawElementsIndirectCommand drawCommand(uint32_t base_instance) const {
+    return {index_count, 1, first_index, int32_t(first_vertex), base_instance};
+  }
+};
+
+// One vertex buffer, one index buffer and one VAO shared by every mesh using
+// the VertexT layout, so any number of meshes can be drawn with a single
+// bind and a single multi draw. The buffers grow (by copying on the GPU) when
+// an allocation doesn't fit.
+//
+// The positions are also split out into a second vertex buffer of PositionT
+// with a VAO of its own over the same index buffer. Depth only passes read
+// that stream, a fraction of the bytes per vertex, with the same draw
+// commands.
+template <typename VertexT> class GeometryBuffer {
+public:
+  constexpr static uint32_t MIN_VERTICES = 1 << 16;
+  constexpr static uint32_t MIN_INDICES = 1 << 18;
+
+  using PositionT = decltype(positionOf(std::declval<const VertexT &>()));
+
+  GeometryBuffer(const GeometryBuffer &) = delete;
+  GeometryBuffer &operator=(const GeometryBuffer &) = delete;
+
+  static GeometryBuffer &shared() {
+    static GeometryBuffer buffer;
+    return buffer;
+  }
+
+  GeometryAllocation allocate(const VertexT *vertices, uint32_t vertex_count,
+                              const uint32_t *indices, uint32_t index_count) {
+    GeometryAllocation allocation;
+    allocation.vertex_count = vertex_count;
+    allocation.index_count = index_count;
+
+    allocation.first_vertex = vertex_ranges.allocate(vertex_count);
+    if (allocation.first_vertex == RangeAllocator::INVALID) {
+      growVertices(vertex_count);
+      allocation.first_vertex = vertex_ranges.allocate(vertex_count);
+    }
+    allocation.first_index = index_ranges.allocate(index_count);
+    if (allocation.first_index == RangeAllocator::INVALID) {
+      growIndices(index_count);
+      allocation.first_index = index_ranges.allocate(index_count);
+    }
+
+    GLState::shared().bindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferSubData(GL_ARRAY_BUFFER,
+                    size_t(allocation.first_vertex) * sizeof(VertexT),
+                    size_t(vertex_count) * sizeof(VertexT), vertices);
+    std::vector<PositionT> positions(vertex_count);
+    for (uint32_t i = 0; i < vertex_count; i++)
+      positions[i] = positionOf(vertices[i]);
+    GLState::shared().bindBuffer(GL_ARRAY_BUFFER, position_VBO);
+    glBufferSubData(GL_ARRAY_BUFFER,
+                    size_t(allocation.first_vertex) * sizeof(PositionT),
+                    size_t(vertex_count) * sizeof(PositionT),
+                    positions.data());
+    GLState::shared().bindBuffer(GL_ARRAY_BUFFER, 0);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, EBO);
+    glBufferSubData(GL_COPY_WRITE_BUFFER,
+                    size_t(allocation.first_index) * sizeof(uint32_t),
+                    size_t(index_count) * sizeof(uint32_t), indices);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return allocation;
+  }
+
+  void free(GeometryAllocation &allocation) {
+    if (!allocation.valid())
+      return;
+    vertex_ranges.free(allocation.first_vertex, allocation.vertex_count);
+    index_ranges.free(allocation.first_index, allocation.index_count);
+    allocation = GeometryAllocation();
+  }
+
+  void bind() const { GLState::shared().bindVertexArray(VAO); }
+  uint32_t vertexArray() const { return VAO; }
+
+  // the VAO of the position only stream
+  void bindPositions() const {
+    GLState::shared().bindVertexArray(position_VAO);
+  }
+  uint32_t positionVertexArray() const { return position_VAO; }
+
+  // deletes the GL objects, call before the context is destroyed
+  void release() {
+    for (uint32_t *vertex_array : {&VAO, &position_VAO})
+      if (*vertex_array != 0)
+        GLState::shared().deleteVertexArrays(1, vertex_array);
+    for (uint32_t *buffer : {&VBO, &position_VBO, &EBO})
+      if (*buffer != 0)
+        GLState::shared().deleteBuffers(1, buffer);
+    VAO = VBO = EBO = position_VAO = position_VBO = 0;
+    vertex_ranges.reset();
+    index_ranges.reset();
+  }
+
+private:
+  uint32_t VAO = 0, VBO = 0, EBO = 0;
+  uint32_t position_VAO = 0, position_VBO = 0;
+  RangeAllocator vertex_ranges;
+  RangeAllocator index_ranges;
+
+  GeometryBuffer() {}
+
+  // replaces buffer with a bigger one holding the same data
+  static void resize(uint32_t &buffer, size_t old_bytes, size_t new_bytes) {
+    uint32_t resized;
+    glGenBuffers(1, &resized);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, resized);
+    glBufferData(GL_COPY_WRITE_BUFFER, new_bytes, NULL, GL_STATIC_DRAW);
+    if (buffer != 0) {
+      GLState::shared().bindBuffer(GL_COPY_READ_BUFFER, buffer);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                          old_bytes);
+      GLState::shared().bindBuffer(GL_COPY_READ_BUFFER, 0);
+      GLState::shared().deleteBuffers(1, &buffer);
+    }
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    buffer = resized;
+  }
+
+  static uint32_t grownCapacity(uint32_t capacity, uint32_t needed,
+                                uint32_t minimum) {
+    return std::max({capacity * 2, capacity + needed, minimum});
+  }
+
+  void growVertices(uint32_t needed) {
+    const uint32_t capacity = vertex_ranges.size();
+    const uint32_t grown = grownCapacity(capacity, needed, MIN_VERTICES);
+    resize(VBO, size_t(capacity) * sizeof(VertexT),
+           size_t(grown) * sizeof(VertexT));
+    resize(position_VBO, size_t(capacity) * sizeof(PositionT),
+           size_t(grown) * sizeof(PositionT));
+    vertex_ranges.grow(grown);
+    setupVertexArray();
+  }
+
+  void growIndices(uint32_t needed) {
+    const uint32_t capacity = index_ranges.size();
+    const uint32_t grown = grownCapacity(capacity, needed, MIN_INDICES);
+    resize(EBO, size_t(capacity) * sizeof(uint32_t),
+           size_t(grown) * sizeof(uint32_t));
+    index_ranges.grow(grown);
+    setupVertexArray();
+  }
+
+  // points the VAOs at the current buffers
+  void setupVertexArray() {
+    setupVertexArray<VertexT>(VAO, VBO);
+    setupVertexArray<PositionT>(position_VAO, position_VBO);
+  }
+
+  template <typename LayoutT>
+  void setupVertexArray(uint32_t &vertex_array, uint32_t vertex_buffer) {
+    if (vertex_array == 0)
+      glGenVertexArrays(1, &vertex_array);
+    GLState::shared().bindVertexArray(vertex_array);
+    if (vertex_buffer != 0) {
+      GLState::shared().bindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+      setupVertexAttributes<LayoutT>();
+      GLState::shared().bindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    GLState::shared().bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    GLState::shared().bindVertexArray(0);
+  }
+};
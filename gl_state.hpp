@@ -0,0 +1,347 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <unordered_map>
+
+// glProgramUniform wrappers, one per type a Uniform can be
+inline void setUniform(GLuint program, GLint location, bool value) {
+  glProgramUniform1i(program, location, (int)value);
+}
+inline void setUniform(GLuint program, GLint location, int value) {
+  glProgramUniform1i(program, location, value);
+}
+inline void setUniform(GLuint program, GLint location, float value) {
+  glProgramUniform1f(program, location, value);
+}
+inline void setUniform(GLuint program, GLint location, const glm::vec2 &value) {
+  glProgramUniform2fv(program, location, 1, &value[0]);
+}
+inline void setUniform(GLuint program, GLint location, const glm::vec3 &value) {
+  glProgramUniform3fv(program, location, 1, &value[0]);
+}
+inline void setUniform(GLuint program, GLint location, const glm::vec4 &value) {
+  glProgramUniform4fv(program, location, 1, &value[0]);
+}
+inline void setUniform(GLuint program, GLint location, const glm::mat2 &mat) {
+  glProgramUniformMatrix2fv(program, location, 1, GL_FALSE, &mat[0][0]);
+}
+inline void setUniform(GLuint program, GLint location, const glm::mat3 &mat) {
+  glProgramUniformMatrix3fv(program, location, 1, GL_FALSE, &mat[0][0]);
+}
+inline void setUniform(GLuint program, GLint location, const glm::mat4 &mat) {
+  glProgramUniformMatrix4fv(program, location, 1, GL_FALSE, &mat[0][0]);
+}
+
+// last value set on a uniform, size 0 until the first set
+struct UniformValue {
+  uint8_t bytes[sizeof(glm::mat4)];
+  uint32_t size = 0;
+};
+
+// cached uniform values of one program name. records are never erased, so
+// the pointers handed out into them stay valid; forgetting the program bumps
+// generation instead, which tells handles resolved before that they're stale
+struct ProgramUniforms {
+  uint32_t generation = 0;
+  std::unordered_map<GLint, UniformValue> values;
+};
+
+// Shadow copy of the GL state the renderer touches every frame: the program,
+// the vertex array, texture units, buffer bindings and uniform values. Calls
+// that wouldn't change anything are dropped. Everything binding or deleting
+// these objects has to go through here, or the shadow copy goes stale.
+//
+// Element array buffer bindings are vertex array state and always issued.
+// With filtering off every call is issued, the counters still tell how many
+// of them were redundant, so both can be compared.
+class GLState {
+public:
+  constexpr static uint32_t MAX_TEXTURE_UNITS = 32;
+
+  // calls of one kind that reached GL, and calls that wouldn't have changed
+  // anything (which don't reach GL while filtering)
+  struct Counter {
+    uint64_t issued = 0;
+    uint64_t redundant = 0;
+  };
+  struct Counters {
+    Counter programs;
+    Counter vertex_arrays;
+    Counter textures;
+    Counter buffers;
+    Counter uniforms;
+  };
+
+  bool filtering = true;
+  // calls of the frame in progress, of the last finished frame, and of all
+  // finished frames
+  Counters frame, last_frame, total;
+  uint64_t frames = 0;
+
+  GLState(const GLState &) = delete;
+  GLState &operator=(const GLState &) = delete;
+
+  static GLState &shared() {
+    static GLState state;
+    return state;
+  }
+
+  // closes the counters of the previous frame
+  void beginFrame() {
+    if (in_frame) {
+      last_frame = frame;
+      add(total.programs, frame.programs);
+      add(total.vertex_arrays, frame.vertex_arrays);
+      add(total.textures, frame.textures);
+      add(total.buffers, frame.buffers);
+      add(total.uniforms, frame.uniforms);
+      frames++;
+    }
+    frame = Counters();
+    in_frame = true;
+  }
+
+  void useProgram(GLuint program) {
+    if (skip(program_bound == program, frame.programs))
+      return;
+    glUseProgram(program);
+    program_bound = program;
+  }
+
+  void bindVertexArray(GLuint vertex_array) {
+    if (skip(vertex_array_bound == vertex_array, frame.vertex_arrays))
+      return;
+    glBindVertexArray(vertex_array);
+    vertex_array_bound = vertex_array;
+  }
+
+  // binds the texture to target on the unit, GL_TEXTURE_2D and
+  // GL_TEXTURE_2D_ARRAY are tracked
+  void bindTexture(uint32_t unit, GLenum target, GLuint texture) {
+    GLuint *bound = unit < MAX_TEXTURE_UNITS ? textureSlot(unit, target) : NULL;
+    if (skip(bound != NULL && *bound == texture, frame.textures))
+      return;
+    if (active_unit != unit) {
+      glActiveTexture(GL_TEXTURE0 + unit);
+      active_unit = unit;
+      frame.textures.issued++;
+    }
+    glBindTexture(target, texture);
+    if (bound != NULL)
+      *bound = texture;
+  }
+
+  void bindBuffer(GLenum target, GLuint buffer) {
+    GLuint *bound = bufferSlot(target);
+    if (skip(bound != NULL && *bound == buffer, frame.buffers))
+      return;
+    glBindBuffer(target, buffer);
+    if (bound != NULL)
+      *bound = buffer;
+  }
+
+  // glBindBufferBase/glBindBufferRange for uniform and shader storage
+  // blocks, size 0 binds the whole buffer. both also bind the generic
+  // binding point of the target.
+  void bindBufferRange(GLenum target, uint32_t index, GLuint buffer,
+                       GLintptr offset = 0, GLsizeiptr size = 0) {
+    IndexedBinding *bound = indexedSlot(target, index);
+    if (skip(bound != NULL && bound->buffer == buffer &&
+                 bound->offset == offset && bound->size == size,
+             frame.buffers))
+      return;
+    if (size == 0)
+      glBindBufferBase(target, index, buffer);
+    else
+      glBindBufferRange(target, index, buffer, offset, size);
+    if (bound != NULL)
+      *bound = {buffer, offset, size};
+    if (GLuint *generic = bufferSlot(target))
+      *generic = buffer;
+  }
+
+  // sets the uniform through its cached value, cache comes from
+  // uniformCache() and may be NULL for uniforms the linker dropped
+  template <typename T>
+  void uniform(GLuint program, GLint location, UniformValue *cache,
+               const T &value) {
+    static_assert(sizeof(T) <= sizeof(UniformValue::bytes),
+                  "uniform value too big to cache");
+    if (location < 0)
+      return;
+    // bools are set as ints
+    typedef std::conditional_t<std::is_same_v<T, bool>, int, T> Stored;
+    const Stored stored = value;
+    if (skip(cache != NULL && cache->size == sizeof(Stored) &&
+                 std::memcmp(cache->bytes, &stored, sizeof(Stored)) == 0,
+             frame.uniforms))
+      return;
+    setUniform(program, location, stored);
+    if (cache != NULL) {
+      std::memcpy(cache->bytes, &stored, sizeof(Stored));
+      cache->size = sizeof(Stored);
+    }
+  }
+
+  template <typename T>
+  void uniform(GLuint program, GLint location, const T &value) {
+    uniform(program, location, uniformCache(program, location), value);
+  }
+
+  // the cached value of a uniform, the pointer lives as long as GLState but
+  // only means something until the program is deleted or forgotten
+  UniformValue *uniformCache(GLuint program, GLint location) {
+    if (location < 0)
+      return NULL;
+    return &uniform_values[program].values[location];
+  }
+
+  // bumped every time the program is forgotten, handles compare it with the
+  // generation they were resolved in
+  const uint32_t *programGeneration(GLuint program) {
+    return &uniform_values[program].generation;
+  }
+
+  // drops the cached uniforms of a program, for programs created under the
+  // name of a deleted one. the storage is kept, live handles point into it
+  void forgetProgram(GLuint program) {
+    ProgramUniforms &record = uniform_values[program];
+    record.generation++;
+    for (auto &value : record.values)
+      value.second.size = 0;
+  }
+
+  void deleteProgram(GLuint program) {
+    if (program_bound == program)
+      program_bound = 0;
+    forgetProgram(program);
+    glDeleteProgram(program);
+  }
+
+  void deleteVertexArrays(GLsizei count, const GLuint *vertex_arrays) {
+    for (GLsizei i = 0; i < count; i++)
+      if (vertex_array_bound == vertex_arrays[i])
+        vertex_array_bound = 0;
+    glDeleteVertexArrays(count, vertex_arrays);
+  }
+
+  void deleteTextures(GLsizei count, const GLuint *textures) {
+    for (GLsizei i = 0; i < count; i++)
+      for (GLuint *unit : texture_units)
+        for (uint32_t t = 0; t < TEXTURE_TARGETS; t++)
+          if (unit[t] == textures[i])
+            unit[t] = 0;
+    glDeleteTextures(count, textures);
+  }
+
+  void deleteBuffers(GLsizei count, const GLuint *buffers) {
+    for (GLsizei i = 0; i < count; i++) {
+      for (BufferBinding &binding : buffer_bindings)
+        if (binding.buffer == buffers[i])
+          binding.buffer = 0;
+      for (IndexedBinding *bindings : {uniform_blocks, storage_blocks})
+        for (uint32_t index = 0; index < MAX_BLOCK_BINDINGS; index++)
+          if (bindings[index].buffer == buffers[i])
+            bindings[index] = IndexedBinding();
+    }
+    glDeleteBuffers(count, buffers);
+  }
+
+  // prints the average calls per frame
+  void printStatistics() const {
+    if (frames == 0)
+      return;
+    std::cout << "GL_STATE:: calls per frame issued/redundant over " << frames
+              << " frames" << (filtering ? "" : " (filtering off)") << ": ";
+    print("programs", total.programs);
+    print(", vertex arrays", total.vertex_arrays);
+    print(", textures", total.textures);
+    print(", buffers", total.buffers);
+    print(", uniforms", total.uniforms);
+    std::cout << std::endl;
+  }
+
+private:
+  constexpr static uint32_t TEXTURE_TARGETS = 2;
+  constexpr static uint32_t MAX_BLOCK_BINDINGS = 16;
+
+  struct BufferBinding {
+    GLenum target;
+    GLuint buffer;
+  };
+  struct IndexedBinding {
+    GLuint buffer = 0;
+    GLintptr offset = 0;
+    GLsizeiptr size = 0;
+  };
+
+  bool in_frame = false;
+  GLuint program_bound = 0;
+  GLuint vertex_array_bound = 0;
+  uint32_t active_unit = 0;
+  GLuint texture_units[MAX_TEXTURE_UNITS][TEXTURE_TARGETS] = {};
+  // the element array buffer is left out, it belongs to the vertex array
+  BufferBinding buffer_bindings[9] = {
+      {GL_ARRAY_BUFFER, 0},         {GL_COPY_READ_BUFFER, 0},
+      {GL_COPY_WRITE_BUFFER, 0},    {GL_DRAW_INDIRECT_BUFFER, 0},
+      {GL_PIXEL_UNPACK_BUFFER, 0},  {GL_SHADER_STORAGE_BUFFER, 0},
+      {GL_UNIFORM_BUFFER, 0},       {GL_DISPATCH_INDIRECT_BUFFER, 0},
+      {GL_PARAMETER_BUFFER, 0}};
+  IndexedBinding uniform_blocks[MAX_BLOCK_BINDINGS];
+  IndexedBinding storage_blocks[MAX_BLOCK_BINDINGS];
+  // program -> location -> value
+  std::unordered_map<GLuint, ProgramUniforms> uniform_values;
+
+  GLState() {}
+
+  // counts the call, true if it can be dropped
+  bool skip(bool redundant, Counter &counter) {
+    if (redundant)
+      counter.redundant++;
+    if (redundant && filtering)
+      return true;
+    counter.issued++;
+    return false;
+  }
+
+  GLuint *textureSlot(uint32_t unit, GLenum target) {
+    if (target == GL_TEXTURE_2D)
+      return &texture_units[unit][0];
+    if (target == GL_TEXTURE_2D_ARRAY)
+      return &texture_units[unit][1];
+    return NULL;
+  }
+
+  GLuint *bufferSlot(GLenum target) {
+    for (BufferBinding &binding : buffer_bindings)
+      if (binding.target == target)
+        return &binding.buffer;
+    return NULL;
+  }
+
+  IndexedBinding *indexedSlot(GLenum target, uint32_t index) {
+    if (index >= MAX_BLOCK_BINDINGS)
+      return NULL;
+    if (target == GL_UNIFORM_BUFFER)
+      return &uniform_blocks[index];
+    if (target == GL_SHADER_STORAGE_BUFFER)
+      return &storage_blocks[index];
+    return NULL;
+  }
+
+  static void add(Counter &to, const Counter &from) {
+    to.issued += from.issued;
+    to.redundant += from.redundant;
+  }
+
+  void print(const char *name, const Counter &counter) const {
+    std::cout << name << " " << double(counter.issued) / frames << "/"
+              << double(counter.redundant) / frames;
+  }
+};
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "frustum_culling.hpp"
+#include "geometry_buffer.hpp"
+#include "gl_state.hpp"
+#include "mesh.hpp"
+#include "ring_buffer.hpp"
+#include "shader.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Bindings of cull.comp, which reads the instances from INSTANCE_DATA_BINDING
+// like shader.vert does. shader.vert finds the instances left through
+// VISIBLE_INSTANCE_BINDING.
+//
+//   layout (std140, binding = 2) uniform cull_block          -> CullBlock
+//   layout (std430, binding = 3) buffer visible_instance_buffer -> uint[]
+//   layout (std430, binding = 4) buffer mesh_cull_buffer     -> MeshCullData[]
+//   layout (std430, binding = 5) buffer draw_command_buffer  -> commands
+//   layout (std430, binding = 6) buffer cull_count_buffer    -> CullCountBlock
+constexpr uint32_t CULL_BLOCK_BINDING = 2;
+constexpr uint32_t VISIBLE_INSTANCE_BINDING = 3;
+constexpr uint32_t MESH_CULL_BINDING = 4;
+constexpr uint32_t DRAW_COMMAND_BINDING = 5;
+constexpr uint32_t CULL_COUNT_BINDING = 6;
+// texture unit of the depth pyramid, below the MaterialTable's arrays
+constexpr uint32_t DEPTH_PYRAMID_UNIT = 7;
+
+// per dispatch data of cull.comp
+struct CullBlock {
+  glm::mat4 pyramid_view_projection;
+  glm::vec4 planes[6];
+  // model space bounds of all meshes
+  glm::vec4 bounds_min;
+  glm::vec4 bounds_max;
+  glm::vec2 pyramid_size;
+  // 0 while there is no pyramid, nothing is occluded then
+  uint32_t pyramid_levels;
+  uint32_t instance_count;
+  uint32_t mesh_count;
+  uint32_t mesh_cull_instances;
+  uint32_t padding[2];
+};
+
+static_assert(sizeof(CullBlock) == 224, "cull_block isn't std140");
+static_assert(offsetof(CullBlock, pyramid_size) == 192,
+              "cull_block isn't std140");
+
+// a mesh as cull.comp sees it: its model space bounds and the draw command
+// it gets if it is visible, appended to the commands of its batch
+struct MeshCullData {
+  glm::vec4 bounds_min;
+  glm::vec4 bounds_max;
+  uint32_t index_count;
+  uint32_t first_index;
+  int32_t base_vertex;
+  uint32_t base_instance;
+  uint32_t batch;
+  uint32_t first_command;
+  uint32_t padding[2];
+};
+
+static_assert(sizeof(MeshCullData) == 64, "MeshCullData isn't std430");
+
+// what cull.comp counted, followed by the draw count of every batch
+struct CullCountBlock {
+  uint32_t visible;
+  uint32_t culled;
+  uint32_t occluded;
+  uint32_t mesh_culled;
+  uint32_t mesh_occluded;
+};
+
+// The camera the GPU culls against and the depth pyramid of the last frame
+// it saw. After a frame is drawn buildPyramid() copies its depth buffer and
+// reduces it into a mip chain of the farthest depth, the frame after tests
+// instance and mesh bounds against it with the camera that drew it. Anything
+// behind the depth of the last frame is dropped, what only just came into
+// view is drawn since the last frame has no depth for it.
+class GPUCulling {
+public:
+  // compute programs, built by init()
+  Shader cull_program;
+  Shader pyramid_program;
+
+  // R32F mip chain, level 0 is the depth buffer of pyramid_width x
+  // pyramid_height padded to powers of two
+  uint32_t pyramid = 0;
+  uint32_t pyramid_width = 0, pyramid_height = 0, pyramid_levels = 0;
+  // camera of the current frame and of the one the pyramid comes from
+  glm::mat4 view_projection = glm::mat4(1.0f);
+  glm::mat4 pyramid_view_projection = glm::mat4(1.0f);
+  Frustum frustum;
+
+  GPUCulling(const GPUCulling &) = delete;
+  GPUCulling &operator=(const GPUCulling &) = delete;
+
+  static GPUCulling &shared() {
+    static GPUCulling culling;
+    return culling;
+  }
+
+  void init() {
+    if (cull_program.ID != 0)
+      return;
+    cull_program.initCompute("cull.comp");
+    pyramid_program.initCompute("depth_pyramid.comp");
+    mesh_pass = cull_program.uniform<bool>("mesh_pass");
+    from_depth_buffer = pyramid_program.uniform<bool>("from_depth_buffer");
+  }
+
+  void beginFrame(const glm::mat4 &camera) {
+    view_projection = camera;
+    frustum = Frustum(camera);
+  }
+
+  // copies the depth buffer of the read framebuffer, width x height, and
+  // builds the pyramid from it. call after the frame's draws.
+  void buildPyramid(uint32_t width, uint32_t height) {
+    if (width == 0 || height == 0)
+      return;
+    if (width != pyramid_width || height != pyramid_height)
+      allocatePyramid(width, height);
+    glCopyTextureSubImage2D(depth_copy, 0, 0, 0, 0, 0, width, height);
+
+    pyramid_program.use();
+    GLState::shared().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D,
+                                  depth_copy);
+    for (uint32_t level = 0; level < pyramid_levels; level++) {
+      from_depth_buffer.set(level == 0);
+      glBindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY,
+                         GL_R32F);
+      if (level > 0)
+        glBindImageTexture(1, pyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY,
+                           GL_R32F);
+      const uint32_t level_width = std::max(1u, padded_width >> level);
+      const uint32_t level_height = std::max(1u, padded_height >> level);
+      glDispatchCompute((level_width + 7) / 8, (level_height + 7) / 8, 1);
+      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    pyramid_view_projection = view_projection;
+    pyramid_ready = true;
+  }
+
+  // cull_block of a model, bounds and counts are left to the caller
+  CullBlock cullBlock() const {
+    CullBlock block = {};
+    block.pyramid_view_projection = pyramid_view_projection;
+    for (uint32_t i = 0; i < 6; i++)
+      block.planes[i] = frustum.planes[i];
+    block.pyramid_size = glm::vec2(pyramid_width, pyramid_height);
+    block.pyramid_levels = pyramid_ready ? pyramid_levels : 0;
+    return block;
+  }
+
+  // binds the pyramid for cull.comp and cull_program with the instance pass
+  // or the mesh pass selected
+  void bindCullProgram(bool meshes) const {
+    cull_program.use();
+    GLState::shared().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D,
+                                  pyramid);
+    mesh_pass.set(meshes);
+  }
+
+  void shutdown() {
+    releasePyramid();
+    if (cull_program.ID != 0) {
+      GLState::shared().deleteProgram(cull_program.ID);
+      GLState::shared().deleteProgram(pyramid_program.ID);
+    }
+    cull_program.ID = pyramid_program.ID = 0;
+  }
+
+private:
+  Uniform<bool> mesh_pass;
+  Uniform<bool> from_depth_buffer;
+  // level 0 of the pyramid is read from here, depth formats can't be images
+  uint32_t depth_copy = 0;
+  // size of level 0, with powers of two texel t of a level covers exactly
+  // texels 2t and 2t + 1 of the one below
+  uint32_t padded_width = 0, padded_height = 0;
+  bool pyramid_ready = false;
+
+  GPUCulling() {}
+
+  static uint32_t powerOfTwo(uint32_t size) {
+    uint32_t power = 1;
+    while (power < size)
+      power *= 2;
+    return power;
+  }
+
+  void allocatePyramid(uint32_t width, uint32_t height) {
+    releasePyramid();
+    pyramid_width = width;
+    pyramid_height = height;
+    padded_width = powerOfTwo(width);
+    padded_height = powerOfTwo(height);
+    pyramid_levels = 1;
+    while ((std::max(padded_width, padded_height) >> pyramid_levels) > 0)
+      pyramid_levels++;
+
+    glGenTextures(1, &depth_copy);
+    GLState::shared().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D,
+                                  depth_copy);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+    setNearestFiltering();
+
+    glGenTextures(1, &pyramid);
+    GLState::shared().bindTexture(DEPTH_PYRAMID_UNIT, GL_TEXTURE_2D,
+                                  pyramid);
+    glTexStorage2D(GL_TEXTURE_2D, pyramid_levels, GL_R32F, padded_width,
+                   padded_height);
+    setNearestFiltering();
+  }
+
+  static void setNearestFiltering() {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+
+  void releasePyramid() {
+    for (uint32_t *texture : {&depth_copy, &pyramid})
+      if (*texture != 0)
+        GLState::shared().deleteTextures(1, texture);
+    depth_copy = pyramid = 0;
+    pyramid_width = pyramid_height = pyramid_levels = 0;
+    padded_width = padded_height = 0;
+    pyramid_ready = false;
+  }
+};
+
+// The GPU side of culling the instances of one model. cull() runs cull.comp
+// over instances already in a GL buffer: one pass tests every instance and
+// appends the visible ones to visible_buffer, a second one tests the meshes
+// while few instances are left and appends a draw command per visible mesh
+// to the commands of its batch in command_buffer, counting them in
+// count_buffer. The batches are drawn with glMultiDrawElementsIndirectCount
+// reading their count from there, the CPU never sees what was culled and its
+// cost doesn't depend on the number of instances.
+class GPUCullSet {
+public:
+  // meshes are culled one by one while at most this many instances are
+  // visible, as Model::Draw() does on the CPU
+  uint32_t mesh_cull_instances = 16;
+
+  uint32_t mesh_buffer = 0;
+  uint32_t command_buffer = 0;
+  // CullCountBlock followed by a draw count per batch
+  uint32_t count_buffer = 0;
+  uint32_t visible_buffer = 0;
+  uint32_t mesh_count = 0, batch_count = 0;
+  // instances visible_buffer has room for
+  uint32_t visible_capacity = 0;
+  BoundingBox bounds;
+
+  GPUCullSet() {}
+  GPUCullSet(const GPUCullSet &) = delete;
+  GPUCullSet &operator=(const GPUCullSet &) = delete;
+
+  bool empty() const { return mesh_buffer == 0; }
+
+  // meshes of batch b have first_command set to the first command of the
+  // batch, command_count is the number of commands of all batches
+  void init(const std::vector<MeshCullData> &meshes, uint32_t batches,
+            uint32_t command_count, const BoundingBox &model_bounds) {
+    release();
+    GPUCulling::shared().init();
+    mesh_count = meshes.size();
+    batch_count = batches;
+    bounds = model_bounds;
+    mesh_buffer = createBuffer(meshes.size() * sizeof(MeshCullData),
+                               meshes.data());
+    command_buffer = createBuffer(
+        command_count * sizeof(DrawElementsIndirectCommand), NULL);
+    count_buffer = createBuffer(countOffset(batch_count), NULL);
+  }
+
+  // culls instance_count instances of the buffer against the camera of
+  // GPUCulling, the results are ready for the draws issued after it
+  void cull(RingBuffer &frame_data, uint32_t instance_buffer,
+            uint32_t instance_count) {
+    if (instance_count > visible_capacity) {
+      if (visible_buffer != 0)
+        GLState::shared().deleteBuffers(1, &visible_buffer);
+      visible_capacity = std::max(instance_count, 2 * visible_capacity);
+      visible_buffer =
+          createBuffer(visible_capacity * sizeof(uint32_t), NULL);
+    }
+
+    GLState::shared().bindBuffer(GL_PARAMETER_BUFFER, count_buffer);
+    glClearBufferData(GL_PARAMETER_BUFFER, GL_R32UI, GL_RED_INTEGER,
+                      GL_UNSIGNED_INT, NULL);
+
+    CullBlock block = GPUCulling::shared().cullBlock();
+    block.bounds_min = glm::vec4(bounds.min, 1.0f);
+    block.bounds_max = glm::vec4(bounds.max, 1.0f);
+    block.instance_count = instance_count;
+    block.mesh_count = mesh_count;
+    block.mesh_cull_instances = mesh_cull_instances;
+    if (!frame_data.bindUniform(CULL_BLOCK_BINDING, block))
+      return;
+    GLState &state = GLState::shared();
+    state.bindBufferRange(GL_SHADER_STORAGE_BUFFER, INSTANCE_DATA_BINDING,
+                          instance_buffer);
+    state.bindBufferRange(GL_SHADER_STORAGE_BUFFER, VISIBLE_INSTANCE_BINDING,
+                          visible_buffer);
+    state.bindBufferRange(GL_SHADER_STORAGE_BUFFER, MESH_CULL_BINDING,
+                          mesh_buffer);
+    state.bindBufferRange(GL_SHADER_STORAGE_BUFFER, DRAW_COMMAND_BINDING,
+                          command_buffer);
+    state.bindBufferRange(GL_SHADER_STORAGE_BUFFER, CULL_COUNT_BINDING,
+                          count_buffer);
+
+    GPUCulling::shared().bindCullProgram(false);
+    glDispatchCompute((instance_count + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    GPUCulling::shared().bindCullProgram(true);
+    glDispatchCompute((mesh_count + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+  // offset into count_buffer of the draw count of a batch
+  static GLintptr countOffset(uint32_t batch) {
+    return sizeof(CullCountBlock) + batch * sizeof(uint32_t);
+  }
+
+  // counts of the last cull(), meshes count once per instanced draw. waits
+  // for the GPU, for statistics only.
+  void readCounts(CullCounts &instances, CullCounts &meshes) const {
+    instances = meshes = CullCounts();
+    if (empty())
+      return;
+    std::vector<uint32_t> counts(countOffset(batch_count) / sizeof(uint32_t));
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    GLState::shared().bindBuffer(GL_PARAMETER_BUFFER, count_buffer);
+    glGetBufferSubData(GL_PARAMETER_BUFFER, 0,
+                       counts.size() * sizeof(uint32_t), counts.data());
+    CullCountBlock block;
+    std::memcpy(&block, counts.data(), sizeof(block));
+    instances.visible = block.visible;
+    instances.culled = block.culled;
+    instances.occluded = block.occluded;
+    for (uint32_t batch = 0; batch < batch_count; batch++)
+      meshes.visible += counts[countOffset(batch) / sizeof(uint32_t)];
+    meshes.culled = block.mesh_culled;
+    meshes.occluded = block.mesh_occluded;
+    // nothing is drawn without a visible instance
+    if (block.visible == 0)
+      meshes.culled = mesh_count;
+  }
+
+  void release() {
+    for (uint32_t *buffer :
+         {&mesh_buffer, &command_buffer, &count_buffer, &visible_buffer})
+      if (*buffer != 0)
+        GLState::shared().deleteBuffers(1, buffer);
+    mesh_buffer = command_buffer = count_buffer = visible_buffer = 0;
+    mesh_count = batch_count = visible_capacity = 0;
+  }
+
+private:
+  // a buffer only the GPU writes
+  static uint32_t createBuffer(GLsizeiptr size, const void *data) {
+    uint32_t buffer;
+    glGenBuffers(1, &buffer);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, std::max<GLsizeiptr>(size, 4),
+                    data, 0);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return buffer;
+  }
+};
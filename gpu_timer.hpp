@@ -0,0 +1,118 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "ring_buffer.hpp"
+
+#include <cstdint>
+
+// Time the GPU spends between begin() and end(), measured with a pair of
+// timestamp queries per frame. The queries of a frame are read when their
+// slot comes around again, RingBuffer::FRAMES frames later, by then the GPU
+// is done with them and reading them doesn't wait. Timers can't nest with
+// GL_TIME_ELAPSED, timestamps can, so spans may overlap other timers.
+class GPUTimer {
+public:
+  constexpr static uint32_t FRAMES = RingBuffer::FRAMES;
+
+  // spans read back so far and their sum
+  uint64_t samples = 0;
+  double total_ms = 0.0;
+
+  GPUTimer() {}
+  GPUTimer(const GPUTimer &) = delete;
+  GPUTimer &operator=(const GPUTimer &) = delete;
+
+  void init() { glGenQueries(2 * FRAMES, &queries[0][0]); }
+
+  void begin() {
+    slot = (slot + 1) % FRAMES;
+    if (pending[slot])
+      collect(slot);
+    glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+  }
+
+  void end() {
+    glQueryCounter(queries[slot][1], GL_TIMESTAMP);
+    pending[slot] = true;
+  }
+
+  double averageMs() const { return samples > 0 ? total_ms / samples : 0.0; }
+
+  void release() {
+    if (queries[0][0] != 0)
+      glDeleteQueries(2 * FRAMES, &queries[0][0]);
+    queries[0][0] = 0;
+  }
+
+private:
+  uint32_t queries[FRAMES][2] = {};
+  bool pending[FRAMES] = {};
+  uint32_t slot = 0;
+
+  void collect(uint32_t slot) {
+    GLuint64 start = 0, end = 0;
+    glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &start);
+    glGetQueryObjectui64v(queries[slot][1], GL_QUERY_RESULT, &end);
+    pending[slot] = false;
+    samples++;
+    total_ms += double(end - start) / 1e6;
+  }
+};
+
+// Sum of a pipeline statistic, e.g. GL_FRAGMENT_SHADER_INVOCATIONS, over the
+// commands between begin() and end(), read back FRAMES frames later like
+// GPUTimer. One query per target can be active at a time.
+class PipelineCounter {
+public:
+  constexpr static uint32_t FRAMES = RingBuffer::FRAMES;
+
+  GLenum target = GL_FRAGMENT_SHADER_INVOCATIONS;
+  // spans read back so far, the sum of their counts and the last one
+  uint64_t samples = 0;
+  uint64_t total = 0;
+  uint64_t last = 0;
+
+  PipelineCounter() {}
+  PipelineCounter(const PipelineCounter &) = delete;
+  PipelineCounter &operator=(const PipelineCounter &) = delete;
+
+  void init(GLenum statistic) {
+    target = statistic;
+    glGenQueries(FRAMES, queries);
+  }
+
+  void begin() {
+    slot = (slot + 1) % FRAMES;
+    if (pending[slot])
+      collect(slot);
+    glBeginQuery(target, queries[slot]);
+  }
+
+  void end() {
+    glEndQuery(target);
+    pending[slot] = true;
+  }
+
+  double average() const { return samples > 0 ? double(total) / samples : 0.0; }
+
+  void release() {
+    if (queries[0] != 0)
+      glDeleteQueries(FRAMES, queries);
+    queries[0] = 0;
+  }
+
+private:
+  uint32_t queries[FRAMES] = {};
+  bool pending[FRAMES] = {};
+  uint32_t slot = 0;
+
+  void collect(uint32_t slot) {
+    GLuint64 count = 0;
+    glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &count);
+    pending[slot] = false;
+    samples++;
+    total += count;
+    last = count;
+  }
+};
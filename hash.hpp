@@ -0,0 +1,52 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64-bit FNV-1a, used to fingerprint source assets so cached data derived from
+// them can be invalidated when they change.
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+inline uint64_t hashBytes(const void *data, size_t size,
+                          uint64_t hash = FNV_OFFSET_BASIS) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// hashes the whole content of a file, returns 0 if it can't be read
+inline uint64_t hashFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+  if (st.st_size > 0) {
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return 0;
+    }
+    hash = hashBytes(data, st.st_size);
+    munmap(data, st.st_size);
+  }
+  close(fd);
+
+  return hash;
+}
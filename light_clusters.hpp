@@ -0,0 +1,161 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "gl_state.hpp"
+#include "ring_buffer.hpp"
+#include "shader.hpp"
+#include "uniform_blocks.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Bindings of light_clusters.comp and shader.frag, next to those of
+// gpu_culling.hpp
+//
+//   layout (std430, binding = 7) buffer point_light_buffer -> PointLightBlock[]
+//   layout (std430, binding = 8) buffer light_cluster_buffer -> LightCluster[]
+constexpr uint32_t POINT_LIGHT_BINDING = 7;
+constexpr uint32_t LIGHT_CLUSTER_BINDING = 8;
+
+// lights a cluster holds, a fragment never loops over more
+constexpr uint32_t MAX_CLUSTER_LIGHTS = 127;
+
+// the point lights of a cluster as indices into the point light buffer.
+// count is how many touch the cluster, only the first MAX_CLUSTER_LIGHTS of
+// them are kept.
+struct LightCluster {
+  uint32_t count;
+  uint32_t lights[MAX_CLUSTER_LIGHTS];
+};
+
+static_assert(sizeof(LightCluster) == 512, "LightCluster isn't std430");
+
+// distance at which the attenuation of light has brought its brightest
+// color below 5/256, anything further away is left unlit
+inline float pointLightRadius(const PointLightBlock &light) {
+  const glm::vec3 colors = glm::max(light.diffuse, light.specular);
+  const float brightest = std::max({colors.x, colors.y, colors.z});
+  const float threshold = light.constant - 256.0f / 5.0f * brightest;
+  if (threshold >= 0.0f)
+    return 0.0f;
+  if (light.quadratic <= 0.0f)
+    return light.linear > 0.0f ? -threshold / light.linear : 1e30f;
+  return (-light.linear + std::sqrt(light.linear * light.linear -
+                                    4.0f * light.quadratic * threshold)) /
+         (2.0f * light.quadratic);
+}
+
+// Clustered forward lighting. The view frustum is split into a grid of
+// clusters: GRID_X x GRID_Y tiles of the screen, each cut into GRID_Z slices
+// whose depth grows exponentially so far slices aren't much longer than they
+// are wide. Every frame assign() writes the point lights into the frame's
+// region of the RingBuffer and runs light_clusters.comp, which tests the
+// sphere of every light against the view space box of every cluster and
+// lists the lights touching it in cluster_buffer. shader.frag finds its
+// cluster from its pixel and depth and only loops over that list, so the
+// cost of a fragment is bounded by MAX_CLUSTER_LIGHTS whatever the number of
+// lights.
+class LightClusters {
+public:
+  constexpr static uint32_t GRID_X = 16;
+  constexpr static uint32_t GRID_Y = 9;
+  constexpr static uint32_t GRID_Z = 24;
+  constexpr static uint32_t CLUSTERS = GRID_X * GRID_Y * GRID_Z;
+
+  Shader assign_program;
+  uint32_t cluster_buffer = 0;
+
+  LightClusters() {}
+  LightClusters(const LightClusters &) = delete;
+  LightClusters &operator=(const LightClusters &) = delete;
+
+  void init() {
+    assign_program.initCompute("light_clusters.comp");
+    glGenBuffers(1, &cluster_buffer);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, cluster_buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, CLUSTERS * sizeof(LightCluster),
+                    NULL, 0);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+
+  // fills in the cluster grid of block for a width x height framebuffer and
+  // a camera seeing from near to far
+  static void setup(LightBlock &block, uint32_t width, uint32_t height,
+                    float near, float far, uint32_t light_count) {
+    block.cluster_grid = glm::uvec3(GRID_X, GRID_Y, GRID_Z);
+    block.point_light_count = light_count;
+    block.cluster_tile_size =
+        glm::vec2(float(width) / GRID_X, float(height) / GRID_Y);
+    const float depth_range = std::log(far / near);
+    block.cluster_scale = GRID_Z / depth_range;
+    block.cluster_bias = -(GRID_Z * std::log(near)) / depth_range;
+    block.cluster_near = near;
+    block.cluster_far = far;
+  }
+
+  // binds count lights for shader.frag and assigns them to the clusters.
+  // camera_block and a light_block set up with setup() have to be bound.
+  bool assign(RingBuffer &frame_data, const PointLightBlock *lights,
+              uint32_t count) {
+    // the buffer may not be empty, an unused light keeps it bound
+    const PointLightBlock unused = {};
+    if (!frame_data.bindStorage(POINT_LIGHT_BINDING,
+                                count > 0 ? lights : &unused,
+                                std::max(count, 1u)))
+      return false;
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER,
+                                      LIGHT_CLUSTER_BINDING, cluster_buffer);
+    assign_program.use();
+    glDispatchCompute((CLUSTERS + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    return true;
+  }
+
+  // clusters of the last assign() with any light, the lights per such
+  // cluster and the clusters that had to drop lights. waits for the GPU, for
+  // statistics only.
+  struct Statistics {
+    uint32_t lit = 0;
+    uint32_t max_lights = 0;
+    uint32_t overflowing = 0;
+    double average_lights = 0.0;
+  };
+
+  Statistics readStatistics() const {
+    Statistics statistics;
+    if (cluster_buffer == 0)
+      return statistics;
+    std::vector<LightCluster> clusters(CLUSTERS);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    GLState::shared().bindBuffer(GL_COPY_READ_BUFFER, cluster_buffer);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0,
+                       clusters.size() * sizeof(LightCluster),
+                       clusters.data());
+    uint64_t total = 0;
+    for (const LightCluster &cluster : clusters) {
+      if (cluster.count == 0)
+        continue;
+      statistics.lit++;
+      statistics.max_lights = std::max(statistics.max_lights, cluster.count);
+      if (cluster.count > MAX_CLUSTER_LIGHTS)
+        statistics.overflowing++;
+      total += cluster.count;
+    }
+    if (statistics.lit > 0)
+      statistics.average_lights = double(total) / statistics.lit;
+    return statistics;
+  }
+
+  void release() {
+    if (cluster_buffer != 0) {
+      GLState::shared().deleteBuffers(1, &cluster_buffer);
+      GLState::shared().deleteProgram(assign_program.ID);
+    }
+    cluster_buffer = assign_program.ID = 0;
+  }
+};
@@ -3,8 +3,13 @@
 layout (location = 0) in vec3 pos;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+
+// per frame camera data, see CameraBlock in uniform_blocks.hpp
+layout (std140, binding = 0) uniform camera_block {
+    mat4 view;
+    mat4 projection;
+    vec3 camera_pos;
+};
 
 void main()
 {
@@ -1,14 +1,27 @@
 #include <glad/glad.h>
 
+#define ALLOCATION_COUNTER_IMPLEMENTATION
+#include "allocation_counter.hpp"
+#include "benchmarks.hpp"
+#include "deferred_shading.hpp"
+#include "depth_prepass.hpp"
+#include "gpu_timer.hpp"
+#include "light_clusters.hpp"
 #include "model.hpp"
+#include "render_queue.hpp"
 #include "shader.hpp"
+#include "shader_permutations.hpp"
+#include "texture_cooker.hpp"
+#include "uniform_blocks.hpp"
 
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/matrix.hpp>
+#include <cmath>
 #include <iostream>
+#include <random>
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
@@ -17,6 +30,8 @@ private:
   // settings
   constexpr static uint32_t SCR_WIDTH = 1280;
   constexpr static uint32_t SCR_HEIGHT = 720;
+  // of every material, forward and deferred
+  constexpr static float MATERIAL_SHININESS = 32.0f;
 
   // window
   GLFWwindow *window;
@@ -44,9 +59,81 @@ private:
   glm::mat4 view;
   glm::mat4 projection;
 
-  // shader program
-  Shader shader;
+  // shader programs, the scene's compiled per ShaderFeature set
+  ShaderPermutations shaders;
   Shader light_shader;
+  // uniform handles of light_shader
+  struct {
+    Uniform<glm::vec3> light_color;
+    Uniform<glm::mat4> model;
+  } light_uniforms;
+
+  // per frame uniform blocks, instance transforms and draw commands
+  RingBuffer frame_data;
+  constexpr static GLsizeiptr FRAME_DATA_SIZE = 1 << 20;
+
+  // draws of the frame, run sorted by state and depth
+  RenderQueue render_queue;
+  // a light cube queued in render_queue
+  struct LightDraw {
+    lrnOpenGL *demo;
+    glm::mat4 model;
+    glm::vec3 color;
+  };
+
+  // stress mode: a grid of stress_instances backpacks drawn with one
+  // instanced Draw(), and the frame times while drawing it
+  std::vector<InstanceData> stress_grid;
+  struct {
+    uint64_t frames = 0;
+    double total = 0.0, min = 1e9, max = 0.0;
+    // frames and time since the last report
+    uint64_t report_frames = 0;
+    double report_time = 0.0;
+  } stress_times;
+
+  // occluders rendered on the CPU, see render_loop()
+  OcclusionBuffer occlusion;
+
+  // the point lights of the frame, assigned to the clusters of the view by
+  // light_clusters. point_lights[0] is the light of the light cube, the rest
+  // drift around their anchors.
+  LightClusters light_clusters;
+  std::vector<PointLightBlock> point_lights;
+  struct LightAnchor {
+    glm::vec3 position;
+    float phase;
+    float speed;
+  };
+  std::vector<LightAnchor> light_anchors;
+
+  // G-buffer and programs of the deferred path, and the GPU time of the
+  // frames drawn forward and deferred. G switches between the two.
+  DeferredShading deferred;
+  GPUTimer forward_timer, deferred_timer;
+  bool switch_key_down = false;
+
+  // lays down the depth before shading, P switches it on and off
+  DepthPrepass prepass;
+  bool prepass_key_down = false;
+
+  // the spot light at the camera, F switches it off and on
+  bool flashlight = true;
+  bool flashlight_key_down = false;
+
+  // the backpack instances in a GL buffer for the GPU culling, uploaded once
+  uint32_t instance_buffer = 0;
+
+  // culled and visible backpack instances and meshes summed over all frames
+  struct {
+    uint64_t frames = 0;
+    CullCounts instances, meshes;
+  } culling;
+
+  // heap allocations made between beginFrame() and endFrame(), the first
+  // frame is left out since it resolves bindings and uniform handles
+  uint64_t draw_allocations = 0;
+  uint64_t allocating_frames = 0;
 
   // opengl state machine
   uint32_t VBO, light_VAO;
@@ -54,43 +141,49 @@ private:
   // backpack model
   Model backpack;
 
-  // cube
-  constexpr static float cube[] = {
-      -0.5f, -0.5f, -0.5f, 0.0f,  0.0f,  -1.0f, 0.0f,  0.0f,  0.5f,  -0.5f,
-      -0.5f, 0.0f,  0.0f,  -1.0f, 1.0f,  0.0f,  0.5f,  0.5f,  -0.5f, 0.0f,
-      0.0f,  -1.0f, 1.0f,  1.0f,  0.5f,  0.5f,  -0.5f, 0.0f,  0.0f,  -1.0f,
-      1.0f,  1.0f,  -0.5f, 0.5f,  -0.5f, 0.0f,  0.0f,  -1.0f, 0.0f,  1.0f,
-      -0.5f, -0.5f, -0.5f, 0.0f,  0.0f,  -1.0f, 0.0f,  0.0f,
-
-      -0.5f, -0.5f, 0.5f,  0.0f,  0.0f,  1.0f,  0.0f,  0.0f,  0.5f,  -0.5f,
-      0.5f,  0.0f,  0.0f,  1.0f,  1.0f,  0.0f,  0.5f,  0.5f,  0.5f,  0.0f,
-      0.0f,  1.0f,  1.0f,  1.0f,  0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,
-      1.0f,  1.0f,  -0.5f, 0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f,  1.0f,
-      -0.5f, -0.5f, 0.5f,  0.0f,  0.0f,  1.0f,  0.0f,  0.0f,
-
-      -0.5f, 0.5f,  0.5f,  -1.0f, 0.0f,  0.0f,  1.0f,  0.0f,  -0.5f, 0.5f,
-      -0.5f, -1.0f, 0.0f,  0.0f,  1.0f,  1.0f,  -0.5f, -0.5f, -0.5f, -1.0f,
-      0.0f,  0.0f,  0.0f,  1.0f,  -0.5f, -0.5f, -0.5f, -1.0f, 0.0f,  0.0f,
-      0.0f,  1.0f,  -0.5f, -0.5f, 0.5f,  -1.0f, 0.0f,  0.0f,  0.0f,  0.0f,
-      -0.5f, 0.5f,  0.5f,  -1.0f, 0.0f,  0.0f,  1.0f,  0.0f,
-
-      0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f,  0.0f,  0.5f,  0.5f,
-      -0.5f, 1.0f,  0.0f,  0.0f,  1.0f,  1.0f,  0.5f,  -0.5f, -0.5f, 1.0f,
-      0.0f,  0.0f,  0.0f,  1.0f,  0.5f,  -0.5f, -0.5f, 1.0f,  0.0f,  0.0f,
-      0.0f,  1.0f,  0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  0.0f,  0.0f,  0.0f,
-      0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f,  0.0f,
-
-      -0.5f, -0.5f, -0.5f, 0.0f,  -1.0f, 0.0f,  0.0f,  1.0f,  0.5f,  -0.5f,
-      -0.5f, 0.0f,  -1.0f, 0.0f,  1.0f,  1.0f,  0.5f,  -0.5f, 0.5f,  0.0f,
-      -1.0f, 0.0f,  1.0f,  0.0f,  0.5f,  -0.5f, 0.5f,  0.0f,  -1.0f, 0.0f,
-      1.0f,  0.0f,  -0.5f, -0.5f, 0.5f,  0.0f,  -1.0f, 0.0f,  0.0f,  0.0f,
-      -0.5f, -0.5f, -0.5f, 0.0f,  -1.0f, 0.0f,  0.0f,  1.0f,
-
-      -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,  0.0f,  1.0f,  0.5f,  0.5f,
-      -0.5f, 0.0f,  1.0f,  0.0f,  1.0f,  1.0f,  0.5f,  0.5f,  0.5f,  0.0f,
-      1.0f,  0.0f,  1.0f,  0.0f,  0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,
-      1.0f,  0.0f,  -0.5f, 0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f,  0.0f,
-      -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,  0.0f,  1.0f};
+  // light cube, positions only
+  constexpr static PositionVertex cube[] = {
+      {glm::vec3(-0.5f, -0.5f, -0.5f)},
+      {glm::vec3(0.5f, -0.5f, -0.5f)},
+      {glm::vec3(0.5f, 0.5f, -0.5f)},
+      {glm::vec3(0.5f, 0.5f, -0.5f)},
+      {glm::vec3(-0.5f, 0.5f, -0.5f)},
+      {glm::vec3(-0.5f, -0.5f, -0.5f)},
+
+      {glm::vec3(-0.5f, -0.5f, 0.5f)},
+      {glm::vec3(0.5f, -0.5f, 0.5f)},
+      {glm::vec3(0.5f, 0.5f, 0.5f)},
+      {glm::vec3(0.5f, 0.5f, 0.5f)},
+      {glm::vec3(-0.5f, 0.5f, 0.5f)},
+      {glm::vec3(-0.5f, -0.5f, 0.5f)},
+
+      {glm::vec3(-0.5f, 0.5f, 0.5f)},
+      {glm::vec3(-0.5f, 0.5f, -0.5f)},
+      {glm::vec3(-0.5f, -0.5f, -0.5f)},
+      {glm::vec3(-0.5f, -0.5f, -0.5f)},
+      {glm::vec3(-0.5f, -0.5f, 0.5f)},
+      {glm::vec3(-0.5f, 0.5f, 0.5f)},
+
+      {glm::vec3(0.5f, 0.5f, 0.5f)},
+      {glm::vec3(0.5f, 0.5f, -0.5f)},
+      {glm::vec3(0.5f, -0.5f, -0.5f)},
+      {glm::vec3(0.5f, -0.5f, -0.5f)},
+      {glm::vec3(0.5f, -0.5f, 0.5f)},
+      {glm::vec3(0.5f, 0.5f, 0.5f)},
+
+      {glm::vec3(-0.5f, -0.5f, -0.5f)},
+      {glm::vec3(0.5f, -0.5f, -0.5f)},
+      {glm::vec3(0.5f, -0.5f, 0.5f)},
+      {glm::vec3(0.5f, -0.5f, 0.5f)},
+      {glm::vec3(-0.5f, -0.5f, 0.5f)},
+      {glm::vec3(-0.5f, -0.5f, -0.5f)},
+
+      {glm::vec3(-0.5f, 0.5f, -0.5f)},
+      {glm::vec3(0.5f, 0.5f, -0.5f)},
+      {glm::vec3(0.5f, 0.5f, 0.5f)},
+      {glm::vec3(0.5f, 0.5f, 0.5f)},
+      {glm::vec3(-0.5f, 0.5f, 0.5f)},
+      {glm::vec3(-0.5f, 0.5f, -0.5f)}};
 
   uint8_t init() {
     // init glfw
@@ -127,45 +220,74 @@ private:
       return 2;
     }
 
-    shader.init("shader.vert", "shader.frag");
+    GLState::shared().filtering = state_filtering;
+    shaders.init("shader.vert", "shader.frag",
+                 SHADER_LIGHT_FEATURES | SHADER_MATERIAL_FEATURES,
+                 setupMaterial);
     light_shader.init("light_shader.vert", "light_shader.frag");
-
+    light_uniforms.light_color = light_shader.uniform<glm::vec3>("light_color");
+    light_uniforms.model = light_shader.uniform<glm::mat4>("model");
+    // the GPU culled instances aren't streamed
+    frame_data.init(FRAME_DATA_SIZE +
+                    GLsizeiptr(gpu_culling ? 0 : stress_instances) *
+                        sizeof(InstanceData) +
+                    GLsizeiptr(point_light_count) * sizeof(PointLightBlock));
+    light_clusters.init();
+    deferred.init();
+    forward_timer.init();
+    deferred_timer.init();
+    prepass.init();
+    prepass.enabled = depth_prepass;
+
+    MaterialTable::shared().init(bindless_textures);
     backpack.loadModel("backpack/backpack.obj");
 
     // light VAO
     glGenVertexArrays(1, &light_VAO);
-    glBindVertexArray(light_VAO);
+    GLState::shared().bindVertexArray(light_VAO);
 
     // vertex buffer
     glGenBuffers(1, &VBO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    GLState::shared().bindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW);
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
-                          (void *)0);
-    glEnableVertexAttribArray(0);
+    setupVertexAttributes<PositionVertex>();
 
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    GLState::shared().bindVertexArray(0);
+    GLState::shared().bindBuffer(GL_ARRAY_BUFFER, 0);
 
     // opengl state machine
     glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
     glEnable(GL_DEPTH_TEST);
 
-    stbi_set_flip_vertically_on_load(true);
+    if (stress_instances > 0)
+      initStressGrid();
+    if (gpu_culling)
+      initInstanceBuffer();
+    initPointLights();
 
     return 0;
   }
 
   void render_loop() {
     while (!glfwWindowShouldClose(window)) {
-      // clear color and depth buffers
-      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      GLState::shared().beginFrame();
 
       // input
       glfwPollEvents();
       processInput();
 
+      // clear color and depth buffers
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      // timed as the path the input left selected
+      GPUTimer &frame_timer =
+          deferred_shading ? deferred_timer : forward_timer;
+      frame_timer.begin();
+
+      // upload textures that finished decoding in the background
+      TextureLoader::shared().poll();
+      MaterialTable::shared().update();
+
       // time
       old_time = time;
       time = glfwGetTime();
@@ -178,6 +300,27 @@ private:
       projection = glm::perspective(glm::radians(fov),
                                     static_cast<float>(SCR_WIDTH) / SCR_HEIGHT,
                                     0.1f, 100.0f);
+      render_queue.begin(view, projection, 0.1f, 100.0f);
+      if (gpu_culling)
+        GPUCulling::shared().beginFrame(projection * view);
+
+      // the backpacks of this frame
+      const InstanceData instance = instanceData(model);
+      const InstanceData *instances = &instance;
+      uint32_t instance_count = 1;
+      if (!stress_grid.empty()) {
+        instances = stress_grid.data();
+        instance_count = stress_grid.size();
+      }
+
+      // render the closest backpacks into the occlusion buffer on the worker
+      // threads while this thread goes on with the frame
+      if (occlusion_culling && !gpu_culling) {
+        occlusion.begin(projection * view);
+        backpack.addOccluders(occlusion, camera_pos, instances,
+                              instance_count);
+        occlusion.renderAsync(ThreadPool::shared());
+      }
 
       // light pos
       glm::vec3 light_pos = glm::vec3(0.0f, 0.0f, 0.0f);
@@ -194,83 +337,347 @@ private:
       glm::vec3 ambient_color = diffuse_color * glm::vec3(0.2f);
 
       // static light
-      glm::vec3 static_light_diffuse = glm::vec3(0.5f);
       glm::vec3 static_light_ambient = glm::vec3(0.05f);
 
-      // setting object shader values
-      shader.use();
+      animatePointLights(light_pos, ambient_color, diffuse_color);
+
+      // per frame data, written straight into this frame's region of the
+      // ring buffer and shared by every program
+      frame_data.beginFrame();
+      const uint64_t allocations = thread_heap_allocations;
 
-      // material
-      shader.setFloat("material.shininess", 32.0f);
+      CameraBlock camera_block = {};
+      camera_block.view = view;
+      camera_block.projection = projection;
+      camera_block.camera_pos = camera_pos;
+      frame_data.bindUniform(CAMERA_BLOCK_BINDING, camera_block);
+
+      LightBlock light_block = {};
 
       // directional light
-      shader.setVec3("dir_light.direction", -0.2f, -1.0f, -0.3f);
-      shader.setVec3("dir_light.ambient", glm::vec3(0.01f));
-      shader.setVec3("dir_light.diffuse", glm::vec3(0.1f));
-      shader.setVec3("dir_light.specular", 0.5f, 0.5f, 0.5f);
-
-      // spot light
-      shader.setVec3("spot_light.position", camera_pos);
-      shader.setVec3("spot_light.direction", camera_front);
-      shader.setVec3("spot_light.ambient", 0.0f, 0.0f, 0.0f);
-      shader.setVec3("spot_light.diffuse", 1.0f, 1.0f, 1.0f);
-      shader.setVec3("spot_light.specular", 1.0f, 1.0f, 1.0f);
-      shader.setFloat("spot_light.constant", 1.0f);
-      shader.setFloat("spot_light.linear", 0.09f);
-      shader.setFloat("spot_light.quadratic", 0.032f);
-      shader.setFloat("spot_light.cut_off", glm::cos(glm::radians(12.5f)));
-      shader.setFloat("spot_light.outer_cut_off",
-                      glm::cos(glm::radians(15.0f)));
-
-      shader.setVec3("point_light.position", light_pos);
-      shader.setVec3("point_light.ambient", ambient_color);
-      shader.setVec3("point_light.diffuse", diffuse_color);
-      shader.setVec3("point_light.specular", 1.0f, 1.0f, 1.0f);
-      shader.setFloat("point_light.constant", 1.0f);
-      shader.setFloat("point_light.linear", 0.09f);
-      shader.setFloat("point_light.quadratic", 0.032f);
-
-      // camera
-      shader.setVec3("camera_pos", camera_pos);
-
-      // matrices
-      shader.setMat4("model", model);
-      shader.setMat3("normal_matrix", glm::transpose(glm::inverse(model)));
-      shader.setMat4("view", view);
-      shader.setMat4("projection", projection);
-
-      // draw object
-      backpack.Draw(shader);
-
-      // set light shader values
-      light_shader.use();
-      light_shader.setMat4("view", view);
-      light_shader.setMat4("projection", projection);
-      light_shader.setVec3("light_color", static_light_diffuse);
+      light_block.dir_light.direction = glm::vec3(-0.2f, -1.0f, -0.3f);
+      light_block.dir_light.ambient = glm::vec3(0.01f);
+      light_block.dir_light.diffuse = glm::vec3(0.1f);
+      light_block.dir_light.specular = glm::vec3(0.5f, 0.5f, 0.5f);
+
+      // spot light, F switches it off and on
+      light_block.spot_light.position = camera_pos;
+      light_block.spot_light.direction = camera_front;
+      light_block.spot_light.ambient = glm::vec3(0.0f, 0.0f, 0.0f);
+      light_block.spot_light.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
+      light_block.spot_light.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+      light_block.spot_light.constant = 1.0f;
+      light_block.spot_light.linear = 0.09f;
+      light_block.spot_light.quadratic = 0.032f;
+      light_block.spot_light.cut_off = glm::cos(glm::radians(12.5f));
+      light_block.spot_light.outer_cut_off = glm::cos(glm::radians(15.0f));
+
+      // point lights, assigned to the clusters of this view
+      int width, height;
+      glfwGetFramebufferSize(window, &width, &height);
+      LightClusters::setup(light_block, width, height, 0.1f, 100.0f,
+                           point_lights.size());
+      frame_data.bindUniform(LIGHT_BLOCK_BINDING, light_block);
+      light_clusters.assign(frame_data, point_lights.data(),
+                            point_lights.size());
+
+      // the lights the scene's shader variants evaluate
+      const uint32_t light_features =
+          SHADER_DIR_LIGHT |
+          (point_lights.empty() ? 0u : uint32_t(SHADER_POINT_LIGHTS)) |
+          (flashlight ? uint32_t(SHADER_SPOT_LIGHT) : 0u);
+
+      if (occlusion_culling && !gpu_culling) {
+        occlusion.wait();
+        render_queue.occlusion = &occlusion;
+      }
+
+      // queue object, into the G-buffer when deferred
+      ShaderPermutations &scene_shaders =
+          deferred_shading ? deferred.geometry_programs : shaders;
+      if (gpu_culling) {
+        backpack.DrawCulled(render_queue, scene_shaders, light_features,
+                            frame_data, instance_buffer, instance_count,
+                            prepass.depthProgram());
+      } else {
+        backpack.Draw(render_queue, scene_shaders, light_features, frame_data,
+                      instances, instance_count, prepass.depthProgram());
+        culling.frames++;
+        add(culling.instances, backpack.instance_culling);
+        add(culling.meshes, backpack.mesh_culling);
+      }
 
       // manipulate light model matrix
       model = glm::mat4(1.0f);
       model = glm::translate(model, light_pos + glm::vec3(0.0f, 0.0f, 3.0f));
       model = glm::scale(model, glm::vec3(0.2f));
-      light_shader.setMat4("model", model);
-      light_shader.setVec3("light_color", light_color);
 
-      // draw light
-      glBindVertexArray(light_VAO);
-      glDrawArrays(GL_TRIANGLES, 0, 36);
+      // queue light, if the cube is in view and not behind a backpack
+      const BoundingSphere light_sphere = {glm::vec3(model[3]), 0.2f};
+      const BoundingBox light_box = {light_sphere.center - 0.1f,
+                                     light_sphere.center + 0.1f};
+      // deferred, the cube is drawn forward after the lighting pass
+      const LightDraw light = {this, model, light_color};
+      const bool light_visible =
+          render_queue.frustum.visible(light_sphere) &&
+          !(render_queue.occlusion != NULL &&
+            render_queue.occlusion->occluded(light_box));
+      if (light_visible && !deferred_shading) {
+        const uint32_t light_depth =
+            render_queue.depth(light_sphere.center, RENDER_PASS_OPAQUE);
+        render_queue.submit(RenderQueue::key(RENDER_PASS_OPAQUE,
+                                             light_shader.ID, 0, light_VAO,
+                                             light_depth),
+                            drawLight, light);
+        // the cube has no position stream, its own program lays its depth
+        if (prepass.enabled)
+          render_queue.submit(RenderQueue::key(RENDER_PASS_DEPTH,
+                                               light_shader.ID, 0, light_VAO,
+                                               light_depth),
+                              drawLight, light);
+      }
+
+      // draw everything queued, sorted
+      if (deferred_shading) {
+        deferred.beginGeometry(width, height);
+        prepass.begin(render_queue);
+        render_queue.execute();
+        prepass.end();
+        deferred.light(projection * view, MATERIAL_SHININESS,
+                       light_features);
+        if (light_visible)
+          drawLight(&light);
+      } else {
+        prepass.begin(render_queue);
+        render_queue.execute();
+        prepass.end();
+      }
+      frame_timer.end();
+
+      // the depth the next frame is culled against
+      if (gpu_culling)
+        GPUCulling::shared().buildPyramid(width, height);
+
+      // the GPU is done with this frame's data once it passes this fence
+      frame_data.endFrame();
+      if (frame_data.frames > 1 && thread_heap_allocations != allocations) {
+        draw_allocations += thread_heap_allocations - allocations;
+        allocating_frames++;
+      }
 
       // render frame
       glfwSwapBuffers(window);
+
+      if (!stress_grid.empty())
+        recordStressFrame();
+    }
+  }
+
+  // a cube of backpacks in front of the camera, 3 units apart
+  void initStressGrid() {
+    const uint32_t side = std::ceil(std::cbrt(double(stress_instances)));
+    stress_grid.reserve(stress_instances);
+    for (uint32_t i = 0; i < stress_instances; i++) {
+      const glm::vec3 cell(i % side, i / side % side, i / (side * side));
+      const glm::vec3 offset(-0.5f * side, -0.5f * side, side + 2.0f);
+      glm::mat4 model =
+          glm::translate(glm::mat4(1.0f), 3.0f * (cell - offset));
+      stress_grid.push_back(instanceData(model));
+    }
+    // measure the frames, not the display
+    glfwSwapInterval(0);
+  }
+
+  // the stress grid, or the single backpack, for DrawCulled()
+  void initInstanceBuffer() {
+    const InstanceData single = instanceData(glm::mat4(1.0f));
+    const InstanceData *instances = &single;
+    size_t count = 1;
+    if (!stress_grid.empty()) {
+      instances = stress_grid.data();
+      count = stress_grid.size();
+    }
+    glGenBuffers(1, &instance_buffer);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, instance_buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, count * sizeof(InstanceData),
+                    instances, 0);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+
+  // point_light_count lights, the ones after the first scattered around the
+  // backpacks at about one per 3 cubic units
+  void initPointLights() {
+    point_lights.resize(std::max(point_light_count, 1u));
+    light_anchors.resize(point_lights.size());
+    glm::vec3 scene_min(-1.0f), scene_max(1.0f);
+    for (const InstanceData &instance : stress_grid) {
+      scene_min = glm::min(scene_min, glm::vec3(instance.model[3]));
+      scene_max = glm::max(scene_max, glm::vec3(instance.model[3]));
+    }
+    const glm::vec3 center = 0.5f * (scene_min + scene_max);
+    const glm::vec3 half = glm::max(
+        0.5f * (scene_max - scene_min),
+        glm::vec3(0.5f * std::cbrt(3.0f * point_lights.size())));
+
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> color(0.05f, 0.3f);
+    for (size_t i = 1; i < point_lights.size(); i++) {
+      PointLightBlock &light = point_lights[i];
+      light.diffuse = glm::vec3(color(random), color(random), color(random));
+      light.specular = light.diffuse;
+      light.constant = 1.0f;
+      light.linear = 0.7f;
+      light.quadratic = 1.8f;
+      light.radius = pointLightRadius(light);
+      light_anchors[i].position =
+          center + half * glm::vec3(unit(random), unit(random), unit(random));
+      light_anchors[i].phase = 3.14159265f * unit(random);
+      light_anchors[i].speed = 0.5f + 0.5f * unit(random);
     }
   }
 
+  // moves the lights for this frame, the first one is the light cube's
+  void animatePointLights(const glm::vec3 &cube_position,
+                          const glm::vec3 &ambient, const glm::vec3 &diffuse) {
+    PointLightBlock &cube_light = point_lights[0];
+    cube_light.position = cube_position;
+    cube_light.ambient = ambient;
+    cube_light.diffuse = diffuse;
+    cube_light.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+    cube_light.constant = 1.0f;
+    cube_light.linear = 0.09f;
+    cube_light.quadratic = 0.032f;
+    cube_light.radius = pointLightRadius(cube_light);
+    for (size_t i = 1; i < point_lights.size(); i++) {
+      const LightAnchor &anchor = light_anchors[i];
+      const float angle = time * anchor.speed + anchor.phase;
+      point_lights[i].position =
+          anchor.position +
+          glm::vec3(sin(angle), 0.5f * sin(0.7f * angle), cos(angle));
+    }
+  }
+
+  // frame times of the stress mode, the first frame loads and is left out
+  void recordStressFrame() {
+    if (frame_data.frames < 2)
+      return;
+    const double frame_ms = delta_time * 1000.0;
+    stress_times.frames++;
+    stress_times.total += frame_ms;
+    stress_times.min = std::min(stress_times.min, frame_ms);
+    stress_times.max = std::max(stress_times.max, frame_ms);
+    stress_times.report_frames++;
+    stress_times.report_time += frame_ms;
+    if (stress_times.report_time < 1000.0)
+      return;
+    // the GPU culling counts are read back, once per report
+    CullCounts instances = backpack.instance_culling, meshes;
+    if (gpu_culling)
+      backpack.gpu_culling.readCounts(instances, meshes);
+    std::cout << "STRESS:: " << stress_grid.size() << " backpacks, "
+              << stress_times.report_time / stress_times.report_frames
+              << " ms per frame, " << instances.visible << " visible"
+              << std::endl;
+    stress_times.report_frames = 0;
+    stress_times.report_time = 0.0;
+  }
+
   void free_resources() {
-    glDeleteVertexArrays(1, &light_VAO);
-    glDeleteBuffers(1, &VBO);
+    GLState::shared().deleteVertexArrays(1, &light_VAO);
+    GLState::shared().deleteBuffers(1, &VBO);
+    if (gpu_culling) {
+      CullCounts instances, meshes;
+      backpack.gpu_culling.readCounts(instances, meshes);
+      std::cout << "GPU_CULLING:: last frame visible/culled/occluded "
+                   "instances "
+                << instances.visible << "/" << instances.culled << "/"
+                << instances.occluded << ", mesh draws " << meshes.visible
+                << "/" << meshes.culled << "/" << meshes.occluded
+                << std::endl;
+      GLState::shared().deleteBuffers(1, &instance_buffer);
+    }
+    const LightClusters::Statistics lights = light_clusters.readStatistics();
+    std::cout << "LIGHT_CLUSTERS:: " << point_lights.size()
+              << " point lights, " << lights.lit << " of "
+              << LightClusters::CLUSTERS << " clusters lit by "
+              << lights.average_lights << " lights on average, at most "
+              << lights.max_lights << ", " << lights.overflowing
+              << " over the limit of " << MAX_CLUSTER_LIGHTS << std::endl;
+    light_clusters.release();
+    std::cout << "DEFERRED_SHADING:: GPU frame time forward "
+              << forward_timer.averageMs() << " ms over "
+              << forward_timer.samples << " frames, deferred "
+              << deferred_timer.averageMs() << " ms over "
+              << deferred_timer.samples << " frames" << std::endl;
+    forward_timer.release();
+    deferred_timer.release();
+    std::cout << "SHADER_PERMUTATIONS:: " << shaders.compiled
+              << " forward variants compiled, "
+              << deferred.geometry_programs.compiled << " geometry and "
+              << deferred.lighting_programs.compiled << " deferred lighting"
+              << std::endl;
+    shaders.release();
+    deferred.release();
+    std::cout << "DEPTH_PREPASS:: fragment shader invocations per frame "
+              << prepass.fragments_without_prepass.average()
+              << " without the pre-pass, with it "
+              << prepass.prepass_fragments.average() << " for depth and "
+              << prepass.shaded_fragments.average() << " shaded" << std::endl;
+    prepass.release();
+    backpack.unload();
+    GPUCulling::shared().shutdown();
+    MaterialTable::shared().shutdown();
+    std::cout << "RING_BUFFER:: waited on a fence in " << frame_data.fence_waits
+              << " of " << frame_data.frames << " frames" << std::endl;
+    frame_data.release();
+    std::cout << "RENDER_QUEUE:: " << render_queue.last_draws
+              << " draws in the last frame, sorted in "
+              << render_queue.last_sort_passes << " radix passes" << std::endl;
+    std::cout << "ALLOCATION_COUNTER:: " << draw_allocations
+              << " heap allocations while drawing, in " << allocating_frames
+              << " frames" << std::endl;
+    GLState::shared().printStatistics();
+    if (culling.frames > 0)
+      std::cout << "CULLING:: per frame visible/culled/occluded instances "
+                << double(culling.instances.visible) / culling.frames << "/"
+                << double(culling.instances.culled) / culling.frames << "/"
+                << double(culling.instances.occluded) / culling.frames
+                << ", mesh draws "
+                << double(culling.meshes.visible) / culling.frames << "/"
+                << double(culling.meshes.culled) / culling.frames << "/"
+                << double(culling.meshes.occluded) / culling.frames
+                << std::endl;
+    if (stress_times.frames > 0)
+      std::cout << "STRESS:: " << stress_grid.size() << " backpacks over "
+                << stress_times.frames << " frames, frame time avg "
+                << stress_times.total / stress_times.frames << " ms, min "
+                << stress_times.min << " ms, max " << stress_times.max
+                << " ms" << std::endl;
+    GeometryBuffer<PackedVertex>::shared().release();
+    GeometryBuffer<Vertex>::shared().release();
+    TextureLoader::shared().shutdown();
     glfwTerminate();
   }
 
 public:
+  // use ARB_bindless_texture if the driver has it, texture arrays otherwise
+  bool bindless_textures = true;
+  // drop GL calls that wouldn't change any state
+  bool state_filtering = true;
+  // skip backpacks hidden behind the closest ones
+  bool occlusion_culling = true;
+  // backpacks drawn by the stress mode, 0 draws the single one
+  uint32_t stress_instances = 0;
+  // cull on the GPU against the depth of the last frame, see gpu_culling.hpp
+  bool gpu_culling = false;
+  // point lights, the first is the light cube's (see light_clusters.hpp)
+  uint32_t point_light_count = 1;
+  // shade through a G-buffer, see deferred_shading.hpp
+  bool deferred_shading = false;
+  // draw the depth of the opaque meshes first, see depth_prepass.hpp
+  bool depth_prepass = false;
+
   void run() {
     if (init() != 0) {
       std::cerr << "ERROR\n";
@@ -287,6 +694,22 @@ private:
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
       glfwSetWindowShouldClose(window, true);
 
+    // switches between forward and deferred shading once per press
+    const bool switch_key = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+    if (switch_key && !switch_key_down)
+      deferred_shading = !deferred_shading;
+    switch_key_down = switch_key;
+    // switches the depth pre-pass on and off
+    const bool prepass_key = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+    if (prepass_key && !prepass_key_down)
+      prepass.enabled = !prepass.enabled;
+    prepass_key_down = prepass_key;
+    // switches the flashlight off and on
+    const bool flashlight_key = glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS;
+    if (flashlight_key && !flashlight_key_down)
+      flashlight = !flashlight;
+    flashlight_key_down = flashlight_key;
+
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
       camera_pos += camera_front * camera_speed * delta_time;
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
@@ -338,6 +761,26 @@ private:
     ths->camera_front = glm::normalize(direction);
   }
 
+  static void add(CullCounts &total, const CullCounts &frame) {
+    total.visible += frame.visible;
+    total.culled += frame.culled;
+    total.occluded += frame.occluded;
+  }
+
+  // material uniforms of every scene shader variant, they never change
+  static void setupMaterial(const Shader &shader) {
+    shader.setFloat("material.shininess", MATERIAL_SHININESS);
+  }
+
+  static void drawLight(const void *payload) {
+    const LightDraw &light = *static_cast<const LightDraw *>(payload);
+    light.demo->light_shader.use();
+    light.demo->light_uniforms.model.set(light.model);
+    light.demo->light_uniforms.light_color.set(light.color);
+    GLState::shared().bindVertexArray(light.demo->light_VAO);
+    glDrawArrays(GL_TRIANGLES, 0, 36);
+  }
+
   static void scroll_callback(GLFWwindow *window, double xoffset,
                               double yoffset) {
     lrnOpenGL *ths =
@@ -351,7 +794,49 @@ private:
   }
 };
 
-int main() {
+int main(int argc, char **argv) {
+  // offline step: block compress the textures of a material file
+  if (argc == 3 && std::string(argv[1]) == "--cook-textures")
+    return cookMaterialTextures(argv[2]);
+  if (argc == 3 && std::string(argv[1]) == "--bench-mips")
+    return benchmarkMipmaps(argv[2]);
+  if (argc == 2 && std::string(argv[1]) == "--bench-uniforms")
+    return benchmarkUniforms();
+  if (argc == 2 && std::string(argv[1]) == "--bench-culling")
+    return benchmarkCulling();
+  if (argc == 2 && std::string(argv[1]) == "--bench-gpu-culling")
+    return benchmarkGPUCulling();
+  if (argc == 2 && std::string(argv[1]) == "--check-occlusion")
+    return checkOcclusion();
+
   lrnOpenGL demo;
+  // forces the texture array fallback of the MaterialTable
+  if (argc == 2 && std::string(argv[1]) == "--texture-arrays")
+    demo.bindless_textures = false;
+  // issues every state change, to compare against the filtered calls
+  if (argc == 2 && std::string(argv[1]) == "--no-state-filter")
+    demo.state_filtering = false;
+  // frustum culling only
+  if (argc == 2 && std::string(argv[1]) == "--no-occlusion")
+    demo.occlusion_culling = false;
+  // draws a grid of backpacks and reports the frame times
+  if (argc >= 2 && std::string(argv[1]) == "--stress")
+    demo.stress_instances = argc == 3 ? std::stoul(argv[2]) : 10000;
+  // the GPU culls, optionally a stress grid of that many backpacks
+  if (argc >= 2 && std::string(argv[1]) == "--gpu-culling") {
+    demo.gpu_culling = true;
+    demo.stress_instances = argc == 3 ? std::stoul(argv[2]) : 0;
+  }
+  // lights the backpack with that many point lights
+  if (argc >= 2 && std::string(argv[1]) == "--lights")
+    demo.point_light_count = argc == 3 ? std::stoul(argv[2]) : 4096;
+  // the same lights shaded deferred, G switches to forward and back
+  if (argc >= 2 && std::string(argv[1]) == "--deferred") {
+    demo.deferred_shading = true;
+    demo.point_light_count = argc == 3 ? std::stoul(argv[2]) : 4096;
+  }
+  // starts with the depth pre-pass, P switches it off and on
+  if (argc == 2 && std::string(argv[1]) == "--depth-prepass")
+    demo.depth_prepass = true;
   demo.run();
 }
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "gl_state.hpp"
+#include "texture_loader.hpp"
+
+#include <GLFW/glfw3.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+// textures of a material, in the order of MaterialData's arrays
+enum MaterialSlot : uint32_t {
+  MATERIAL_DIFFUSE = 0,
+  MATERIAL_SPECULAR = 1,
+  MATERIAL_SLOTS = 2
+};
+
+// per material data read by shader.frag from the shader storage buffer at
+// MATERIAL_BINDING, indexed by the material of the draw. a slot whose texture
+// isn't loaded (yet) has handle 0 and array -1 and samples as white.
+constexpr uint32_t MATERIAL_BINDING = 2;
+
+struct MaterialData {
+  // ARB_bindless_texture handles, a uvec2 each in the shader
+  GLuint64 handles[MATERIAL_SLOTS];
+  // texture array and layer of the fallback path
+  int32_t arrays[MATERIAL_SLOTS];
+  int32_t layers[MATERIAL_SLOTS];
+};
+
+static_assert(sizeof(MaterialData) == 32, "MaterialData isn't std430");
+
+// Every material of every model in one storage buffer, so a multi draw can
+// cover meshes with different textures and nothing is bound per mesh. With
+// ARB_bindless_texture every texture is made resident and referenced by its
+// handle. Without it textures are copied into 2D texture arrays grouped by
+// size, format and mip count, bound once to MAX_TEXTURE_ARRAYS units starting
+// at FIRST_ARRAY_UNIT, and referenced by array and layer.
+//
+// Textures come from the TextureLoader, a texture is only made resident (or
+// copied) once its image has been uploaded, until then the material samples
+// it as white.
+class MaterialTable {
+public:
+  constexpr static uint32_t MAX_TEXTURE_ARRAYS = 8;
+  constexpr static uint32_t FIRST_ARRAY_UNIT = 8;
+
+  MaterialTable(const MaterialTable &) = delete;
+  MaterialTable &operator=(const MaterialTable &) = delete;
+
+  static MaterialTable &shared() {
+    static MaterialTable table;
+    return table;
+  }
+
+  // picks the bindless path if the driver has it and allow_bindless is set,
+  // has to be called with a current context before the first acquire()
+  void init(bool allow_bindless = true) {
+    bindless = allow_bindless && hasExtension("GL_ARB_bindless_texture");
+    if (bindless) {
+      getTextureHandle = reinterpret_cast<GetTextureHandleProc>(
+          glfwGetProcAddress("glGetTextureHandleARB"));
+      makeResident = reinterpret_cast<MakeHandleResidentProc>(
+          glfwGetProcAddress("glMakeTextureHandleResidentARB"));
+      makeNonResident = reinterpret_cast<MakeHandleNonResidentProc>(
+          glfwGetProcAddress("glMakeTextureHandleNonResidentARB"));
+      bindless = getTextureHandle && makeResident && makeNonResident;
+    }
+    std::cout << "MATERIAL_TABLE:: "
+              << (bindless ? "bindless textures" : "texture arrays")
+              << std::endl;
+  }
+
+  bool isBindless() const { return bindless; }
+
+  // returns the index of the material sampling the given textures, slots
+  // without a texture (0) sample as white. every acquire has to be paired
+  // with a release.
+  uint32_t acquire(const std::array<uint32_t, MATERIAL_SLOTS> &textures) {
+    auto found = lookup.find(textures);
+    if (found != lookup.end()) {
+      materials[found->second].references++;
+      return found->second;
+    }
+
+    uint32_t index;
+    if (!free_materials.empty()) {
+      index = free_materials.back();
+      free_materials.pop_back();
+    } else {
+      index = materials.size();
+      materials.emplace_back();
+      data.emplace_back();
+    }
+    materials[index].textures = textures;
+    materials[index].references = 1;
+    lookup[textures] = index;
+
+    for (uint32_t slot = 0; slot < MATERIAL_SLOTS; slot++) {
+      const uint32_t id = textures[slot];
+      if (id == 0)
+        continue;
+      TextureEntry &entry = entries[id];
+      if (entry.references++ == 0 &&
+          !TextureLoader::shared().loading(id))
+        resolve(id, entry);
+      else if (entry.references == 1)
+        waiting.push_back(id);
+    }
+    writeMaterial(index);
+    return index;
+  }
+
+  void release(uint32_t index) {
+    if (index >= materials.size() || materials[index].references == 0)
+      return;
+    Material &material = materials[index];
+    if (--material.references > 0)
+      return;
+
+    lookup.erase(material.textures);
+    for (uint32_t id : material.textures) {
+      auto found = entries.find(id);
+      if (found == entries.end() || --found->second.references > 0)
+        continue;
+      unresolve(found->second);
+      entries.erase(found);
+    }
+    material = Material();
+    free_materials.push_back(index);
+    writeMaterial(index);
+  }
+
+  // picks up textures the loader finished since the last call, call once per
+  // frame after TextureLoader::poll()
+  void update() {
+    for (size_t i = 0; i < waiting.size();) {
+      const uint32_t id = waiting[i];
+      auto found = entries.find(id);
+      if (found != entries.end() && TextureLoader::shared().loading(id)) {
+        i++;
+        continue;
+      }
+      if (found != entries.end() && !found->second.resolved) {
+        resolve(id, found->second);
+        for (uint32_t index : found->second.materials)
+          writeMaterial(index);
+      }
+      waiting[i] = waiting.back();
+      waiting.pop_back();
+    }
+  }
+
+  // binds the material buffer and, without bindless textures, the arrays.
+  // uploads the materials first if any changed.
+  void bind() {
+    if (dirty) {
+      if (buffer == 0)
+        glGenBuffers(1, &buffer);
+      GLState::shared().bindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER,
+                   std::max<size_t>(data.size(), 1) * sizeof(MaterialData),
+                   data.empty() ? NULL : data.data(), GL_DYNAMIC_DRAW);
+      GLState::shared().bindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+      dirty = false;
+    }
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER,
+                                      MATERIAL_BINDING, buffer);
+    for (uint32_t i = 0; i < arrays.size(); i++)
+      GLState::shared().bindTexture(FIRST_ARRAY_UNIT + i, GL_TEXTURE_2D_ARRAY,
+                                    arrays[i].texture);
+  }
+
+  // frees the GL objects, call before the context is destroyed
+  void shutdown() {
+    for (auto &entry : entries)
+      unresolve(entry.second);
+    entries.clear();
+    for (TextureArray &array : arrays)
+      GLState::shared().deleteTextures(1, &array.texture);
+    arrays.clear();
+    if (buffer != 0)
+      GLState::shared().deleteBuffers(1, &buffer);
+    buffer = 0;
+    materials.clear();
+    data.clear();
+    lookup.clear();
+    free_materials.clear();
+    waiting.clear();
+  }
+
+private:
+  typedef GLuint64(APIENTRYP GetTextureHandleProc)(GLuint texture);
+  typedef void(APIENTRYP MakeHandleResidentProc)(GLuint64 handle);
+  typedef void(APIENTRYP MakeHandleNonResidentProc)(GLuint64 handle);
+
+  struct Material {
+    std::array<uint32_t, MATERIAL_SLOTS> textures = {};
+    uint32_t references = 0;
+  };
+
+  // a texture referenced by at least one material
+  struct TextureEntry {
+    uint32_t references = 0;
+    bool resolved = false;
+    GLuint64 handle = 0;
+    int32_t array = -1;
+    int32_t layer = -1;
+    // materials to rewrite once the texture is resolved
+    std::vector<uint32_t> materials;
+  };
+
+  // textures of one size, format and mip count
+  struct TextureArray {
+    uint32_t texture = 0;
+    GLenum format;
+    GLsizei width, height, levels;
+    uint32_t capacity = 0;
+    uint32_t count = 0;
+    std::vector<uint32_t> free_layers;
+  };
+
+  bool bindless = false;
+  GetTextureHandleProc getTextureHandle = NULL;
+  MakeHandleResidentProc makeResident = NULL;
+  MakeHandleNonResidentProc makeNonResident = NULL;
+
+  std::vector<Material> materials;
+  // what the buffer holds, parallel to materials
+  std::vector<MaterialData> data;
+  std::map<std::array<uint32_t, MATERIAL_SLOTS>, uint32_t> lookup;
+  std::vector<uint32_t> free_materials;
+  std::unordered_map<uint32_t, TextureEntry> entries;
+  // textures still being loaded
+  std::vector<uint32_t> waiting;
+  std::vector<TextureArray> arrays;
+  uint32_t buffer = 0;
+  bool dirty = true;
+
+  MaterialTable() {}
+
+  static bool hasExtension(const char *extension) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+      const char *name =
+          reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, i));
+      if (name && std::strcmp(name, extension) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  void writeMaterial(uint32_t index) {
+    Material &material = materials[index];
+    MaterialData &out = data[index];
+    for (uint32_t slot = 0; slot < MATERIAL_SLOTS; slot++) {
+      out.handles[slot] = 0;
+      out.arrays[slot] = -1;
+      out.layers[slot] = -1;
+      auto found = entries.find(material.textures[slot]);
+      if (found == entries.end())
+        continue;
+      TextureEntry &entry = found->second;
+      if (material.references > 0 &&
+          std::find(entry.materials.begin(), entry.materials.end(), index) ==
+              entry.materials.end())
+        entry.materials.push_back(index);
+      if (!entry.resolved)
+        continue;
+      out.handles[slot] = entry.handle;
+      out.arrays[slot] = entry.array;
+      out.layers[slot] = entry.layer;
+    }
+    dirty = true;
+  }
+
+  // makes a loaded texture resident, or copies it into its array
+  void resolve(uint32_t id, TextureEntry &entry) {
+    entry.resolved = true;
+    if (bindless) {
+      entry.handle = getTextureHandle(id);
+      makeResident(entry.handle);
+      return;
+    }
+
+    GLint width, height, format, levels = 0;
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D, id);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT,
+                             &format);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D, 0);
+    // textures that failed to load have a single mutable level
+    if (levels == 0)
+      levels = 1;
+
+    const int32_t array = findArray(format, width, height, levels);
+    if (array < 0)
+      return;
+    TextureArray &target = arrays[array];
+    uint32_t layer;
+    if (!target.free_layers.empty()) {
+      layer = target.free_layers.back();
+      target.free_layers.pop_back();
+    } else {
+      if (target.count == target.capacity)
+        grow(target);
+      layer = target.count++;
+    }
+    for (GLint level = 0; level < levels; level++)
+      glCopyImageSubData(id, GL_TEXTURE_2D, level, 0, 0, 0, target.texture,
+                         GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+                         std::max(width >> level, 1),
+                         std::max(height >> level, 1), 1);
+    entry.array = array;
+    entry.layer = layer;
+  }
+
+  void unresolve(TextureEntry &entry) {
+    if (!entry.resolved)
+      return;
+    if (entry.handle != 0)
+      makeNonResident(entry.handle);
+    if (entry.array >= 0)
+      arrays[entry.array].free_layers.push_back(entry.layer);
+    entry = TextureEntry();
+  }
+
+  // returns the array for textures of that kind, creating it if there is
+  // room, -1 otherwise
+  int32_t findArray(GLenum format, GLsizei width, GLsizei height,
+                    GLsizei levels) {
+    for (uint32_t i = 0; i < arrays.size(); i++)
+      if (arrays[i].format == format && arrays[i].width == width &&
+          arrays[i].height == height && arrays[i].levels == levels)
+        return i;
+    if (arrays.size() == MAX_TEXTURE_ARRAYS) {
+      std::cout << "ERROR::MATERIAL_TABLE::OUT_OF_TEXTURE_ARRAYS: " << width
+                << "x" << height << std::endl;
+      return -1;
+    }
+    TextureArray array;
+    array.format = format;
+    array.width = width;
+    array.height = height;
+    array.levels = levels;
+    arrays.push_back(array);
+    return arrays.size() - 1;
+  }
+
+  // reallocates the array with room for twice the layers, copying the ones
+  // in use on the GPU
+  void grow(TextureArray &array) {
+    const uint32_t capacity = std::max(array.capacity * 2, 4u);
+    uint32_t texture;
+    glGenTextures(1, &texture);
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D_ARRAY, texture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, array.levels, array.format,
+                   array.width, array.height, capacity);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                    array.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D_ARRAY, 0);
+    if (array.texture != 0) {
+      for (GLsizei level = 0; level < array.levels; level++)
+        glCopyImageSubData(array.texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                           texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                           std::max(array.width >> level, 1),
+                           std::max(array.height >> level, 1), array.count);
+      GLState::shared().deleteTextures(1, &array.texture);
+    }
+    array.texture = texture;
+    array.capacity = capacity;
+  }
+};
@@ -5,148 +5,254 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "frustum_culling.hpp"
+#include "geometry_buffer.hpp"
 #include "shader.hpp"
+#include "vertex_format.hpp"
+#include "vertex_layout.hpp"
 
 #include <string>
 #include <vector>
 
-#define MAX_BONE_INFLUENCE 4
-
-struct Vertex {
-  // position
-  glm::vec3 Position;
-  // normal
-  glm::vec3 Normal;
-  // texCoords
-  glm::vec2 TexCoords;
-  // tangent
-  glm::vec3 Tangent;
-  // bitangent
-  glm::vec3 Bitangent;
-  // bone indexes which will influence this vertex
-  int m_BoneIDs[MAX_BONE_INFLUENCE];
-  // weights from each bone
-  float m_Weights[MAX_BONE_INFLUENCE];
+// per draw data read by shader.vert from the shader storage buffer at
+// DRAW_DATA_BINDING, indexed by the base instance of the draw
+constexpr uint32_t DRAW_DATA_BINDING = 0;
+
+struct MeshDrawData {
+  // dequantization of packed positions, identity for full vertices
+  glm::vec4 position_scale;
+  glm::vec4 position_offset;
+  // index into the MaterialTable
+  uint32_t material;
+  uint32_t padding[3];
 };
 
+// per instance transform read by shader.vert from the shader storage buffer
+// at INSTANCE_DATA_BINDING, indexed by gl_InstanceID. the normal matrix is a
+// mat4 so the struct has the same layout in std430.
+constexpr uint32_t INSTANCE_DATA_BINDING = 1;
+
+struct InstanceData {
+  glm::mat4 model;
+  glm::mat4 normal_matrix;
+};
+
+inline InstanceData instanceData(const glm::mat4 &model) {
+  return {model, glm::transpose(glm::inverse(model))};
+}
+
 struct Texture {
   uint32_t id;
   std::string type;
   std::string path;
 };
 
-class Mesh {
+// what a texture is used for, Texture::type is the name of its sampler
+// without the number
+enum class TextureType : uint8_t { Diffuse, Specular, Normal, Height, Unknown };
+constexpr uint32_t TEXTURE_TYPES = uint32_t(TextureType::Unknown);
+
+inline TextureType textureType(const std::string &type) {
+  if (type == "texture_diffuse")
+    return TextureType::Diffuse;
+  if (type == "texture_specular")
+    return TextureType::Specular;
+  if (type == "texture_normal")
+    return TextureType::Normal;
+  if (type == "texture_height")
+    return TextureType::Height;
+  return TextureType::Unknown;
+}
+
+// a mesh with vertices of any layout from vertex_layout.hpp. layouts with a
+// full tangent frame may be uploaded as PackedVertex instead, the rest goes
+// to the GPU as is.
+template <typename VertexT> class Mesh {
 public:
   // mesh Data
-  std::vector<Vertex> vertices;
+  std::vector<VertexT> vertices;
   std::vector<uint32_t> indices;
   std::vector<Texture> textures;
-  uint32_t VAO;
+  // range of the mesh in the GeometryBuffer of its GPU layout
+  GeometryAllocation geometry;
+  // layout of the vertex buffer, picked in setupMesh(). packed positions are
+  // dequantized with position_offset + position * position_scale.
+  VertexFormat format = VertexFormat::Full;
+  glm::vec3 position_scale = glm::vec3(1.0f);
+  glm::vec3 position_offset = glm::vec3(0.0f);
+  // material of the mesh in the MaterialTable, assigned by its Model
+  uint32_t material = 0;
+  // bounds of the vertex positions in model space
+  BoundingBox bounds;
+  BoundingSphere sphere;
 
   // constructor
-  Mesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices,
-       std::vector<Texture> textures) {
-    this->vertices = vertices;
-    this->indices = indices;
-    this->textures = textures;
+  Mesh(std::vector<VertexT> vertices, std::vector<uint32_t> indices,
+       std::vector<Texture> textures = {}) {
+    this->vertices = std::move(vertices);
+    this->indices = std::move(indices);
+    this->textures = std::move(textures);
 
     // now that we have all the required data, set the vertex buffers and its
     // attribute pointers.
     setupMesh();
   }
 
-  // render the mesh
-  void Draw(Shader &shader) {
-    // bind appropriate textures
-    uint32_t diffuseNr = 1;
-    uint32_t specularNr = 1;
-    uint32_t normalNr = 1;
-    uint32_t heightNr = 1;
-    for (uint32_t i = 0; i < textures.size(); i++) {
-      glActiveTexture(GL_TEXTURE0 +
-                      i); // active proper texture unit before binding
-      // retrieve texture number (the N in diffuse_textureN)
-      std::string number;
-      std::string name = textures[i].type;
-      if (name == "texture_diffuse")
-        number = std::to_string(diffuseNr++);
-      else if (name == "texture_specular")
-        number = std::to_string(specularNr++); // transfer uint32_t to string
-      else if (name == "texture_normal")
-        number = std::to_string(normalNr++); // transfer uint32_t to string
-      else if (name == "texture_height")
-        number = std::to_string(heightNr++); // transfer uint32_t to string
-
-      // now set the sampler to the correct texture unit
-      glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
-      // and finally bind the texture
-      glBindTexture(GL_TEXTURE_2D, textures[i].id);
+  // constructor for vertex/index data that already lives in memory in its
+  // final layout, e.g. a mapped cooked model
+  Mesh(const VertexT *vertices, size_t vertexCount, const uint32_t *indices,
+       size_t indexCount, std::vector<Texture> textures)
+      : vertices(vertices, vertices + vertexCount),
+        indices(indices, indices + indexCount), textures(textures) {
+    setupMesh();
+  }
+
+  // binds the textures of the mesh and points the samplers at them, for
+  // draws that don't go through the MaterialTable. the first draw with a
+  // program compiles the binding table, later ones only walk it.
+  void bindTextures(const Shader &shader) {
+    const BindingTable &table = bindingTable(shader);
+    table.material_textures.set(false);
+    for (const TextureBinding &binding : table.textures) {
+      GLState::shared().bindTexture(binding.unit, GL_TEXTURE_2D,
+                                    binding.texture);
+      GLState::shared().uniform(table.program, binding.location,
+                                binding.cache, int(binding.unit));
     }
+  }
+
+  // binds the shared VAO holding the mesh and tells the vertex shader how to
+  // decode its vertices
+  void bindGeometry(const Shader &shader) {
+    if (format == VertexFormat::Packed)
+      GeometryBuffer<PackedVertex>::shared().bind();
+    else
+      GeometryBuffer<VertexT>::shared().bind();
+    if constexpr (is_packable_v<VertexT>)
+      bindingTable(shader).packed_vertex.set(format == VertexFormat::Packed);
+  }
+
+  // the VAO bindGeometry() binds
+  uint32_t vertexArray() const {
+    if (format == VertexFormat::Packed)
+      return GeometryBuffer<PackedVertex>::shared().vertexArray();
+    return GeometryBuffer<VertexT>::shared().vertexArray();
+  }
 
-    // draw mesh
-    glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, static_cast<uint32_t>(indices.size()),
-                   GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
+  // binds the position only stream of the shared buffer, for depth only
+  // passes. packed positions are dequantized like in bindGeometry().
+  void bindPositions() const {
+    if (format == VertexFormat::Packed)
+      GeometryBuffer<PackedVertex>::shared().bindPositions();
+    else
+      GeometryBuffer<VertexT>::shared().bindPositions();
+  }
 
-    // always good practice to set everything back to defaults once configured.
-    glActiveTexture(GL_TEXTURE0);
+  uint32_t positionVertexArray() const {
+    if (format == VertexFormat::Packed)
+      return GeometryBuffer<PackedVertex>::shared().positionVertexArray();
+    return GeometryBuffer<VertexT>::shared().positionVertexArray();
+  }
+
+  MeshDrawData drawData() const {
+    return {glm::vec4(position_scale, 0.0f),
+            glm::vec4(position_offset, 0.0f),
+            material,
+            {0, 0, 0}};
+  }
+
+  // render the mesh on its own, the draw data of the mesh has to be at
+  // draw_index in the buffer bound to DRAW_DATA_BINDING and its transform
+  // first in the buffer bound to INSTANCE_DATA_BINDING
+  void Draw(const Shader &shader, uint32_t draw_index = 0) {
+    bindTextures(shader);
+    bindGeometry(shader);
+    glDrawElementsInstancedBaseVertexBaseInstance(
+        GL_TRIANGLES, geometry.index_count, GL_UNSIGNED_INT,
+        (void *)(size_t(geometry.first_index) * sizeof(uint32_t)), 1,
+        geometry.first_vertex, draw_index);
+  }
+
+  // size of the vertex buffer on the GPU
+  size_t vertexBytes() const {
+    return vertices.size() * (format == VertexFormat::Packed
+                                  ? sizeof(PackedVertex)
+                                  : sizeof(VertexT));
+  }
+
+  // hands the geometry back to the shared buffer
+  void release() {
+    if (format == VertexFormat::Packed)
+      GeometryBuffer<PackedVertex>::shared().free(geometry);
+    else
+      GeometryBuffer<VertexT>::shared().free(geometry);
   }
 
 private:
-  // render data
-  uint32_t VBO, EBO;
+  // a texture of the mesh with everything needed to bind it
+  struct TextureBinding {
+    uint32_t unit;
+    uint32_t texture;
+    GLint location;
+    UniformValue *cache;
+    TextureType type;
+  };
 
-  // initializes all the buffer objects/arrays
+  // the textures and uniforms of the mesh resolved against one program
+  struct BindingTable {
+    GLuint program = 0;
+    Uniform<bool> material_textures;
+    Uniform<bool> packed_vertex;
+    std::vector<TextureBinding> textures;
+  };
+  BindingTable bindings;
+
+  const BindingTable &bindingTable(const Shader &shader) {
+    // the texture caches are only good while the handles are
+    if (!bindings.material_textures.resolvedOn(shader.ID))
+      compileBindings(shader);
+    return bindings;
+  }
+
+  // resolves the sampler of every texture, each type is numbered from 1 in
+  // the order of textures: texture_diffuse1, texture_diffuse2, ...
+  void compileBindings(const Shader &shader) {
+    bindings = BindingTable();
+    bindings.program = shader.ID;
+    bindings.material_textures = shader.uniform<bool>("material_textures");
+    bindings.packed_vertex = shader.uniform<bool>("packed_vertex");
+    uint32_t numbers[TEXTURE_TYPES] = {};
+    for (uint32_t i = 0; i < textures.size(); i++) {
+      TextureBinding binding;
+      binding.unit = i;
+      binding.texture = textures[i].id;
+      binding.type = textureType(textures[i].type);
+      binding.location = -1;
+      if (binding.type != TextureType::Unknown)
+        binding.location = shader.location(
+            textures[i].type +
+            std::to_string(++numbers[uint32_t(binding.type)]));
+      binding.cache =
+          GLState::shared().uniformCache(shader.ID, binding.location);
+      bindings.textures.push_back(binding);
+    }
+  }
+
+  // uploads the vertices and indices into the shared buffer of the layout
   void setupMesh() {
-    // create buffers/arrays
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
-
-    glBindVertexArray(VAO);
-    // load data into vertex buffers
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    // A great thing about structs is that their memory layout is sequential for
-    // all its items. The effect is that we can simply pass a pointer to the
-    // struct and it translates perfectly to a glm::vec3/2 array which again
-    // translates to 3/2 floats which translates to a byte array.
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
-                 &vertices[0], GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t),
-                 &indices[0], GL_STATIC_DRAW);
-
-    // set the vertex attribute pointers
-    // vertex Positions
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)0);
-    // vertex normals
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                          (void *)offsetof(Vertex, Normal));
-    // vertex texture coords
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                          (void *)offsetof(Vertex, TexCoords));
-    // vertex tangent
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                          (void *)offsetof(Vertex, Tangent));
-    // vertex bitangent
-    glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                          (void *)offsetof(Vertex, Bitangent));
-    // ids
-    glEnableVertexAttribArray(5);
-    glVertexAttribIPointer(5, 4, GL_INT, sizeof(Vertex),
-                           (void *)offsetof(Vertex, m_BoneIDs));
-
-    // weights
-    glEnableVertexAttribArray(6);
-    glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                          (void *)offsetof(Vertex, m_Weights));
-    glBindVertexArray(0);
+    bounds = boundingBox(vertices.data(), vertices.size());
+    sphere = boundingSphere(vertices.data(), vertices.size(), bounds);
+    if constexpr (is_packable_v<VertexT>) {
+      format = chooseVertexFormat(vertices);
+      if (format == VertexFormat::Packed) {
+        std::vector<PackedVertex> packed =
+            packVertices(vertices, position_scale, position_offset);
+        geometry = GeometryBuffer<PackedVertex>::shared().allocate(
+            packed.data(), packed.size(), indices.data(), indices.size());
+        return;
+      }
+    }
+    geometry = GeometryBuffer<VertexT>::shared().allocate(
+        vertices.data(), vertices.size(), indices.data(), indices.size());
   }
 };
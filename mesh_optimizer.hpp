@@ -0,0 +1,314 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Index and vertex reordering for triangle lists, run on every mesh when it
+// is imported (the result ends up in the cooked model):
+//   1. optimizeVertexCache() reorders the triangles for the post-transform
+//      vertex cache (Tom Forsyth's linear-speed algorithm), so shared
+//      vertices are shaded once instead of once per triangle
+//   2. optimizeOverdraw() reorders clusters of the result so triangles facing
+//      outwards come first, as long as the cache efficiency stays within a
+//      threshold (Tipsify, Sander et al.)
+//   3. optimizeVertexFetch() renumbers the vertices in the order they are
+//      first used, so fetches walk the vertex buffer front to back
+// analyzeVertexCache() measures the result on a simulated FIFO cache.
+
+// cache size assumed by the optimizer and the statistics, close to what
+// current GPUs keep around per batch
+constexpr uint32_t VERTEX_CACHE_SIZE = 32;
+
+struct VertexCacheStatistics {
+  // vertices run through the vertex shader
+  uint32_t transformed = 0;
+  // average cache miss ratio, transformed vertices per triangle (0.5 is the
+  // best possible for large regular grids, 3 the worst)
+  float acmr = 0.0f;
+  // average transform to vertex ratio, transformed vertices per vertex (1 is
+  // optimal)
+  float atvr = 0.0f;
+};
+
+inline VertexCacheStatistics
+analyzeVertexCache(const std::vector<uint32_t> &indices, uint32_t vertex_count,
+                   uint32_t cache_size = VERTEX_CACHE_SIZE) {
+  VertexCacheStatistics statistics;
+  if (indices.empty() || vertex_count == 0)
+    return statistics;
+
+  // FIFO cache, a vertex is in it while it was transformed less than
+  // cache_size transforms ago
+  std::vector<uint32_t> timestamps(vertex_count, 0);
+  uint32_t time = cache_size + 1;
+  for (uint32_t index : indices) {
+    if (time - timestamps[index] > cache_size) {
+      timestamps[index] = time++;
+      statistics.transformed++;
+    }
+  }
+
+  statistics.acmr = float(statistics.transformed) / (indices.size() / 3);
+  statistics.atvr = float(statistics.transformed) / vertex_count;
+  return statistics;
+}
+
+// returns the indices with their triangles reordered for the vertex cache
+inline std::vector<uint32_t>
+optimizeVertexCache(const std::vector<uint32_t> &indices,
+                    uint32_t vertex_count) {
+  const size_t triangle_count = indices.size() / 3;
+  if (triangle_count == 0 || vertex_count == 0)
+    return indices;
+
+  // scoring constants from the original article
+  constexpr float CACHE_DECAY_POWER = 1.5f;
+  constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+  constexpr float VALENCE_BOOST_SCALE = 2.0f;
+  constexpr float VALENCE_BOOST_POWER = 0.5f;
+  constexpr int CACHE_SIZE = VERTEX_CACHE_SIZE;
+
+  // triangles using each vertex, as offsets into one shared array
+  std::vector<uint32_t> offsets(vertex_count + 1, 0);
+  for (uint32_t index : indices)
+    offsets[index + 1]++;
+  for (uint32_t v = 0; v < vertex_count; v++)
+    offsets[v + 1] += offsets[v];
+  std::vector<uint32_t> adjacency(indices.size());
+  {
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+      adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+  }
+
+  // triangles still to be emitted per vertex, packed at the front of each
+  // vertex's adjacency range
+  std::vector<uint32_t> live(vertex_count);
+  for (uint32_t v = 0; v < vertex_count; v++)
+    live[v] = offsets[v + 1] - offsets[v];
+
+  auto vertexScore = [&](int cache_position, uint32_t live_triangles) {
+    if (live_triangles == 0)
+      return -1.0f;
+    float score = 0.0f;
+    if (cache_position >= 0) {
+      if (cache_position < 3)
+        // the last triangle's vertices get a fixed score so the next
+        // triangle doesn't just reuse its edge all the time
+        score = LAST_TRIANGLE_SCORE;
+      else
+        score = std::pow(1.0f - float(cache_position - 3) / (CACHE_SIZE - 3),
+                         CACHE_DECAY_POWER);
+    }
+    // vertices with few triangles left get a boost to get rid of them
+    return score + VALENCE_BOOST_SCALE *
+                       std::pow(float(live_triangles), -VALENCE_BOOST_POWER);
+  };
+
+  std::vector<float> vertex_scores(vertex_count);
+  for (uint32_t v = 0; v < vertex_count; v++)
+    vertex_scores[v] = vertexScore(-1, live[v]);
+
+  std::vector<float> triangle_scores(triangle_count);
+  for (size_t t = 0; t < triangle_count; t++)
+    triangle_scores[t] = vertex_scores[indices[t * 3 + 0]] +
+                         vertex_scores[indices[t * 3 + 1]] +
+                         vertex_scores[indices[t * 3 + 2]];
+
+  std::vector<bool> emitted(triangle_count, false);
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+
+  // simulated LRU cache, with room for the three vertices pushed in front
+  std::vector<uint32_t> cache, next_cache;
+  cache.reserve(CACHE_SIZE + 3);
+  next_cache.reserve(CACHE_SIZE + 3);
+
+  // start with the best triangle overall
+  size_t best = std::max_element(triangle_scores.begin(),
+                                 triangle_scores.end()) -
+                triangle_scores.begin();
+  // scan position for the fallback when the cache holds no live triangles
+  size_t cursor = 0;
+
+  for (size_t emitted_count = 0; emitted_count < triangle_count;
+       emitted_count++) {
+    emitted[best] = true;
+    const uint32_t *triangle = &indices[best * 3];
+    result.insert(result.end(), triangle, triangle + 3);
+
+    // move the triangle's vertices to the front of the cache
+    next_cache.clear();
+    for (int i = 0; i < 3; i++) {
+      const uint32_t v = triangle[i];
+      // degenerate triangles name a vertex twice, it only takes one slot
+      if (std::find(triangle, triangle + i, v) == triangle + i)
+        next_cache.push_back(v);
+
+      // take the triangle out of the vertex's live range
+      uint32_t *begin = &adjacency[offsets[v]];
+      uint32_t *end = begin + live[v];
+      std::iter_swap(std::find(begin, end, uint32_t(best)), end - 1);
+      live[v]--;
+    }
+    for (uint32_t v : cache)
+      if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+        next_cache.push_back(v);
+
+    // rescore every vertex that is or was in the cache, and their triangles
+    for (size_t i = 0; i < next_cache.size(); i++) {
+      const uint32_t v = next_cache[i];
+      const int position = i < size_t(CACHE_SIZE) ? int(i) : -1;
+      const float delta = vertexScore(position, live[v]) - vertex_scores[v];
+      vertex_scores[v] += delta;
+      for (uint32_t j = offsets[v]; j < offsets[v] + live[v]; j++)
+        triangle_scores[adjacency[j]] += delta;
+    }
+    if (next_cache.size() > size_t(CACHE_SIZE))
+      next_cache.resize(CACHE_SIZE);
+    std::swap(cache, next_cache);
+
+    // the next triangle is the best one using a cached vertex
+    float best_score = -std::numeric_limits<float>::max();
+    bool found = false;
+    for (uint32_t v : cache) {
+      for (uint32_t j = offsets[v]; j < offsets[v] + live[v]; j++) {
+        const uint32_t t = adjacency[j];
+        if (triangle_scores[t] > best_score) {
+          best_score = triangle_scores[t];
+          best = t;
+          found = true;
+        }
+      }
+    }
+    if (!found) {
+      // the cache ran dry, continue with the next triangle in input order
+      while (cursor < triangle_count && emitted[cursor])
+        cursor++;
+      best = cursor;
+    }
+  }
+
+  return result;
+}
+
+// reorders the clusters of a cache optimized index list from the outside of
+// the mesh inwards, so front facing triangles occlude the rest early. clusters
+// are split wherever the cache simulation restarts from scratch, the result is
+// only kept if its ACMR stays within threshold times the input's.
+template <typename VertexT>
+std::vector<uint32_t> optimizeOverdraw(const std::vector<uint32_t> &indices,
+                                       const std::vector<VertexT> &vertices,
+                                       float threshold = 1.05f) {
+  const size_t triangle_count = indices.size() / 3;
+  if (triangle_count < 2)
+    return indices;
+
+  // a new cluster starts at every triangle that misses the cache with all
+  // three vertices, reordering whole clusters barely changes the ACMR
+  std::vector<size_t> cluster_starts;
+  {
+    std::vector<uint32_t> timestamps(vertices.size(), 0);
+    uint32_t time = VERTEX_CACHE_SIZE + 1;
+    for (size_t t = 0; t < triangle_count; t++) {
+      int misses = 0;
+      for (int i = 0; i < 3; i++) {
+        const uint32_t v = indices[t * 3 + i];
+        if (time - timestamps[v] > VERTEX_CACHE_SIZE) {
+          timestamps[v] = time++;
+          misses++;
+        }
+      }
+      if (t == 0 || misses == 3)
+        cluster_starts.push_back(t);
+    }
+  }
+  if (cluster_starts.size() < 2)
+    return indices;
+  cluster_starts.push_back(triangle_count);
+
+  // area weighted centroid of the mesh
+  glm::vec3 mesh_centroid(0.0f);
+  float mesh_area = 0.0f;
+  for (size_t t = 0; t < triangle_count; t++) {
+    const glm::vec3 &a = vertices[indices[t * 3 + 0]].Position;
+    const glm::vec3 &b = vertices[indices[t * 3 + 1]].Position;
+    const glm::vec3 &c = vertices[indices[t * 3 + 2]].Position;
+    const float area = glm::length(glm::cross(b - a, c - a));
+    mesh_centroid += (a + b + c) * (area / 3.0f);
+    mesh_area += area;
+  }
+  if (mesh_area > 0.0f)
+    mesh_centroid /= mesh_area;
+
+  // sort key: how far the cluster faces away from the mesh center
+  struct Cluster {
+    size_t begin, end;
+    float sort_key;
+  };
+  std::vector<Cluster> clusters;
+  for (size_t i = 0; i + 1 < cluster_starts.size(); i++) {
+    Cluster cluster = {cluster_starts[i], cluster_starts[i + 1], 0.0f};
+    glm::vec3 centroid(0.0f), normal(0.0f);
+    float area = 0.0f;
+    for (size_t t = cluster.begin; t < cluster.end; t++) {
+      const glm::vec3 &a = vertices[indices[t * 3 + 0]].Position;
+      const glm::vec3 &b = vertices[indices[t * 3 + 1]].Position;
+      const glm::vec3 &c = vertices[indices[t * 3 + 2]].Position;
+      const glm::vec3 cross = glm::cross(b - a, c - a);
+      const float triangle_area = glm::length(cross);
+      centroid += (a + b + c) * (triangle_area / 3.0f);
+      normal += cross;
+      area += triangle_area;
+    }
+    if (area > 0.0f)
+      centroid /= area;
+    const float normal_length = glm::length(normal);
+    if (normal_length > 0.0f)
+      cluster.sort_key =
+          glm::dot(centroid - mesh_centroid, normal / normal_length);
+    clusters.push_back(cluster);
+  }
+
+  std::stable_sort(clusters.begin(), clusters.end(),
+                   [](const Cluster &a, const Cluster &b) {
+                     return a.sort_key > b.sort_key;
+                   });
+
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+  for (const Cluster &cluster : clusters)
+    result.insert(result.end(), indices.begin() + cluster.begin * 3,
+                  indices.begin() + cluster.end * 3);
+
+  const uint32_t vertex_count = vertices.size();
+  if (analyzeVertexCache(result, vertex_count).acmr >
+      analyzeVertexCache(indices, vertex_count).acmr * threshold)
+    return indices;
+  return result;
+}
+
+// renumbers the vertices in order of first use, in place. vertices no index
+// refers to are dropped.
+template <typename VertexT>
+void optimizeVertexFetch(std::vector<VertexT> &vertices,
+                         std::vector<uint32_t> &indices) {
+  constexpr uint32_t UNUSED = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> remap(vertices.size(), UNUSED);
+  std::vector<VertexT> reordered;
+  reordered.reserve(vertices.size());
+
+  for (uint32_t &index : indices) {
+    if (remap[index] == UNUSED) {
+      remap[index] = reordered.size();
+      reordered.push_back(vertices[index]);
+    }
+    index = remap[index];
+  }
+  vertices = std::move(reordered);
+}
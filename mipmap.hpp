@@ -0,0 +1,277 @@
+#pragma once
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "compressed_texture.hpp"
+#include "hash.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// CPU mip chain generation for RGBA8 images. Every level is a 2x2 box filter
+// of the one above it, vectorized with SSE2 where available. Color (diffuse)
+// maps are filtered in linear space so the smaller levels don't darken. The
+// generated chains are kept in a "<image>.mips" cache next to the source.
+
+// sRGB <-> linear conversion tables
+struct SrgbTables {
+  float to_linear[256];
+  // indexed by linear value * 4095
+  uint8_t to_srgb[4096];
+
+  SrgbTables() {
+    for (int i = 0; i < 256; i++) {
+      float c = i / 255.0f;
+      to_linear[i] = c <= 0.04045f ? c / 12.92f
+                                   : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i = 0; i < 4096; i++) {
+      float l = i / 4095.0f;
+      float c = l <= 0.0031308f ? l * 12.92f
+                                : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+      to_srgb[i] = uint8_t(std::clamp(c * 255.0f + 0.5f, 0.0f, 255.0f));
+    }
+  }
+
+  static const SrgbTables &get() {
+    static const SrgbTables tables;
+    return tables;
+  }
+};
+
+// plain scalar version of downsampleBox(), kept as the reference the SIMD
+// code is checked and benchmarked against
+inline void downsampleBoxScalar(const uint8_t *src, uint32_t width,
+                                uint32_t height, uint8_t *dst) {
+  const uint32_t out_width = std::max(width / 2, 1u);
+  const uint32_t out_height = std::max(height / 2, 1u);
+  for (uint32_t y = 0; y < out_height; y++) {
+    const uint8_t *row0 = src + size_t(std::min(y * 2, height - 1)) * width * 4;
+    const uint8_t *row1 =
+        src + size_t(std::min(y * 2 + 1, height - 1)) * width * 4;
+    for (uint32_t x = 0; x < out_width; x++) {
+      const uint32_t x0 = std::min(x * 2, width - 1) * 4;
+      const uint32_t x1 = std::min(x * 2 + 1, width - 1) * 4;
+      for (uint32_t c = 0; c < 4; c++)
+        dst[(size_t(y) * out_width + x) * 4 + c] =
+            (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) /
+            4;
+    }
+  }
+}
+
+// halves an RGBA8 image with a 2x2 box filter, odd edges repeat the last
+// row/column
+inline void downsampleBox(const uint8_t *src, uint32_t width, uint32_t height,
+                          uint8_t *dst) {
+#if defined(__SSE2__)
+  const uint32_t out_width = std::max(width / 2, 1u);
+  const uint32_t out_height = std::max(height / 2, 1u);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(2);
+
+  for (uint32_t y = 0; y < out_height; y++) {
+    const uint8_t *row0 = src + size_t(std::min(y * 2, height - 1)) * width * 4;
+    const uint8_t *row1 =
+        src + size_t(std::min(y * 2 + 1, height - 1)) * width * 4;
+    uint8_t *out = dst + size_t(y) * out_width * 4;
+
+    // two output pixels from four input pixels of both rows per iteration
+    uint32_t x = 0;
+    for (; x * 2 + 4 <= width && x + 2 <= out_width; x += 2) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(row0 + x * 8));
+      __m128i b = _mm_loadu_si128((const __m128i *)(row1 + x * 8));
+      // vertical sums of pixels 0,1 and 2,3 widened to 16 bits
+      __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                 _mm_unpacklo_epi8(b, zero));
+      __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                 _mm_unpackhi_epi8(b, zero));
+      // horizontal sums, pixel 0+1 and pixel 2+3
+      lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+      hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+      __m128i sum = _mm_unpacklo_epi64(lo, hi);
+      sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+      _mm_storel_epi64((__m128i *)(out + x * 4), _mm_packus_epi16(sum, zero));
+    }
+
+    // odd widths and the tail
+    for (; x < out_width; x++) {
+      const uint32_t x0 = std::min(x * 2, width - 1) * 4;
+      const uint32_t x1 = std::min(x * 2 + 1, width - 1) * 4;
+      for (uint32_t c = 0; c < 4; c++)
+        out[x * 4 + c] =
+            (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) /
+            4;
+    }
+  }
+#else
+  downsampleBoxScalar(src, width, height, dst);
+#endif
+}
+
+// same as downsampleBox() but averages the color channels in linear space,
+// alpha stays linear
+inline void downsampleBoxSrgb(const uint8_t *src, uint32_t width,
+                              uint32_t height, uint8_t *dst) {
+  const SrgbTables &tables = SrgbTables::get();
+  const uint32_t out_width = std::max(width / 2, 1u);
+  const uint32_t out_height = std::max(height / 2, 1u);
+
+  for (uint32_t y = 0; y < out_height; y++) {
+    const uint8_t *row0 = src + size_t(std::min(y * 2, height - 1)) * width * 4;
+    const uint8_t *row1 =
+        src + size_t(std::min(y * 2 + 1, height - 1)) * width * 4;
+    uint8_t *out = dst + size_t(y) * out_width * 4;
+
+    for (uint32_t x = 0; x < out_width; x++) {
+      const uint8_t *p[4] = {row0 + std::min(x * 2, width - 1) * 4,
+                             row0 + std::min(x * 2 + 1, width - 1) * 4,
+                             row1 + std::min(x * 2, width - 1) * 4,
+                             row1 + std::min(x * 2 + 1, width - 1) * 4};
+      float result[4];
+#if defined(__SSE2__)
+      // one RGBA pixel per register
+      __m128 sum = _mm_setzero_ps();
+      for (int i = 0; i < 4; i++)
+        sum = _mm_add_ps(sum, _mm_setr_ps(tables.to_linear[p[i][0]],
+                                          tables.to_linear[p[i][1]],
+                                          tables.to_linear[p[i][2]],
+                                          p[i][3] / 255.0f));
+      _mm_storeu_ps(result, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#else
+      for (int c = 0; c < 4; c++) {
+        result[c] = 0.0f;
+        for (int i = 0; i < 4; i++)
+          result[c] += c < 3 ? tables.to_linear[p[i][c]] : p[i][c] / 255.0f;
+        result[c] *= 0.25f;
+      }
+#endif
+      for (int c = 0; c < 3; c++)
+        out[x * 4 + c] = tables.to_srgb[int(result[c] * 4095.0f + 0.5f)];
+      out[x * 4 + 3] = uint8_t(result[3] * 255.0f + 0.5f);
+    }
+  }
+}
+
+// builds the whole chain down to 1x1 from an RGBA8 image
+inline TextureImage generateMipChain(const uint8_t *rgba, uint32_t width,
+                                     uint32_t height, bool srgb) {
+  TextureImage image;
+  image.format = GL_RGBA8;
+
+  const uint32_t level_count = mipLevelCount(width, height);
+  size_t total = 0;
+  for (uint32_t i = 0; i < level_count; i++) {
+    TextureImage::Level level;
+    level.width = std::max(width >> i, 1u);
+    level.height = std::max(height >> i, 1u);
+    level.offset = total;
+    level.size = size_t(level.width) * level.height * 4;
+    total += level.size;
+    image.levels.push_back(level);
+  }
+
+  image.data.resize(total);
+  std::memcpy(image.data.data(), rgba, image.levels[0].size);
+  for (uint32_t i = 1; i < level_count; i++) {
+    const TextureImage::Level &parent = image.levels[i - 1];
+    const uint8_t *src = image.data.data() + parent.offset;
+    uint8_t *dst = image.data.data() + image.levels[i].offset;
+    if (srgb)
+      downsampleBoxSrgb(src, parent.width, parent.height, dst);
+    else
+      downsampleBox(src, parent.width, parent.height, dst);
+  }
+  return image;
+}
+
+// mip cache file: header followed by the tightly packed RGBA8 levels
+constexpr char MIP_CACHE_MAGIC[4] = {'M', 'I', 'P', 'S'};
+constexpr uint32_t MIP_CACHE_VERSION = 1;
+
+struct MipCacheHeader {
+  char magic[4];
+  uint32_t version;
+  // hash of the source image the chain was generated from
+  uint64_t source_hash;
+  uint32_t width;
+  uint32_t height;
+  uint32_t level_count;
+  uint32_t srgb;
+};
+
+inline std::string mipCachePath(const std::string &filename) {
+  return filename + ".mips";
+}
+
+// returns false if the cache is missing or doesn't match the source
+inline bool readMipCache(const std::string &filename, uint64_t source_hash,
+                         bool srgb, TextureImage &image) {
+  image = TextureImage();
+  std::vector<uint8_t> bytes = readFileBytes(mipCachePath(filename));
+  if (bytes.size() < sizeof(MipCacheHeader))
+    return false;
+
+  MipCacheHeader header;
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  if (std::memcmp(header.magic, MIP_CACHE_MAGIC, sizeof(MIP_CACHE_MAGIC)) ||
+      header.version != MIP_CACHE_VERSION ||
+      header.source_hash != source_hash || header.srgb != uint32_t(srgb) ||
+      header.width == 0 || header.height == 0 ||
+      header.level_count != mipLevelCount(header.width, header.height))
+    return false;
+
+  image.format = GL_RGBA8;
+  size_t offset = 0;
+  for (uint32_t i = 0; i < header.level_count; i++) {
+    TextureImage::Level level;
+    level.width = std::max(header.width >> i, 1u);
+    level.height = std::max(header.height >> i, 1u);
+    level.offset = offset;
+    level.size = size_t(level.width) * level.height * 4;
+    offset += level.size;
+    image.levels.push_back(level);
+  }
+  if (bytes.size() != sizeof(MipCacheHeader) + offset) {
+    image = TextureImage();
+    return false;
+  }
+
+  bytes.erase(bytes.begin(), bytes.begin() + sizeof(MipCacheHeader));
+  image.data = std::move(bytes);
+  return true;
+}
+
+inline bool writeMipCache(const std::string &filename, uint64_t source_hash,
+                          bool srgb, const TextureImage &image) {
+  MipCacheHeader header;
+  std::memcpy(header.magic, MIP_CACHE_MAGIC, sizeof(MIP_CACHE_MAGIC));
+  header.version = MIP_CACHE_VERSION;
+  header.source_hash = source_hash;
+  header.width = image.levels[0].width;
+  header.height = image.levels[0].height;
+  header.level_count = image.levels.size();
+  header.srgb = srgb;
+
+  // write to a temporary file so concurrent readers never see half of it
+  const std::string path = mipCachePath(filename);
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(image.data.data()),
+             image.data.size());
+  file.close();
+  if (!file || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -9,11 +9,29 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <stb_image.h>
 
+#include "frustum_culling.hpp"
+#include "gpu_culling.hpp"
+#include "hash.hpp"
+#include "material_table.hpp"
 #include "mesh.hpp"
+#include "mesh_optimizer.hpp"
+#include "occlusion_culling.hpp"
+#include "model_cache.hpp"
+#include "render_queue.hpp"
+#include "ring_buffer.hpp"
 #include "shader.hpp"
+#include "shader_permutations.hpp"
+#include "texture_cache.hpp"
+#include "texture_loader.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 uint32_t TextureFromFile(const char *path, const std::string &directory,
@@ -22,10 +40,10 @@ uint32_t TextureFromFile(const char *path, const std::string &directory,
 class Model {
 public:
   // model data
-  std::vector<Texture>
-      textures_loaded; // stores all the textures loaded so far, optimization to
-                       // make sure textures aren't loaded more than once.
-  std::vector<Mesh> meshes;
+  std::unordered_map<std::string, Texture>
+      textures_loaded; // textures referenced by this model keyed by their
+                       // path, each holds one reference in the TextureCache.
+  std::vector<Mesh<Vertex>> meshes;
   std::string directory;
   bool gammaCorrection;
 
@@ -36,15 +54,250 @@ public:
 
   Model() : gammaCorrection(false) {}
 
-  // draws the model, and thus all its meshes
-  void Draw(Shader &shader) {
-    for (uint32_t i = 0; i < meshes.size(); i++)
-      meshes[i].Draw(shader);
+  // meshes and texture references are GL resources, copies would free them
+  // twice
+  Model(const Model &) = delete;
+  Model &operator=(const Model &) = delete;
+
+  ~Model() { unload(); }
+
+  // frees the meshes and hands the textures back to the TextureCache, has to
+  // be called while the context is still alive
+  void unload() {
+    // materials first, they hold on to the textures
+    for (Mesh<Vertex> &mesh : meshes) {
+      if (!batches.empty())
+        MaterialTable::shared().release(mesh.material);
+      mesh.release();
+    }
+    meshes.clear();
+    batches.clear();
+    commands.clear();
+    occluder = OccluderMesh();
+    gpu_culling.release();
+    visible_commands.clear();
+    visible_batches.clear();
+    if (draw_data_buffer != 0)
+      GLState::shared().deleteBuffers(1, &draw_data_buffer);
+    draw_data_buffer = 0;
+
+    for (auto &loaded : textures_loaded)
+      TextureCache::shared().release(loaded.second.id);
+    textures_loaded.clear();
+  }
+
+  // what the last Draw() culled, meshes count once per instanced draw
+  CullCounts instance_culling, mesh_culling;
+  // triangles standing in for the model in an OcclusionBuffer
+  OccluderMesh occluder;
+  // buffers of DrawCulled(), created by its first call
+  GPUCullSet gpu_culling;
+
+  // adds the instances closest to camera_pos as occluders
+  void addOccluders(OcclusionBuffer &buffer, const glm::vec3 &camera_pos,
+                    const InstanceData *instances, uint32_t instance_count) {
+    if (occluder.empty())
+      return;
+    occluder_candidates.clear();
+    for (uint32_t i = 0; i < instance_count; i++)
+      occluder_candidates.push_back(
+          {glm::length(glm::vec3(instances[i].model[3]) - camera_pos), i});
+    const uint32_t count = std::min(instance_count, OCCLUDER_INSTANCES);
+    std::partial_sort(occluder_candidates.begin(),
+                      occluder_candidates.begin() + count,
+                      occluder_candidates.end());
+    for (uint32_t i = 0; i < count; i++)
+      buffer.addOccluder(occluder,
+                         instances[occluder_candidates[i].second].model);
+  }
+
+  // queues the model, and thus all its meshes, to be drawn once per instance
+  // with one multi draw per vertex layout. textures come from the
+  // MaterialTable, no texture state changes between meshes, so the material
+  // field of the sort keys stays 0. the batches are keyed by the instance
+  // closest to the camera.
+  // instances outside the frustum of the queue or behind its occluders are
+  // dropped, then meshes outside of it or occluded in every instance left.
+  // the visible instance transforms and draw commands of this frame are
+  // streamed through frame_data right away. every batch is drawn with the
+  // variant of shaders for the lights in features and its material maps.
+  // with a depth_shader the batches are also queued into the depth pre-pass,
+  // drawing only positions.
+  void Draw(RenderQueue &queue, ShaderPermutations &shaders, uint32_t features,
+            RingBuffer &frame_data, const InstanceData *instances,
+            uint32_t instance_count, const Shader *depth_shader = NULL) {
+    instance_culling = mesh_culling = CullCounts();
+    if (commands.empty() || instance_count == 0)
+      return;
+
+    instance_spheres.clear();
+    for (uint32_t i = 0; i < instance_count; i++)
+      instance_spheres.push(transformSphere(sphere, instances[i].model));
+    visible_instances.resize(instance_count);
+    uint32_t visible_count = cullSpheres(queue.frustum, instance_spheres,
+                                         visible_instances.data());
+    instance_culling.culled = instance_count - visible_count;
+    if (visible_count == 0) {
+      mesh_culling.culled = commands.size();
+      return;
+    }
+    if (queue.occlusion != NULL) {
+      uint32_t unoccluded = 0;
+      for (uint32_t i = 0; i < visible_count; i++) {
+        const uint32_t index = visible_instances[i];
+        if (!queue.occlusion->occluded(
+                transformBox(bounds, instances[index].model)))
+          visible_instances[unoccluded++] = index;
+      }
+      instance_culling.occluded = visible_count - unoccluded;
+      visible_count = unoccluded;
+      if (visible_count == 0) {
+        mesh_culling.occluded = commands.size();
+        return;
+      }
+    }
+    instance_culling.visible = visible_count;
+
+    visible_commands.clear();
+    visible_batches.clear();
+    for (const DrawBatch &batch : batches) {
+      DrawBatch visible_batch = {batch.first_mesh,
+                                 uint32_t(visible_commands.size()), 0,
+                                 batch.features};
+      for (uint32_t i = 0; i < batch.command_count; i++) {
+        DrawElementsIndirectCommand command =
+            commands[batch.first_command + i];
+        // the base instance is the index of the mesh
+        const Mesh<Vertex> &mesh = meshes[command.baseInstance];
+        if (!meshInFrustum(queue.frustum, mesh, instances, visible_count)) {
+          mesh_culling.culled++;
+          continue;
+        }
+        if (meshOccluded(queue.occlusion, mesh, instances, visible_count)) {
+          mesh_culling.occluded++;
+          continue;
+        }
+        command.instanceCount = visible_count;
+        visible_commands.push_back(command);
+        visible_batch.command_count++;
+      }
+      if (visible_batch.command_count > 0)
+        visible_batches.push_back(visible_batch);
+    }
+    mesh_culling.visible = visible_commands.size();
+    if (visible_commands.empty())
+      return;
+
+    BatchDraw draw;
+    draw.model = this;
+    draw.indirect_buffer = frame_data.buffer;
+    draw.instances = frame_data.allocate(visible_count * sizeof(InstanceData),
+                                         frame_data.storage_alignment);
+    if (draw.instances.data == NULL)
+      return;
+    InstanceData *visible = static_cast<InstanceData *>(draw.instances.data);
+    uint32_t depth = UINT32_MAX;
+    for (uint32_t i = 0; i < visible_count; i++) {
+      visible[i] = instances[visible_instances[i]];
+      depth = std::min(depth, queue.depth(glm::vec3(visible[i].model[3]),
+                                          RENDER_PASS_OPAQUE));
+    }
+    const RingAllocation indirect =
+        frame_data.write(visible_commands.data(), visible_commands.size(),
+                         sizeof(DrawElementsIndirectCommand));
+    if (indirect.data == NULL)
+      return;
+    resolveDepthUniforms(depth_shader);
+
+    for (const DrawBatch &batch : visible_batches) {
+      const Mesh<Vertex> &first_mesh = meshes[batch.first_mesh];
+      draw.first_mesh = batch.first_mesh;
+      draw.command_count = batch.command_count;
+      draw.indirect = indirect.offset + size_t(batch.first_command) *
+                                            sizeof(DrawElementsIndirectCommand);
+      draw.variant = variantOf(shaders, features, batch);
+      const Shader &shader = resolveVariant(shaders, draw.variant);
+      draw.shader = &shader;
+      draw.positions_only = false;
+      queue.submit(RenderQueue::key(RENDER_PASS_OPAQUE, shader.ID, 0,
+                                    first_mesh.vertexArray(), depth),
+                   drawBatch, draw);
+      if (depth_shader == NULL)
+        continue;
+      draw.shader = depth_shader;
+      draw.positions_only = true;
+      queue.submit(RenderQueue::key(RENDER_PASS_DEPTH, depth_shader->ID, 0,
+                                    first_mesh.positionVertexArray(), depth),
+                   drawBatch, draw);
+    }
+  }
+
+  // queues the model like Draw() for the instance_count instances in
+  // instance_buffer, a GL buffer of InstanceData, culled on the GPU by
+  // gpu_culling against the camera and depth pyramid of GPUCulling instead.
+  // what is left never comes back to the CPU, every batch is one
+  // glMultiDrawElementsIndirectCount, so nothing here grows with the number
+  // of instances. the batches are keyed without depth. a depth_shader
+  // queues them into the depth pre-pass as well.
+  void DrawCulled(RenderQueue &queue, ShaderPermutations &shaders,
+                  uint32_t features, RingBuffer &frame_data,
+                  uint32_t instance_buffer, uint32_t instance_count,
+                  const Shader *depth_shader = NULL) {
+    if (commands.empty() || instance_count == 0)
+      return;
+    if (gpu_culling.empty())
+      gpu_culling.init(meshCullData(), batches.size(), commands.size(),
+                       bounds);
+    gpu_culling.cull(frame_data, instance_buffer, instance_count);
+    resolveDepthUniforms(depth_shader);
+
+    CulledBatchDraw draw;
+    draw.model = this;
+    draw.instance_buffer = instance_buffer;
+    for (uint32_t i = 0; i < batches.size(); i++) {
+      const Mesh<Vertex> &first_mesh = meshes[batches[i].first_mesh];
+      draw.batch = i;
+      draw.variant = variantOf(shaders, features, batches[i]);
+      const Shader &shader = resolveVariant(shaders, draw.variant);
+      draw.shader = &shader;
+      draw.positions_only = false;
+      queue.submit(RenderQueue::key(RENDER_PASS_OPAQUE, shader.ID, 0,
+                                    first_mesh.vertexArray(), 0),
+                   drawCulledBatch, draw);
+      if (depth_shader == NULL)
+        continue;
+      draw.shader = depth_shader;
+      draw.positions_only = true;
+      queue.submit(RenderQueue::key(RENDER_PASS_DEPTH, depth_shader->ID, 0,
+                                    first_mesh.positionVertexArray(), 0),
+                   drawCulledBatch, draw);
+    }
   }
 
   // loads a model with supported ASSIMP extensions from file and stores the
-  // resulting meshes in the meshes vector.
+  // resulting meshes in the meshes vector. the result of the import is cooked
+  // into "<path>.cooked", later runs map that file instead of going through
+  // ASSIMP as long as the source file and its material files haven't
+  // changed.
   void loadModel(std::string const &path) {
+    // retrieve the directory path of the filepath
+    directory = path.substr(0, path.find_last_of('/'));
+
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t source_hash = sourceHash(path);
+    const std::string cooked_path = path + ".cooked";
+
+    CookedModel cooked;
+    if (source_hash != 0 && cooked.open(cooked_path, source_hash)) {
+      loadCooked(cooked);
+      std::cout << "MODEL_CACHE:: " << path << " loaded from cache in "
+                << elapsedMs(start) << " ms (assimp import took "
+                << cooked.header().import_ms << " ms)" << std::endl;
+      printVertexMemory(path);
+      buildDrawCommands();
+      return;
+    }
+
     // read file via ASSIMP
     Assimp::Importer importer;
     const aiScene *scene = importer.ReadFile(
@@ -57,83 +310,453 @@ public:
       std::cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
       return;
     }
-    // retrieve the directory path of the filepath
-    directory = path.substr(0, path.find_last_of('/'));
 
-    // process ASSIMP's root node recursively
-    processNode(scene->mRootNode, scene);
+    // collect the meshes of ASSIMP's node tree in node order, convert them on
+    // the worker threads and create the GL objects here, on the thread that
+    // owns the context
+    std::vector<aiMesh *> ai_meshes;
+    processNode(scene->mRootNode, scene, ai_meshes);
+
+    std::vector<MeshData> mesh_data(ai_meshes.size());
+    ThreadPool::shared().parallelFor(ai_meshes.size(), [&](size_t i) {
+      mesh_data[i] = processMesh(ai_meshes[i], scene);
+    });
+
+    meshes.reserve(mesh_data.size());
+    for (MeshData &data : mesh_data) {
+      std::cout << "MESH_OPTIMIZER:: mesh " << meshes.size() << ", "
+                << data.indices.size() / 3 << " triangles, ACMR "
+                << data.imported.acmr << " -> " << data.optimized.acmr
+                << ", ATVR " << data.imported.atvr << " -> "
+                << data.optimized.atvr << std::endl;
+      for (Texture &texture : data.textures)
+        texture = loadTexture(texture.path.c_str(), texture.type);
+      meshes.push_back(Mesh<Vertex>(std::move(data.vertices),
+                                    std::move(data.indices),
+                                    std::move(data.textures)));
+    }
+
+    const double import_ms = elapsedMs(start);
+    std::cout << "MODEL_CACHE:: " << path << " imported with assimp in "
+              << import_ms << " ms" << std::endl;
+    if (source_hash != 0)
+      writeCookedModel(cooked_path, source_hash, meshes, import_ms);
+    printVertexMemory(path);
+    buildDrawCommands();
   }
 
 private:
-  // processes a node in a recursive fashion. Processes each individual mesh
+  // meshes drawn by one glMultiDrawElementsIndirect, their commands are
+  // consecutive in the indirect buffer. they share the material features of
+  // their shader variant.
+  struct DrawBatch {
+    uint32_t first_mesh;
+    uint32_t first_command;
+    uint32_t command_count;
+    uint32_t features;
+  };
+  std::vector<DrawBatch> batches;
+  // draw commands of all batches, written to the frame's RingBuffer region
+  // on every Draw()
+  std::vector<DrawElementsIndirectCommand> commands;
+  // MeshDrawData per mesh, indexed by the base instance of its command
+  uint32_t draw_data_buffer = 0;
+  // resolved on the first Draw() with a variant, by variant, and the depth
+  // program
+  struct VariantUniforms {
+    Uniform<bool> material_textures;
+    Uniform<bool> gpu_culled;
+  };
+  VariantUniforms variant_uniforms[SHADER_VARIANTS];
+  Uniform<bool> depth_gpu_culled;
+
+  // meshes are culled one by one as long as at most MESH_CULL_INSTANCES
+  // instances are visible. with more, nearly every mesh is visible in one of
+  // them and the tests cost more than the draws they save.
+  constexpr static uint32_t MESH_CULL_INSTANCES = 16;
+  // bounds of all meshes, set by buildDrawCommands()
+  BoundingBox bounds;
+  BoundingSphere sphere;
+  // meshes of the occluder, biggest first, as long as they fit
+  constexpr static uint32_t OCCLUDER_TRIANGLES = 4096;
+  // instances closest to the camera rendered as occluders
+  constexpr static uint32_t OCCLUDER_INSTANCES = 16;
+  // distance and index of every instance, scratch of addOccluders()
+  std::vector<std::pair<float, uint32_t>> occluder_candidates;
+  // culling scratch, kept between frames so Draw() doesn't allocate
+  SphereBatch instance_spheres;
+  std::vector<uint32_t> visible_instances;
+  std::vector<DrawElementsIndirectCommand> visible_commands;
+  std::vector<DrawBatch> visible_batches;
+
+  // one batch of one Draw(), run by the RenderQueue. the depth pre-pass
+  // draws only the positions.
+  struct BatchDraw {
+    Model *model;
+    const Shader *shader;
+    uint32_t variant;
+    bool positions_only;
+    uint32_t first_mesh;
+    uint32_t command_count;
+    uint32_t indirect_buffer;
+    RingAllocation instances;
+    GLintptr indirect;
+  };
+
+  static void drawBatch(const void *payload) {
+    const BatchDraw &draw = *static_cast<const BatchDraw *>(payload);
+    Model &model = *draw.model;
+    draw.shader->use();
+    GLState::shared().bindBufferRange(
+        GL_SHADER_STORAGE_BUFFER, INSTANCE_DATA_BINDING, draw.indirect_buffer,
+        draw.instances.offset, draw.instances.size);
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER,
+                                      DRAW_DATA_BINDING,
+                                      model.draw_data_buffer);
+    GLState::shared().bindBuffer(GL_DRAW_INDIRECT_BUFFER,
+                                 draw.indirect_buffer);
+    if (draw.positions_only) {
+      model.depth_gpu_culled.set(false);
+      model.meshes[draw.first_mesh].bindPositions();
+    } else {
+      const VariantUniforms &uniforms = model.variant_uniforms[draw.variant];
+      MaterialTable::shared().bind();
+      uniforms.material_textures.set(true);
+      uniforms.gpu_culled.set(false);
+      model.meshes[draw.first_mesh].bindGeometry(*draw.shader);
+    }
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                (void *)draw.indirect, draw.command_count, 0);
+  }
+
+  // one batch of one DrawCulled(), its commands and their count were written
+  // by cull.comp
+  struct CulledBatchDraw {
+    Model *model;
+    const Shader *shader;
+    uint32_t variant;
+    bool positions_only;
+    uint32_t instance_buffer;
+    uint32_t batch;
+  };
+
+  static void drawCulledBatch(const void *payload) {
+    const CulledBatchDraw &draw =
+        *static_cast<const CulledBatchDraw *>(payload);
+    Model &model = *draw.model;
+    const DrawBatch &batch = model.batches[draw.batch];
+    const GPUCullSet &culling = model.gpu_culling;
+    draw.shader->use();
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER,
+                                      INSTANCE_DATA_BINDING,
+                                      draw.instance_buffer);
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER,
+                                      VISIBLE_INSTANCE_BINDING,
+                                      culling.visible_buffer);
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER,
+                                      DRAW_DATA_BINDING,
+                                      model.draw_data_buffer);
+    GLState::shared().bindBuffer(GL_DRAW_INDIRECT_BUFFER,
+                                 culling.command_buffer);
+    GLState::shared().bindBuffer(GL_PARAMETER_BUFFER, culling.count_buffer);
+    if (draw.positions_only) {
+      model.depth_gpu_culled.set(true);
+      model.meshes[batch.first_mesh].bindPositions();
+    } else {
+      const VariantUniforms &uniforms = model.variant_uniforms[draw.variant];
+      MaterialTable::shared().bind();
+      uniforms.material_textures.set(true);
+      uniforms.gpu_culled.set(true);
+      model.meshes[batch.first_mesh].bindGeometry(*draw.shader);
+    }
+    glMultiDrawElementsIndirectCount(
+        GL_TRIANGLES, GL_UNSIGNED_INT,
+        (void *)(size_t(batch.first_command) *
+                 sizeof(DrawElementsIndirectCommand)),
+        GPUCullSet::countOffset(draw.batch), batch.command_count, 0);
+  }
+
+  // the cheapest variant for batch: the lights of the frame and the maps of
+  // its material
+  static uint32_t variantOf(const ShaderPermutations &shaders,
+                            uint32_t features, const DrawBatch &batch) {
+    return ((features & SHADER_LIGHT_FEATURES) | batch.features) &
+           shaders.used_features;
+  }
+
+  // the variant, compiled if needed, with its uniforms resolved
+  const Shader &resolveVariant(ShaderPermutations &shaders, uint32_t variant) {
+    const Shader &shader = shaders.variant(variant);
+    VariantUniforms &uniforms = variant_uniforms[variant];
+    if (!uniforms.material_textures.resolvedOn(shader.ID)) {
+      uniforms.material_textures = shader.uniform<bool>("material_textures");
+      uniforms.gpu_culled = shader.uniform<bool>("gpu_culled");
+    }
+    return shader;
+  }
+
+  void resolveDepthUniforms(const Shader *depth_shader) {
+    if (depth_shader != NULL && !depth_gpu_culled.resolvedOn(depth_shader->ID))
+      depth_gpu_culled = depth_shader->uniform<bool>("gpu_culled");
+  }
+
+  // what cull.comp needs to know about every mesh, in the order of their
+  // commands
+  std::vector<MeshCullData> meshCullData() const {
+    std::vector<MeshCullData> cull_data;
+    for (uint32_t b = 0; b < batches.size(); b++) {
+      const DrawBatch &batch = batches[b];
+      for (uint32_t i = 0; i < batch.command_count; i++) {
+        const DrawElementsIndirectCommand &command =
+            commands[batch.first_command + i];
+        const Mesh<Vertex> &mesh = meshes[command.baseInstance];
+        MeshCullData data = {};
+        data.bounds_min = glm::vec4(mesh.bounds.min, 1.0f);
+        data.bounds_max = glm::vec4(mesh.bounds.max, 1.0f);
+        data.index_count = command.count;
+        data.first_index = command.firstIndex;
+        data.base_vertex = command.baseVertex;
+        data.base_instance = command.baseInstance;
+        data.batch = b;
+        data.first_command = batch.first_command;
+        cull_data.push_back(data);
+      }
+    }
+    return cull_data;
+  }
+
+  bool meshInFrustum(const Frustum &frustum, const Mesh<Vertex> &mesh,
+                     const InstanceData *instances,
+                     uint32_t visible_count) const {
+    if (visible_count > MESH_CULL_INSTANCES)
+      return true;
+    for (uint32_t i = 0; i < visible_count; i++)
+      if (frustum.visible(transformSphere(
+              mesh.sphere, instances[visible_instances[i]].model)))
+        return true;
+    return false;
+  }
+
+  bool meshOccluded(const OcclusionBuffer *occlusion,
+                    const Mesh<Vertex> &mesh, const InstanceData *instances,
+                    uint32_t visible_count) const {
+    if (occlusion == NULL || visible_count > MESH_CULL_INSTANCES)
+      return false;
+    for (uint32_t i = 0; i < visible_count; i++)
+      if (!occlusion->occluded(transformBox(
+              mesh.bounds, instances[visible_instances[i]].model)))
+        return false;
+    return true;
+  }
+
+  // resolves the materials of the meshes, groups the meshes into batches,
+  // builds their draw commands and uploads their draw data
+  void buildDrawCommands() {
+    for (Mesh<Vertex> &mesh : meshes)
+      mesh.material = acquireMaterial(mesh.textures);
+
+    // meshes can share a multi draw if they use the same GeometryBuffer and
+    // shader variant
+    auto compatible = [](const Mesh<Vertex> &a, const Mesh<Vertex> &b) {
+      return a.format == b.format &&
+             materialFeatures(a.textures) == materialFeatures(b.textures);
+    };
+
+    std::vector<MeshDrawData> draw_data;
+    std::vector<bool> batched(meshes.size(), false);
+    for (uint32_t i = 0; i < meshes.size(); i++) {
+      draw_data.push_back(meshes[i].drawData());
+      if (batched[i])
+        continue;
+      DrawBatch batch = {i, uint32_t(commands.size()), 0,
+                         materialFeatures(meshes[i].textures)};
+      for (uint32_t j = i; j < meshes.size(); j++) {
+        if (batched[j] || !compatible(meshes[i], meshes[j]))
+          continue;
+        batched[j] = true;
+        commands.push_back(meshes[j].geometry.drawCommand(j));
+        batch.command_count++;
+      }
+      batches.push_back(batch);
+    }
+
+    // a sphere around the center of all meshes holding their spheres
+    bounds = meshes.empty() ? BoundingBox() : meshes[0].bounds;
+    for (const Mesh<Vertex> &mesh : meshes) {
+      bounds.min = glm::min(bounds.min, mesh.bounds.min);
+      bounds.max = glm::max(bounds.max, mesh.bounds.max);
+    }
+    sphere = {0.5f * (bounds.min + bounds.max), 0.0f};
+    for (const Mesh<Vertex> &mesh : meshes) {
+      const float reach =
+          glm::length(mesh.sphere.center - sphere.center) + mesh.sphere.radius;
+      sphere.radius = std::max(sphere.radius, reach);
+    }
+
+    buildOccluder();
+
+    glGenBuffers(1, &draw_data_buffer);
+    GLState::shared().bindBuffer(GL_SHADER_STORAGE_BUFFER, draw_data_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 draw_data.size() * sizeof(MeshDrawData), draw_data.data(),
+                 GL_STATIC_DRAW);
+    GLState::shared().bindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    std::cout << "MODEL:: " << meshes.size() << " meshes drawn with "
+              << batches.size() << " multi draw calls" << std::endl;
+  }
+
+  // the triangles of the biggest meshes standing in for the model in the
+  // OcclusionBuffer, the meshes themselves are the only hull sure to be
+  // inside the model
+  void buildOccluder() {
+    occluder = OccluderMesh();
+    std::vector<uint32_t> order(meshes.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+      return meshes[a].sphere.radius > meshes[b].sphere.radius;
+    });
+    for (uint32_t i : order) {
+      const Mesh<Vertex> &mesh = meshes[i];
+      if (occluder.indices.size() + mesh.indices.size() >
+          OCCLUDER_TRIANGLES * 3)
+        continue;
+      const uint32_t base = occluder.positions.size();
+      for (const Vertex &vertex : mesh.vertices)
+        occluder.positions.push_back(vertex.Position);
+      for (uint32_t index : mesh.indices)
+        occluder.indices.push_back(base + index);
+    }
+  }
+
+  // the first diffuse and specular map of the mesh as a material
+  static uint32_t acquireMaterial(const std::vector<Texture> &textures) {
+    std::array<uint32_t, MATERIAL_SLOTS> slots = {};
+    for (auto texture = textures.rbegin(); texture != textures.rend();
+         ++texture) {
+      const TextureType type = textureType(texture->type);
+      if (type == TextureType::Diffuse)
+        slots[MATERIAL_DIFFUSE] = texture->id;
+      else if (type == TextureType::Specular)
+        slots[MATERIAL_SPECULAR] = texture->id;
+    }
+    return MaterialTable::shared().acquire(slots);
+  }
+
+  // the shader features the textures of a mesh ask for
+  static uint32_t materialFeatures(const std::vector<Texture> &textures) {
+    for (const Texture &texture : textures)
+      if (textureType(texture.type) == TextureType::Specular)
+        return SHADER_SPECULAR_MAP;
+    return 0;
+  }
+
+  // hash of the model file and, for OBJ, of the material libraries it names,
+  // the cooked file holds their materials and texture paths too. 0 if the
+  // model can't be read.
+  uint64_t sourceHash(const std::string &path) const {
+    uint64_t hash = hashFile(path);
+    if (hash == 0 || path.size() < 4 ||
+        path.compare(path.size() - 4, 4, ".obj") != 0)
+      return hash;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.compare(0, 7, "mtllib ") != 0)
+        continue;
+      // the rest of the line is the file name, like ASSIMP reads it
+      const size_t first = line.find_first_not_of(" \t", 7);
+      const size_t last = line.find_last_not_of(" \t\r");
+      if (first == std::string::npos)
+        continue;
+      const uint64_t material_hash =
+          hashFile(directory + '/' + line.substr(first, last - first + 1));
+      hash = hashBytes(&material_hash, sizeof(material_hash), hash);
+    }
+    return hash;
+  }
+
+  static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  void printVertexMemory(const std::string &path) const {
+    size_t packed_meshes = 0, bytes = 0, full_bytes = 0;
+    for (const Mesh<Vertex> &mesh : meshes) {
+      packed_meshes += mesh.format == VertexFormat::Packed;
+      bytes += mesh.vertexBytes();
+      full_bytes += mesh.vertices.size() * sizeof(Vertex);
+    }
+    std::cout << "VERTEX_FORMAT:: " << path << " " << packed_meshes << "/"
+              << meshes.size() << " meshes packed, "
+              << bytes / (1024.0 * 1024.0) << " MiB of vertices ("
+              << full_bytes / (1024.0 * 1024.0) << " MiB unpacked)"
+              << std::endl;
+  }
+
+  // rebuilds the meshes straight from the mapped vertex and index blobs
+  void loadCooked(const CookedModel &cooked) {
+    const CookedHeader &header = cooked.header();
+    meshes.reserve(header.mesh_count);
+    for (uint32_t i = 0; i < header.mesh_count; i++) {
+      const CookedMesh &mesh = cooked.mesh(i);
+      std::vector<Texture> textures = cooked.textures(mesh);
+      for (Texture &texture : textures)
+        texture = loadTexture(texture.path.c_str(), texture.type);
+      meshes.push_back(Mesh<Vertex>(cooked.vertices(mesh), mesh.vertex_count,
+                                    cooked.indices(mesh), mesh.index_count,
+                                    textures));
+    }
+  }
+
+  // CPU side data of a mesh extracted from ASSIMP, textures are only
+  // referenced by type and path until they get loaded on the context thread
+  struct MeshData {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<Texture> textures;
+    // vertex cache efficiency of the index order ASSIMP produced and of the
+    // optimized one
+    VertexCacheStatistics imported;
+    VertexCacheStatistics optimized;
+  };
+
+  // processes a node in a recursive fashion. Collects each individual mesh
   // located at the node and repeats this process on its children nodes (if
   // any).
-  void processNode(aiNode *node, const aiScene *scene) {
-    // process each mesh located at the current node
+  void processNode(aiNode *node, const aiScene *scene,
+                   std::vector<aiMesh *> &ai_meshes) {
+    // collect each mesh located at the current node
     for (uint32_t i = 0; i < node->mNumMeshes; i++) {
       // the node object only contains indices to index the actual objects in
       // the scene. the scene contains all the data, node is just to keep stuff
       // organized (like relations between nodes).
-      aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-      meshes.push_back(processMesh(mesh, scene));
+      ai_meshes.push_back(scene->mMeshes[node->mMeshes[i]]);
     }
-    // after we've processed all of the meshes (if any) we then recursively
+    // after we've collected all of the meshes (if any) we then recursively
     // process each of the children nodes
     for (uint32_t i = 0; i < node->mNumChildren; i++) {
-      processNode(node->mChildren[i], scene);
+      processNode(node->mChildren[i], scene, ai_meshes);
     }
   }
 
-  Mesh processMesh(aiMesh *mesh, const aiScene *scene) {
+  // converts an ASSIMP mesh, doesn't touch any GL state so it can run on a
+  // worker thread
+  MeshData processMesh(aiMesh *mesh, const aiScene *scene) {
     // data to fill
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
-    std::vector<Texture> textures;
+    MeshData data;
+    std::vector<Vertex> &vertices = data.vertices;
+    std::vector<uint32_t> &indices = data.indices;
+    std::vector<Texture> &textures = data.textures;
+    vertices.reserve(mesh->mNumVertices);
+    indices.reserve(mesh->mNumFaces * 3);
 
     // walk through each of the mesh's vertices
-    for (uint32_t i = 0; i < mesh->mNumVertices; i++) {
-      Vertex vertex;
-      glm::vec3 vector; // we declare a placeholder vector since assimp uses its
-                        // own vector class that doesn't directly convert to
-                        // glm's vec3 class so we transfer the data to this
-                        // placeholder glm::vec3 first.
-      // positions
-      vector.x = mesh->mVertices[i].x;
-      vector.y = mesh->mVertices[i].y;
-      vector.z = mesh->mVertices[i].z;
-      vertex.Position = vector;
-      // normals
-      if (mesh->HasNormals()) {
-        vector.x = mesh->mNormals[i].x;
-        vector.y = mesh->mNormals[i].y;
-        vector.z = mesh->mNormals[i].z;
-        vertex.Normal = vector;
-      }
-      // texture coordinates
-      if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
-      {
-        glm::vec2 vec;
-        // a vertex can contain up to 8 different texture coordinates. We thus
-        // make the assumption that we won't use models where a vertex can have
-        // multiple texture coordinates so we always take the first set (0).
-        vec.x = mesh->mTextureCoords[0][i].x;
-        vec.y = mesh->mTextureCoords[0][i].y;
-        vertex.TexCoords = vec;
-        // tangent
-        vector.x = mesh->mTangents[i].x;
-        vector.y = mesh->mTangents[i].y;
-        vector.z = mesh->mTangents[i].z;
-        vertex.Tangent = vector;
-        // bitangent
-        vector.x = mesh->mBitangents[i].x;
-        vector.y = mesh->mBitangents[i].y;
-        vector.z = mesh->mBitangents[i].z;
-        vertex.Bitangent = vector;
-      } else
-        vertex.TexCoords = glm::vec2(0.0f, 0.0f);
+    fillVertices(mesh, vertices);
 
-      vertices.push_back(vertex);
-    }
     // now wak through each of the mesh's faces (a face is a mesh its triangle)
     // and retrieve the corresponding vertex indices.
     for (uint32_t i = 0; i < mesh->mNumFaces; i++) {
@@ -142,6 +765,7 @@ private:
       for (uint32_t j = 0; j < face.mNumIndices; j++)
         indices.push_back(face.mIndices[j]);
     }
+    optimizeMesh(data);
     // process materials
     aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
     // we assume a convention for sampler names in the shaders. Each diffuse
@@ -168,80 +792,129 @@ private:
         loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
     textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
-    // return a mesh object created from the extracted mesh data
-    return Mesh(vertices, indices, textures);
+    // return the extracted mesh data
+    return data;
   }
 
-  // checks all material textures of a given type and loads the textures if
-  // they're not loaded yet. the required info is returned as a Texture struct.
+  // converts the vertices of an ASSIMP mesh to any layout from
+  // vertex_layout.hpp, attributes the layout doesn't have are skipped at
+  // compile time
+  template <typename VertexT>
+  static void fillVertices(const aiMesh *mesh, std::vector<VertexT> &vertices) {
+    for (uint32_t i = 0; i < mesh->mNumVertices; i++) {
+      // zeroed, bone data and missing attributes must not be garbage
+      VertexT vertex{};
+      glm::vec3 vector; // we declare a placeholder vector since assimp uses its
+                        // own vector class that doesn't directly convert to
+                        // glm's vec3 class so we transfer the data to this
+                        // placeholder glm::vec3 first.
+      // positions
+      vector.x = mesh->mVertices[i].x;
+      vector.y = mesh->mVertices[i].y;
+      vector.z = mesh->mVertices[i].z;
+      vertex.Position = vector;
+      // normals
+      if constexpr (has_Normal<VertexT>::value) {
+        if (mesh->HasNormals()) {
+          vector.x = mesh->mNormals[i].x;
+          vector.y = mesh->mNormals[i].y;
+          vector.z = mesh->mNormals[i].z;
+          vertex.Normal = vector;
+        }
+      }
+      // texture coordinates
+      if constexpr (has_TexCoords<VertexT>::value) {
+        if (mesh->mTextureCoords[0]) // does the mesh contain texture
+                                     // coordinates?
+        {
+          glm::vec2 vec;
+          // a vertex can contain up to 8 different texture coordinates. We
+          // thus make the assumption that we won't use models where a vertex
+          // can have multiple texture coordinates so we always take the first
+          // set (0).
+          vec.x = mesh->mTextureCoords[0][i].x;
+          vec.y = mesh->mTextureCoords[0][i].y;
+          vertex.TexCoords = vec;
+        }
+      }
+      // tangent and bitangent, only generated for meshes with texture
+      // coordinates
+      if constexpr (has_Tangent<VertexT>::value) {
+        if (mesh->mTextureCoords[0]) {
+          vector.x = mesh->mTangents[i].x;
+          vector.y = mesh->mTangents[i].y;
+          vector.z = mesh->mTangents[i].z;
+          vertex.Tangent = vector;
+        }
+      }
+      if constexpr (has_Bitangent<VertexT>::value) {
+        if (mesh->mTextureCoords[0]) {
+          vector.x = mesh->mBitangents[i].x;
+          vector.y = mesh->mBitangents[i].y;
+          vector.z = mesh->mBitangents[i].z;
+          vertex.Bitangent = vector;
+        }
+      }
+
+      vertices.push_back(vertex);
+    }
+  }
+
+  // reorders the triangles for the vertex cache and overdraw and the
+  // vertices for fetch locality, see mesh_optimizer.hpp
+  static void optimizeMesh(MeshData &data) {
+    const uint32_t vertex_count = data.vertices.size();
+    data.imported = analyzeVertexCache(data.indices, vertex_count);
+    data.indices = optimizeVertexCache(data.indices, vertex_count);
+    data.indices = optimizeOverdraw(data.indices, data.vertices);
+    optimizeVertexFetch(data.vertices, data.indices);
+    data.optimized = analyzeVertexCache(data.indices, data.vertices.size());
+  }
+
+  // collects all material textures of a given type. the textures aren't
+  // loaded here, the required info is returned as a Texture struct without
+  // an id.
   std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type,
                                             std::string typeName) {
     std::vector<Texture> textures;
     for (uint32_t i = 0; i < mat->GetTextureCount(type); i++) {
       aiString str;
       mat->GetTexture(type, i, &str);
-      // check if texture was loaded before and if so, continue to next
-      // iteration: skip loading a new texture
-      bool skip = false;
-      for (uint32_t j = 0; j < textures_loaded.size(); j++) {
-        if (std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0) {
-          textures.push_back(textures_loaded[j]);
-          skip = true; // a texture with the same filepath has already been
-                       // loaded, continue to next one. (optimization)
-          break;
-        }
-      }
-      if (!skip) { // if texture hasn't been loaded already, load it
-        Texture texture;
-        texture.id = TextureFromFile(str.C_Str(), this->directory);
-        texture.type = typeName;
-        texture.path = str.C_Str();
-        textures.push_back(texture);
-        textures_loaded.push_back(
-            texture); // store it as texture loaded for entire model, to ensure
-                      // we won't unnecessary load duplicate textures.
-      }
+      Texture texture;
+      texture.id = 0;
+      texture.type = typeName;
+      texture.path = str.C_Str();
+      textures.push_back(texture);
     }
     return textures;
   }
+
+  // returns the texture at the given path. textures are shared through the
+  // TextureCache, the model keeps one reference per distinct path.
+  Texture loadTexture(const char *path, const std::string &typeName) {
+    auto loaded = textures_loaded.find(path);
+    if (loaded != textures_loaded.end())
+      return loaded->second; // a texture with the same filepath has already
+                             // been loaded. (optimization)
+
+    Texture texture;
+    // diffuse maps hold sRGB colors, their mip levels are filtered in linear
+    // space
+    texture.id = TextureCache::shared().acquire(this->directory + '/' + path,
+                                                typeName == "texture_diffuse");
+    texture.type = typeName;
+    texture.path = path;
+    textures_loaded.emplace(texture.path, texture);
+    return texture;
+  }
 };
 
+// the texture is decoded and uploaded in the background, the returned id shows
+// white until TextureLoader::poll() has uploaded the image.
 inline uint32_t TextureFromFile(const char *path, const std::string &directory,
                                 bool gamma) {
   std::string filename = std::string(path);
   filename = directory + '/' + filename;
 
-  uint32_t textureID;
-  glGenTextures(1, &textureID);
-
-  int width, height, nrComponents;
-  unsigned char *data =
-      stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-  if (data) {
-    GLenum format;
-    if (nrComponents == 1)
-      format = GL_RED;
-    else if (nrComponents == 3)
-      format = GL_RGB;
-    else if (nrComponents == 4)
-      format = GL_RGBA;
-
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
-                 GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                    GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    stbi_image_free(data);
-  } else {
-    std::cout << "Texture failed to load at path: " << path << std::endl;
-    stbi_image_free(data);
-  }
-
-  return textureID;
+  return TextureLoader::shared().load(filename, gamma);
 }
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mesh.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Cooked model format. Written after the first Assimp import of a model and
+// mapped straight into memory on later runs, so the meshes can be rebuilt
+// without any parsing. Layout (every blob starts on a 16 byte boundary):
+//
+//   CookedHeader
+//   CookedMesh[mesh_count]
+//   CookedTexture[texture_count]  material table, each mesh owns a range
+//   char[string_size]             texture types and paths
+//   Vertex / uint32_t blobs       per mesh vertex and index data
+constexpr char COOKED_MAGIC[4] = {'C', 'M', 'D', 'L'};
+constexpr uint32_t COOKED_VERSION = 3;
+constexpr uint64_t COOKED_ALIGNMENT = 16;
+
+struct CookedHeader {
+  char magic[4];
+  uint32_t version;
+  // hash of the source file the data was cooked from
+  uint64_t source_hash;
+  // guards against reading data cooked with a different Vertex layout
+  uint32_t vertex_size;
+  uint32_t mesh_count;
+  uint32_t texture_count;
+  uint32_t string_size;
+  uint64_t meshes_offset;
+  uint64_t textures_offset;
+  uint64_t strings_offset;
+  uint64_t file_size;
+  // how long the Assimp import took when the file was cooked
+  double import_ms;
+};
+
+struct CookedMesh {
+  uint64_t vertex_offset;
+  uint64_t index_offset;
+  uint32_t vertex_count;
+  uint32_t index_count;
+  uint32_t first_texture;
+  uint32_t texture_count;
+};
+
+struct CookedTexture {
+  uint32_t type_offset;
+  uint32_t type_length;
+  uint32_t path_offset;
+  uint32_t path_length;
+};
+
+inline uint64_t alignCooked(uint64_t offset) {
+  return (offset + COOKED_ALIGNMENT - 1) & ~(COOKED_ALIGNMENT - 1);
+}
+
+// read only view of a cooked model file mapped into memory
+class CookedModel {
+public:
+  CookedModel() {}
+  CookedModel(const CookedModel &) = delete;
+  CookedModel &operator=(const CookedModel &) = delete;
+  ~CookedModel() { close(); }
+
+  // maps the file and validates it against the hash of the source file,
+  // returns false if the file is missing, corrupt or stale
+  bool open(const std::string &path, uint64_t source_hash) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(CookedHeader)) {
+      ::close(fd);
+      return false;
+    }
+
+    size = st.st_size;
+    data = static_cast<const char *>(
+        mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      data = nullptr;
+      return false;
+    }
+
+    if (!validate(source_hash)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+    data = nullptr;
+    size = 0;
+  }
+
+  const CookedHeader &header() const {
+    return *reinterpret_cast<const CookedHeader *>(data);
+  }
+
+  const CookedMesh &mesh(uint32_t i) const {
+    return reinterpret_cast<const CookedMesh *>(data +
+                                                header().meshes_offset)[i];
+  }
+
+  const Vertex *vertices(const CookedMesh &mesh) const {
+    return reinterpret_cast<const Vertex *>(data + mesh.vertex_offset);
+  }
+
+  const uint32_t *indices(const CookedMesh &mesh) const {
+    return reinterpret_cast<const uint32_t *>(data + mesh.index_offset);
+  }
+
+  // material table entries of a mesh
+  std::vector<Texture> textures(const CookedMesh &mesh) const {
+    const CookedTexture *table = reinterpret_cast<const CookedTexture *>(
+        data + header().textures_offset);
+    const char *strings = data + header().strings_offset;
+
+    std::vector<Texture> result;
+    for (uint32_t i = 0; i < mesh.texture_count; i++) {
+      const CookedTexture &entry = table[mesh.first_texture + i];
+      Texture texture;
+      texture.id = 0;
+      texture.type.assign(strings + entry.type_offset, entry.type_length);
+      texture.path.assign(strings + entry.path_offset, entry.path_length);
+      result.push_back(texture);
+    }
+    return result;
+  }
+
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+
+  bool validate(uint64_t source_hash) const {
+    const CookedHeader &h = header();
+    if (std::memcmp(h.magic, COOKED_MAGIC, sizeof(COOKED_MAGIC)) != 0 ||
+        h.version != COOKED_VERSION || h.vertex_size != sizeof(Vertex) ||
+        h.source_hash != source_hash || h.file_size != size)
+      return false;
+
+    // every table and blob has to lie inside the mapping
+    if (h.meshes_offset + uint64_t(h.mesh_count) * sizeof(CookedMesh) > size ||
+        h.textures_offset + uint64_t(h.texture_count) * sizeof(CookedTexture) >
+            size ||
+        h.strings_offset + h.string_size > size)
+      return false;
+
+    const CookedTexture *table =
+        reinterpret_cast<const CookedTexture *>(data + h.textures_offset);
+    for (uint32_t i = 0; i < h.texture_count; i++) {
+      if (uint64_t(table[i].type_offset) + table[i].type_length >
+              h.string_size ||
+          uint64_t(table[i].path_offset) + table[i].path_length > h.string_size)
+        return false;
+    }
+
+    for (uint32_t i = 0; i < h.mesh_count; i++) {
+      const CookedMesh &m = mesh(i);
+      if (m.vertex_offset + uint64_t(m.vertex_count) * sizeof(Vertex) > size ||
+          m.index_offset + uint64_t(m.index_count) * sizeof(uint32_t) > size ||
+          uint64_t(m.first_texture) + m.texture_count > h.texture_count)
+        return false;
+    }
+    return true;
+  }
+};
+
+// writes the meshes of a freshly imported model to a cooked file
+inline bool writeCookedModel(const std::string &path, uint64_t source_hash,
+                             const std::vector<Mesh<Vertex>> &meshes,
+                             double import_ms) {
+  std::vector<CookedMesh> cooked_meshes(meshes.size());
+  std::vector<CookedTexture> cooked_textures;
+  std::string strings;
+
+  for (uint32_t i = 0; i < meshes.size(); i++) {
+    cooked_meshes[i].first_texture = cooked_textures.size();
+    cooked_meshes[i].texture_count = meshes[i].textures.size();
+    for (const Texture &texture : meshes[i].textures) {
+      CookedTexture entry;
+      entry.type_offset = strings.size();
+      entry.type_length = texture.type.size();
+      strings += texture.type;
+      entry.path_offset = strings.size();
+      entry.path_length = texture.path.size();
+      strings += texture.path;
+      cooked_textures.push_back(entry);
+    }
+  }
+
+  CookedHeader header = {};
+  std::memcpy(header.magic, COOKED_MAGIC, sizeof(COOKED_MAGIC));
+  header.version = COOKED_VERSION;
+  header.source_hash = source_hash;
+  header.vertex_size = sizeof(Vertex);
+  header.mesh_count = cooked_meshes.size();
+  header.texture_count = cooked_textures.size();
+  header.string_size = strings.size();
+  header.import_ms = import_ms;
+
+  // lay out the tables first, then the blobs
+  uint64_t offset = alignCooked(sizeof(CookedHeader));
+  header.meshes_offset = offset;
+  offset = alignCooked(offset + cooked_meshes.size() * sizeof(CookedMesh));
+  header.textures_offset = offset;
+  offset =
+      alignCooked(offset + cooked_textures.size() * sizeof(CookedTexture));
+  header.strings_offset = offset;
+  offset = alignCooked(offset + strings.size());
+  for (uint32_t i = 0; i < meshes.size(); i++) {
+    cooked_meshes[i].vertex_offset = offset;
+    cooked_meshes[i].vertex_count = meshes[i].vertices.size();
+    offset = alignCooked(offset + meshes[i].vertices.size() * sizeof(Vertex));
+    cooked_meshes[i].index_offset = offset;
+    cooked_meshes[i].index_count = meshes[i].indices.size();
+    offset =
+        alignCooked(offset + meshes[i].indices.size() * sizeof(uint32_t));
+  }
+  header.file_size = offset;
+
+  // write to a temporary file first so a crash never leaves a truncated
+  // cache behind
+  std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::cout << "ERROR::MODEL_CACHE:: could not open " << tmp_path
+              << std::endl;
+    return false;
+  }
+
+  auto writeAt = [&file](uint64_t at, const void *src, size_t bytes) {
+    // pad up to the aligned offset
+    static const char zeros[COOKED_ALIGNMENT] = {};
+    uint64_t pos = file.tellp();
+    file.write(zeros, at - pos);
+    if (bytes)
+      file.write(static_cast<const char *>(src), bytes);
+  };
+
+  writeAt(0, &header, sizeof(header));
+  writeAt(header.meshes_offset, cooked_meshes.data(),
+          cooked_meshes.size() * sizeof(CookedMesh));
+  writeAt(header.textures_offset, cooked_textures.data(),
+          cooked_textures.size() * sizeof(CookedTexture));
+  writeAt(header.strings_offset, strings.data(), strings.size());
+  for (uint32_t i = 0; i < meshes.size(); i++) {
+    writeAt(cooked_meshes[i].vertex_offset, meshes[i].vertices.data(),
+            meshes[i].vertices.size() * sizeof(Vertex));
+    writeAt(cooked_meshes[i].index_offset, meshes[i].indices.data(),
+            meshes[i].indices.size() * sizeof(uint32_t));
+  }
+  writeAt(header.file_size, nullptr, 0);
+  file.close();
+
+  if (!file || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::cout << "ERROR::MODEL_CACHE:: failed to write " << path << std::endl;
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "frustum_culling.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// triangles rendered into the OcclusionBuffer in place of a mesh, in model
+// space. they have to lie inside what they stand for, or things behind them
+// get culled while they are still visible.
+struct OccluderMesh {
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+
+  bool empty() const { return indices.empty(); }
+};
+
+// Low resolution depth buffer rendered on the CPU from a few occluders, to
+// skip the draws of whatever they hide. No GL is involved, so it runs on the
+// worker threads while the GPU is still busy with the previous frame.
+//
+// Rendering happens in two steps: the occluders are split into
+// SETUP_GROUPS, each group transforms its triangles and bins them into the
+// screen tiles they touch. Then every row of tiles is rasterized on its own,
+// 4 pixels at a time with SSE2, keeping the nearest depth (0 near plane, 1
+// far plane) and the farthest depth of every tile.
+//
+// A box is occluded if its nearest point is behind the depth of every pixel
+// its screen rectangle touches. Triangles are only drawn over pixels they
+// cover completely, with the farthest depth they have inside the pixel, and
+// boxes test every pixel they touch, so the buffer never hides more than the
+// occluders do. The price is that a pixel split between two triangles of a
+// mesh stays empty: occluders lose a pixel wide line along every edge, and
+// triangles under about two pixels wide hide nothing.
+class OcclusionBuffer {
+public:
+  constexpr static uint32_t WIDTH = 256;
+  constexpr static uint32_t HEIGHT = 144;
+  constexpr static uint32_t TILE_WIDTH = 32;
+  constexpr static uint32_t TILE_HEIGHT = 16;
+  constexpr static uint32_t TILES_X = WIDTH / TILE_WIDTH;
+  constexpr static uint32_t TILES_Y = HEIGHT / TILE_HEIGHT;
+  constexpr static uint32_t TILES = TILES_X * TILES_Y;
+  constexpr static uint32_t SETUP_GROUPS = 4;
+  static_assert(WIDTH % TILE_WIDTH == 0 && HEIGHT % TILE_HEIGHT == 0,
+                "tiles have to cover the buffer");
+  static_assert(TILE_WIDTH % 4 == 0, "tiles are rasterized 4 pixels wide");
+
+  // triangles binned by the last render
+  uint32_t last_triangles = 0;
+
+  OcclusionBuffer() : depth_buffer(WIDTH * HEIGHT, 1.0f) {
+    std::fill(tile_max, tile_max + TILES, 1.0f);
+  }
+  OcclusionBuffer(const OcclusionBuffer &) = delete;
+  OcclusionBuffer &operator=(const OcclusionBuffer &) = delete;
+
+  ~OcclusionBuffer() { wait(); }
+
+  // starts a new frame seen through view_projection, call while no render
+  // is running
+  void begin(const glm::mat4 &view_projection) {
+    this->view_projection = view_projection;
+    occluders.clear();
+  }
+
+  // mesh has to stay alive until the render is done
+  void addOccluder(const OccluderMesh &mesh, const glm::mat4 &model) {
+    if (!mesh.empty())
+      occluders.push_back({&mesh, model});
+  }
+
+  // renders the occluders on the calling thread
+  void render() {
+    for (uint32_t group = 0; group < SETUP_GROUPS; group++)
+      setup(group);
+    for (uint32_t row = 0; row < TILES_Y; row++)
+      rasterize(row);
+    countTriangles();
+  }
+
+  // renders the occluders on the pool, wait() before using the result. the
+  // tasks queue their successors themselves, no worker ever blocks on
+  // another.
+  void renderAsync(ThreadPool &pool) {
+    wait();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy = true;
+    }
+    pending = SETUP_GROUPS;
+    for (uint32_t group = 0; group < SETUP_GROUPS; group++)
+      pool.submit([this, &pool, group] {
+        setup(group);
+        if (pending.fetch_sub(1) == 1)
+          rasterizeAsync(pool);
+      });
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return !busy; });
+  }
+
+  // true if the world space box is hidden behind the occluders
+  bool occluded(const BoundingBox &box) const {
+    glm::vec2 lo = glm::vec2(WIDTH, HEIGHT), hi = glm::vec2(0.0f);
+    float nearest = 1.0f;
+    for (uint32_t i = 0; i < 8; i++) {
+      const glm::vec3 corner(i & 1 ? box.max.x : box.min.x,
+                             i & 2 ? box.max.y : box.min.y,
+                             i & 4 ? box.max.z : box.min.z);
+      const glm::vec4 clip = view_projection * glm::vec4(corner, 1.0f);
+      // reaches in front of the near plane, can't be behind anything
+      if (clip.z < -clip.w)
+        return false;
+      const glm::vec3 window = toWindow(clip);
+      lo = glm::min(lo, glm::vec2(window.x, window.y));
+      hi = glm::max(hi, glm::vec2(window.x, window.y));
+      nearest = std::min(nearest, window.z);
+    }
+    // off screen boxes are left to the frustum culling
+    const int x0 = std::max(int(std::floor(lo.x)), 0);
+    const int y0 = std::max(int(std::floor(lo.y)), 0);
+    const int x1 = std::min(int(std::floor(hi.x)), int(WIDTH) - 1);
+    const int y1 = std::min(int(std::floor(hi.y)), int(HEIGHT) - 1);
+    if (x0 > x1 || y0 > y1)
+      return false;
+
+    for (int ty = y0 / TILE_HEIGHT; ty <= y1 / int(TILE_HEIGHT); ty++) {
+      for (int tx = x0 / TILE_WIDTH; tx <= x1 / int(TILE_WIDTH); tx++) {
+        // the whole tile is in front of the box
+        if (tile_max[ty * TILES_X + tx] < nearest)
+          continue;
+        const int px0 = std::max(x0, tx * int(TILE_WIDTH));
+        const int px1 = std::min(x1, (tx + 1) * int(TILE_WIDTH) - 1);
+        const int py0 = std::max(y0, ty * int(TILE_HEIGHT));
+        const int py1 = std::min(y1, (ty + 1) * int(TILE_HEIGHT) - 1);
+        for (int y = py0; y <= py1; y++)
+          for (int x = px0; x <= px1; x++)
+            if (depth_buffer[y * WIDTH + x] >= nearest)
+              return false;
+      }
+    }
+    return true;
+  }
+
+  // depth of a pixel, 1 where no occluder is
+  float depth(uint32_t x, uint32_t y) const {
+    return depth_buffer[y * WIDTH + x];
+  }
+
+private:
+  struct Occluder {
+    const OccluderMesh *mesh;
+    glm::mat4 model;
+  };
+  // a triangle in window space, the pixel centered at x, y is inside edge i
+  // where edges[i].x * x + edges[i].y * y + edges[i].z >= 0. the farthest
+  // depth of the triangle in that pixel is plane.x * x + plane.y * y +
+  // plane.z
+  struct Triangle {
+    glm::vec3 edges[3];
+    glm::vec3 plane;
+    int min_x, min_y, max_x, max_y;
+  };
+
+  glm::mat4 view_projection = glm::mat4(1.0f);
+  std::vector<Occluder> occluders;
+  // per setup group, so the groups don't share anything
+  std::vector<glm::vec4> clip_positions[SETUP_GROUPS];
+  std::vector<Triangle> triangles[SETUP_GROUPS];
+  std::vector<uint32_t> bins[SETUP_GROUPS][TILES];
+  std::vector<float> depth_buffer;
+  float tile_max[TILES];
+
+  std::atomic<uint32_t> pending{0};
+  std::mutex mutex;
+  std::condition_variable done;
+  bool busy = false;
+
+  // window coordinates in pixels and depth in [0, 1]
+  static glm::vec3 toWindow(const glm::vec4 &clip) {
+    const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+    return glm::vec3((ndc.x * 0.5f + 0.5f) * WIDTH,
+                     (ndc.y * 0.5f + 0.5f) * HEIGHT, ndc.z * 0.5f + 0.5f);
+  }
+
+  void rasterizeAsync(ThreadPool &pool) {
+    pending = TILES_Y;
+    for (uint32_t row = 0; row < TILES_Y; row++)
+      pool.submit([this, row] {
+        rasterize(row);
+        if (pending.fetch_sub(1) == 1)
+          finish();
+      });
+  }
+
+  void finish() {
+    countTriangles();
+    std::lock_guard<std::mutex> lock(mutex);
+    busy = false;
+    done.notify_all();
+  }
+
+  void countTriangles() {
+    last_triangles = 0;
+    for (const std::vector<Triangle> &group : triangles)
+      last_triangles += group.size();
+  }
+
+  // transforms and bins the triangles of every SETUP_GROUPS-th occluder
+  void setup(uint32_t group) {
+    triangles[group].clear();
+    for (std::vector<uint32_t> &bin : bins[group])
+      bin.clear();
+    for (size_t i = group; i < occluders.size(); i += SETUP_GROUPS) {
+      const OccluderMesh &mesh = *occluders[i].mesh;
+      const glm::mat4 mvp = view_projection * occluders[i].model;
+      clip_positions[group].resize(mesh.positions.size());
+      for (size_t v = 0; v < mesh.positions.size(); v++)
+        clip_positions[group][v] = mvp * glm::vec4(mesh.positions[v], 1.0f);
+      for (size_t t = 0; t + 2 < mesh.indices.size(); t += 3)
+        setupTriangle(group, clip_positions[group][mesh.indices[t]],
+                      clip_positions[group][mesh.indices[t + 1]],
+                      clip_positions[group][mesh.indices[t + 2]]);
+    }
+  }
+
+  void setupTriangle(uint32_t group, const glm::vec4 &a, const glm::vec4 &b,
+                     const glm::vec4 &c) {
+    // triangles crossing the near plane are dropped instead of clipped,
+    // that only makes the occluders smaller
+    if (a.z < -a.w || b.z < -b.w || c.z < -c.w)
+      return;
+    glm::vec3 p0 = toWindow(a), p1 = toWindow(b), p2 = toWindow(c);
+    // the pixel centers (x + 0.5, y + 0.5) inside the bounds
+    const float lo_x = std::min({p0.x, p1.x, p2.x});
+    const float hi_x = std::max({p0.x, p1.x, p2.x});
+    const float lo_y = std::min({p0.y, p1.y, p2.y});
+    const float hi_y = std::max({p0.y, p1.y, p2.y});
+    Triangle triangle;
+    triangle.min_x = std::max(int(std::ceil(lo_x - 0.5f)), 0);
+    triangle.max_x = std::min(int(std::floor(hi_x - 0.5f)), int(WIDTH) - 1);
+    triangle.min_y = std::max(int(std::ceil(lo_y - 0.5f)), 0);
+    triangle.max_y = std::min(int(std::floor(hi_y - 0.5f)), int(HEIGHT) - 1);
+    if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y)
+      return;
+
+    // both sides are drawn, the renderer doesn't cull faces either
+    float area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+    if (std::fabs(area) < 1e-8f)
+      return;
+    if (area < 0.0f) {
+      std::swap(p1, p2);
+      area = -area;
+    }
+    const glm::vec3 *corners[3] = {&p0, &p1, &p2};
+    for (uint32_t i = 0; i < 3; i++) {
+      const glm::vec3 &from = *corners[(i + 1) % 3];
+      const glm::vec3 &to = *corners[(i + 2) % 3];
+      glm::vec3 &edge = triangle.edges[i];
+      edge = glm::vec3(from.y - to.y, to.x - from.x,
+                       from.x * to.y - from.y * to.x);
+      // the edge function drops by at most half a pixel along each axis
+      // from the center, moving the edge in by that much leaves the pixels
+      // the triangle covers completely
+      edge.z -= 0.5f * (std::fabs(edge.x) + std::fabs(edge.y));
+    }
+    // depth is linear in window space after the perspective divide, the
+    // farthest point in a pixel is half a pixel along each axis away
+    const float dz1 = p1.z - p0.z, dz2 = p2.z - p0.z;
+    triangle.plane.x = (dz1 * (p2.y - p0.y) - dz2 * (p1.y - p0.y)) / area;
+    triangle.plane.y = (dz2 * (p1.x - p0.x) - dz1 * (p2.x - p0.x)) / area;
+    triangle.plane.z = p0.z - triangle.plane.x * p0.x -
+                       triangle.plane.y * p0.y +
+                       0.5f * (std::fabs(triangle.plane.x) +
+                               std::fabs(triangle.plane.y));
+
+    const uint32_t index = triangles[group].size();
+    triangles[group].push_back(triangle);
+    for (int ty = triangle.min_y / TILE_HEIGHT;
+         ty <= triangle.max_y / int(TILE_HEIGHT); ty++)
+      for (int tx = triangle.min_x / TILE_WIDTH;
+           tx <= triangle.max_x / int(TILE_WIDTH); tx++)
+        bins[group][ty * TILES_X + tx].push_back(index);
+  }
+
+  // clears and draws one row of tiles
+  void rasterize(uint32_t row) {
+    const int y0 = row * TILE_HEIGHT;
+    std::fill(depth_buffer.begin() + y0 * WIDTH,
+              depth_buffer.begin() + (y0 + TILE_HEIGHT) * WIDTH, 1.0f);
+    for (uint32_t tx = 0; tx < TILES_X; tx++) {
+      const uint32_t tile = row * TILES_X + tx;
+      const int x0 = tx * TILE_WIDTH;
+      for (uint32_t group = 0; group < SETUP_GROUPS; group++)
+        for (uint32_t index : bins[group][tile])
+          drawTriangle(triangles[group][index], x0, y0);
+
+      float farthest = 0.0f;
+      for (int y = y0; y < y0 + int(TILE_HEIGHT); y++)
+        for (int x = x0; x < x0 + int(TILE_WIDTH); x++)
+          farthest = std::max(farthest, depth_buffer[y * WIDTH + x]);
+      tile_max[tile] = farthest;
+    }
+  }
+
+  // draws the part of triangle inside the tile at (x0, y0)
+  void drawTriangle(const Triangle &triangle, int x0, int y0) {
+    const int min_y = std::max(triangle.min_y, y0);
+    const int max_y = std::min(triangle.max_y, y0 + int(TILE_HEIGHT) - 1);
+    // spans start 4 aligned within the tile so they never leave it
+    const int min_x = x0 + ((std::max(triangle.min_x, x0) - x0) & ~3);
+    const int max_x = std::min(triangle.max_x, x0 + int(TILE_WIDTH) - 1);
+    const glm::vec3 *e = triangle.edges;
+    const glm::vec3 &z = triangle.plane;
+#if defined(__SSE2__)
+    const __m128 lane = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 a0 = _mm_set1_ps(e[0].x), a1 = _mm_set1_ps(e[1].x);
+    const __m128 a2 = _mm_set1_ps(e[2].x), a_depth = _mm_set1_ps(z.x);
+    for (int y = min_y; y <= max_y; y++) {
+      const float py = y + 0.5f;
+      const __m128 c0 = _mm_set1_ps(e[0].y * py + e[0].z);
+      const __m128 c1 = _mm_set1_ps(e[1].y * py + e[1].z);
+      const __m128 c2 = _mm_set1_ps(e[2].y * py + e[2].z);
+      const __m128 c_depth = _mm_set1_ps(z.y * py + z.z);
+      float *pixels = &depth_buffer[y * WIDTH];
+      // the edge functions are evaluated at every pixel instead of stepped,
+      // so rounding doesn't drift along the span
+      for (int x = min_x; x <= max_x; x += 4) {
+        const __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lane);
+        const __m128 inside = _mm_and_ps(
+            _mm_and_ps(
+                _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(px, a0), c0), zero),
+                _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(px, a1), c1), zero)),
+            _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(px, a2), c2), zero));
+        const __m128 depth = _mm_add_ps(_mm_mul_ps(px, a_depth), c_depth);
+        const __m128 old = _mm_loadu_ps(pixels + x);
+        const __m128 nearer = _mm_min_ps(old, depth);
+        _mm_storeu_ps(pixels + x,
+                      _mm_or_ps(_mm_and_ps(inside, nearer),
+                                _mm_andnot_ps(inside, old)));
+      }
+    }
+#else
+    for (int y = min_y; y <= max_y; y++) {
+      const float py = y + 0.5f;
+      for (int x = min_x; x <= max_x; x++) {
+        const float px = x + 0.5f;
+        if (px * e[0].x + (e[0].y * py + e[0].z) >= 0.0f &&
+            px * e[1].x + (e[1].y * py + e[1].z) >= 0.0f &&
+            px * e[2].x + (e[2].y * py + e[2].z) >= 0.0f) {
+          float &pixel = depth_buffer[y * WIDTH + x];
+          pixel = std::min(pixel, px * z.x + (z.y * py + z.z));
+        }
+      }
+    }
+#endif
+  }
+};
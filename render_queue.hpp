@@ -0,0 +1,178 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "frustum_culling.hpp"
+#include "occlusion_culling.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// passes in the order they are drawn, the top bits of a sort key
+enum RenderPass : uint32_t {
+  // depth only, ahead of the opaque draws, see depth_prepass.hpp
+  RENDER_PASS_DEPTH = 0,
+  RENDER_PASS_OPAQUE = 1,
+  // drawn back to front after everything opaque
+  RENDER_PASS_TRANSPARENT = 2,
+};
+
+// runs one queued draw with the payload it was submitted with
+typedef void (*RenderFunction)(const void *payload);
+
+// Draws of a frame are submitted with a 64 bit sort key and a payload and run
+// sorted by key once everything is in, so draws sharing a program, material
+// and vertex array follow each other and opaque geometry goes front to back.
+// From the top bit down the key holds
+//
+//   pass 4 | program 12 | material 16 | vertex array 12 | depth 20
+//
+// GL names wider than their field wrap around, that only costs a state change
+// where two of them collide. The keys are sorted with an LSD radix sort,
+// 8 bits per pass, skipping the bytes every key has in common.
+//
+// Payloads are copied into a per frame arena and have to be trivially
+// copyable. Nothing is freed between frames, once the queue has seen its
+// largest frame it doesn't allocate anymore.
+class RenderQueue {
+public:
+  constexpr static uint32_t DEPTH_BITS = 20;
+  constexpr static uint32_t VERTEX_ARRAY_BITS = 12;
+  constexpr static uint32_t MATERIAL_BITS = 16;
+  constexpr static uint32_t PROGRAM_BITS = 12;
+  constexpr static uint32_t PASS_BITS = 4;
+
+  // draws in the last executed frame, and how many radix sort passes the
+  // keys needed out of 8
+  uint32_t last_draws = 0;
+  uint32_t last_sort_passes = 0;
+  // the camera of the frame, for culling what gets submitted, and the
+  // occluders seen by it if they were rendered
+  Frustum frustum;
+  const OcclusionBuffer *occlusion = NULL;
+
+  RenderQueue() {}
+  RenderQueue(const RenderQueue &) = delete;
+  RenderQueue &operator=(const RenderQueue &) = delete;
+
+  static uint64_t key(RenderPass pass, uint32_t program, uint32_t material,
+                      uint32_t vertex_array, uint32_t depth) {
+    uint64_t sort_key = field(pass, PASS_BITS);
+    sort_key = sort_key << PROGRAM_BITS | field(program, PROGRAM_BITS);
+    sort_key = sort_key << MATERIAL_BITS | field(material, MATERIAL_BITS);
+    sort_key = sort_key << VERTEX_ARRAY_BITS |
+               field(vertex_array, VERTEX_ARRAY_BITS);
+    return sort_key << DEPTH_BITS | field(depth, DEPTH_BITS);
+  }
+
+  // starts a new frame seen through view and projection, the clip planes
+  // place depth keys
+  void begin(const glm::mat4 &view, const glm::mat4 &projection,
+             float near_plane, float far_plane) {
+    entries.clear();
+    commands.clear();
+    payloads.clear();
+    frustum = Frustum(projection * view);
+    occlusion = NULL;
+    depth_row = glm::vec4(view[0][2], view[1][2], view[2][2], view[3][2]);
+    near_z = near_plane;
+    far_z = far_plane;
+  }
+
+  // quantized distance of a world position from the camera, 0 at the near
+  // plane. transparent draws flip it to go back to front.
+  uint32_t depth(const glm::vec3 &position, RenderPass pass) const {
+    const float distance = -glm::dot(depth_row, glm::vec4(position, 1.0f));
+    const float t =
+        glm::clamp((distance - near_z) / (far_z - near_z), 0.0f, 1.0f);
+    const uint32_t max = (1u << DEPTH_BITS) - 1;
+    const uint32_t quantized = uint32_t(t * max);
+    return pass == RENDER_PASS_TRANSPARENT ? max - quantized : quantized;
+  }
+
+  template <typename T>
+  void submit(uint64_t key, RenderFunction execute, const T &payload) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "render payloads are copied as bytes");
+    constexpr size_t ALIGNMENT = alignof(std::max_align_t);
+    static_assert(alignof(T) <= ALIGNMENT, "render payload over-aligned");
+    const size_t offset =
+        (payloads.size() + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    payloads.resize(offset + sizeof(T));
+    std::memcpy(payloads.data() + offset, &payload, sizeof(T));
+    entries.push_back({key, uint32_t(commands.size())});
+    commands.push_back({execute, offset});
+  }
+
+  // sorts the submitted draws and runs them, the queue stays empty until the
+  // next begin()
+  void execute() {
+    sort();
+    for (const Entry &entry : entries) {
+      const Command &command = commands[entry.command];
+      command.execute(payloads.data() + command.payload);
+    }
+    last_draws = entries.size();
+    entries.clear();
+    commands.clear();
+    payloads.clear();
+  }
+
+private:
+  struct Entry {
+    uint64_t key;
+    uint32_t command;
+  };
+  struct Command {
+    RenderFunction execute;
+    size_t payload;
+  };
+
+  std::vector<Entry> entries;
+  // radix sort ping-pong buffer
+  std::vector<Entry> sorted;
+  std::vector<Command> commands;
+  std::vector<uint8_t> payloads;
+  // the row of the view matrix giving view space z
+  glm::vec4 depth_row = glm::vec4(0.0f, 0.0f, -1.0f, 0.0f);
+  float near_z = 0.1f;
+  float far_z = 100.0f;
+
+  static uint64_t field(uint32_t value, uint32_t bits) {
+    return value & ((1u << bits) - 1);
+  }
+
+  // stable LSD radix sort of the entries by key, all eight byte histograms
+  // are counted in one go
+  void sort() {
+    last_sort_passes = 0;
+    const size_t count = entries.size();
+    if (count < 2)
+      return;
+    uint32_t histograms[8][256] = {};
+    for (const Entry &entry : entries)
+      for (uint32_t byte = 0; byte < 8; byte++)
+        histograms[byte][(entry.key >> (byte * 8)) & 0xff]++;
+
+    sorted.resize(count);
+    for (uint32_t byte = 0; byte < 8; byte++) {
+      uint32_t *histogram = histograms[byte];
+      // every key has the same byte here, the order wouldn't change
+      if (histogram[(entries[0].key >> (byte * 8)) & 0xff] == count)
+        continue;
+      uint32_t offset = 0;
+      for (uint32_t digit = 0; digit < 256; digit++) {
+        const uint32_t digit_count = histogram[digit];
+        histogram[digit] = offset;
+        offset += digit_count;
+      }
+      for (const Entry &entry : entries)
+        sorted[histogram[(entry.key >> (byte * 8)) & 0xff]++] = entry;
+      entries.swap(sorted);
+      last_sort_passes++;
+    }
+  }
+};
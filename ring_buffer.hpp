@@ -0,0 +1,168 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "gl_state.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+// where an allocation from the RingBuffer lives, data is the CPU pointer into
+// the mapping and offset the matching offset into the GL buffer. data is NULL
+// if the frame region was full.
+struct RingAllocation {
+  void *data = NULL;
+  GLintptr offset = 0;
+  GLsizeiptr size = 0;
+};
+
+// Streaming buffer for data written once per frame (uniform blocks, instance
+// transforms, indirect commands). One buffer with immutable storage is mapped
+// persistently and coherently for its whole life and split into FRAMES
+// regions, frame N writes region N % FRAMES. A fence is placed behind the
+// draws of every frame, before a region is written again the CPU checks that
+// the GPU is done with it. With three regions the GPU has to fall two whole
+// frames behind before the CPU waits, fence_waits counts how often it did.
+class RingBuffer {
+public:
+  constexpr static uint32_t FRAMES = 3;
+
+  uint32_t buffer = 0;
+  // bytes per frame region
+  GLsizeiptr region_size = 0;
+  // offset alignments required by glBindBufferRange
+  GLint uniform_alignment = 256;
+  GLint storage_alignment = 256;
+
+  // fence statistics since init()
+  uint64_t frames = 0;
+  uint64_t fence_waits = 0;
+
+  RingBuffer() {}
+  RingBuffer(const RingBuffer &) = delete;
+  RingBuffer &operator=(const RingBuffer &) = delete;
+
+  void init(GLsizeiptr frame_bytes) {
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment);
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT,
+                  &storage_alignment);
+    // regions start aligned for any binding
+    const GLsizeiptr alignment =
+        std::max(uniform_alignment, storage_alignment);
+    region_size = (frame_bytes + alignment - 1) / alignment * alignment;
+
+    constexpr GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &buffer);
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, region_size * FRAMES, NULL, flags);
+    mapping = static_cast<uint8_t *>(glMapBufferRange(
+        GL_COPY_WRITE_BUFFER, 0, region_size * FRAMES, flags));
+    GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (mapping == NULL)
+      std::cout << "ERROR::RING_BUFFER::MAP_FAILED" << std::endl;
+  }
+
+  // moves to the region of the next frame, waiting for the GPU only if it
+  // still reads that region from FRAMES frames ago
+  void beginFrame() {
+    region = (region + 1) % FRAMES;
+    head = 0;
+    frames++;
+    GLsync &fence = fences[region];
+    if (fence == 0)
+      return;
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    if (result == GL_TIMEOUT_EXPIRED) {
+      fence_waits++;
+      do
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                  1000000000);
+      while (result == GL_TIMEOUT_EXPIRED);
+    }
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  // marks the end of the GPU commands reading the current region, call after
+  // the last draw of the frame
+  void endFrame() {
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+
+  RingAllocation allocate(GLsizeiptr size, GLsizeiptr alignment) {
+    RingAllocation allocation;
+    const GLsizeiptr start = (head + alignment - 1) / alignment * alignment;
+    if (mapping == NULL || start + size > region_size) {
+      std::cout << "ERROR::RING_BUFFER::FRAME_REGION_FULL: " << size
+                << " bytes requested, " << region_size - head << " left"
+                << std::endl;
+      return allocation;
+    }
+    head = start + size;
+    allocation.offset = region * region_size + start;
+    allocation.data = mapping + allocation.offset;
+    allocation.size = size;
+    return allocation;
+  }
+
+  // copies count elements into the current region
+  template <typename T>
+  RingAllocation write(const T *data, size_t count, GLsizeiptr alignment) {
+    RingAllocation allocation = allocate(count * sizeof(T), alignment);
+    if (allocation.data != NULL)
+      std::memcpy(allocation.data, data, count * sizeof(T));
+    return allocation;
+  }
+
+  // writes value and binds it as the uniform block at binding
+  template <typename T> bool bindUniform(uint32_t binding, const T &value) {
+    RingAllocation allocation = write(&value, 1, uniform_alignment);
+    if (allocation.data == NULL)
+      return false;
+    GLState::shared().bindBufferRange(GL_UNIFORM_BUFFER, binding, buffer,
+                                      allocation.offset, allocation.size);
+    return true;
+  }
+
+  // writes count elements and binds them as the storage buffer at binding
+  template <typename T>
+  bool bindStorage(uint32_t binding, const T *data, size_t count) {
+    RingAllocation allocation = write(data, count, storage_alignment);
+    if (allocation.data == NULL)
+      return false;
+    GLState::shared().bindBufferRange(GL_SHADER_STORAGE_BUFFER, binding,
+                                      buffer, allocation.offset,
+                                      allocation.size);
+    return true;
+  }
+
+  // waits for the GPU and deletes the buffer, call before the context is
+  // destroyed
+  void release() {
+    for (GLsync &fence : fences) {
+      if (fence == 0)
+        continue;
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+      glDeleteSync(fence);
+      fence = 0;
+    }
+    if (buffer != 0) {
+      GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+      GLState::shared().bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+      GLState::shared().deleteBuffers(1, &buffer);
+    }
+    buffer = 0;
+    mapping = NULL;
+  }
+
+private:
+  uint8_t *mapping = NULL;
+  GLsync fences[FRAMES] = {};
+  // region of the current frame and bytes used in it
+  uint32_t region = FRAMES - 1;
+  GLsizeiptr head = 0;
+};
@@ -1,4 +1,10 @@
 #version 460
+#extension GL_ARB_bindless_texture : enable
+
+// compiled per ShaderFeature set, see shader_permutations.hpp:
+//   DIR_LIGHT, POINT_LIGHTS, SPOT_LIGHT  the lights evaluated
+//   HAS_SPECULAR_MAP                     the specular map is sampled, without
+//                                        it the specular texel is white
 
 struct Material {
     // sampler2D diffuse;
@@ -7,6 +13,8 @@ struct Material {
     float shininess;
 };
 
+// the light structs are laid out to pack into std140 without padding
+// between members, see uniform_blocks.hpp
 struct DirLight {
     vec3 direction;
 
@@ -17,68 +25,177 @@ struct DirLight {
 
 struct PointLight {
     vec3 position;
-
     float constant;
-    float linear;
-    float quadratic;
 
     vec3 ambient;
+    float linear;
     vec3 diffuse;
+    float quadratic;
     vec3 specular;
+    float radius;
 };
 
 struct SpotLight {
     vec3  position;
-    vec3  direction;
     float cut_off;
+    vec3  direction;
     float outer_cut_off;
 
-    float constant;
-    float linear;
-    float quadratic;
-
     vec3 ambient;
+    float constant;
     vec3 diffuse;
+    float linear;
     vec3 specular;
+    float quadratic;
 };
 
 layout (location = 0) in vec3 normal;
 layout (location = 1) in vec3 frag_pos;
 layout (location = 2) in vec2 tex_coords;
+layout (location = 3) flat in uint material_index;
 
 layout (location = 0) out vec4 frag_color;
 
+// textures bound per mesh, used when material_textures is false
 uniform sampler2D texture_diffuse1;
 uniform sampler2D texture_specular1;
 
-uniform vec3 camera_pos;
+// textures of the material at material_index, see material_table.hpp. with
+// bindless textures the handles are used, otherwise the texture arrays.
+uniform bool material_textures;
+
+const int MATERIAL_DIFFUSE = 0;
+const int MATERIAL_SPECULAR = 1;
+
+struct MaterialData {
+    uvec2 handles[2];
+    int arrays[2];
+    int layers[2];
+};
+
+layout (std430, binding = 2) readonly buffer material_buffer {
+    MaterialData materials[];
+};
+
+layout (binding = 8) uniform sampler2DArray texture_arrays[8];
+
+// texels of the fragment, sampled once in main()
+vec3 diffuse_texel;
+vec3 specular_texel;
+
 uniform Material material;
-uniform DirLight dir_light;
-uniform SpotLight spot_light;
-uniform PointLight point_light;
 
+// per frame camera data, see CameraBlock in uniform_blocks.hpp
+layout (std140, binding = 0) uniform camera_block {
+    mat4 view;
+    mat4 projection;
+    vec3 camera_pos;
+};
+
+// per frame light data, see LightBlock in uniform_blocks.hpp
+layout (std140, binding = 1) uniform light_block {
+    DirLight dir_light;
+    SpotLight spot_light;
+    uvec3 cluster_grid;
+    uint point_light_count;
+    vec2 cluster_tile_size;
+    float cluster_scale;
+    float cluster_bias;
+    float cluster_near;
+    float cluster_far;
+};
+
+layout (std430, binding = 7) readonly buffer point_light_buffer {
+    PointLight point_lights[];
+};
+
+// the point lights touching each cluster, see LightClusters in
+// light_clusters.hpp
+const uint MAX_CLUSTER_LIGHTS = 127u;
+
+struct LightCluster {
+    uint count;
+    uint lights[MAX_CLUSTER_LIGHTS];
+};
+
+layout (std430, binding = 8) readonly buffer light_cluster_buffer {
+    LightCluster clusters[];
+};
+
+vec4 sample_material(int slot);
+uint cluster_index();
 vec3 calc_dir_light(DirLight light, vec3 normal, vec3 view_dir);
 vec3 calc_point_light(PointLight light, vec3 normal, vec3 frag_pos, vec3 view_dir);
 vec3 calc_spot_light(SpotLight light, vec3 normal, vec3 frag_pos, vec3 view_dir);
 
 void main()
 {
+    // textures, a missing specular map reads white like in the material
+    // table
+    specular_texel = vec3(1.0);
+    if (material_textures) {
+        diffuse_texel = vec3(sample_material(MATERIAL_DIFFUSE));
+#ifdef HAS_SPECULAR_MAP
+        specular_texel = vec3(sample_material(MATERIAL_SPECULAR));
+#endif
+    } else {
+        diffuse_texel = vec3(texture(texture_diffuse1, tex_coords));
+#ifdef HAS_SPECULAR_MAP
+        specular_texel = vec3(texture(texture_specular1, tex_coords));
+#endif
+    }
+
     // properties
     vec3 norm = normalize(normal);
     vec3 view_dir = normalize(camera_pos - frag_pos);
+    vec3 result = vec3(0.0);
 
+#ifdef DIR_LIGHT
     // directional lighting
-    vec3 result = calc_dir_light(dir_light, norm, view_dir);
-
-    // point light
-    result += calc_point_light(point_light, norm, frag_pos, view_dir);
-
+    result += calc_dir_light(dir_light, norm, view_dir);
+#endif
+
+#ifdef POINT_LIGHTS
+    // point lights of the cluster
+    uint cluster = cluster_index();
+    uint light_count = min(clusters[cluster].count, MAX_CLUSTER_LIGHTS);
+    for (uint i = 0u; i < light_count; i++)
+        result += calc_point_light(point_lights[clusters[cluster].lights[i]],
+                                   norm, frag_pos, view_dir);
+#endif
+
+#ifdef SPOT_LIGHT
     // spot light
     result += calc_spot_light(spot_light, norm, frag_pos, view_dir);
+#endif
 
     frag_color = vec4(result, 1.0);
 }
 
+vec4 sample_material(int slot)
+{
+    MaterialData material = materials[material_index];
+#ifdef GL_ARB_bindless_texture
+    if (material.handles[slot] != uvec2(0))
+        return texture(sampler2D(material.handles[slot]), tex_coords);
+#endif
+    int array = material.arrays[slot];
+    if (array < 0)
+        return vec4(1.0);
+    return texture(texture_arrays[array], vec3(tex_coords, material.layers[slot]));
+}
+
+// cluster of the fragment from its pixel and view space depth
+uint cluster_index()
+{
+    float depth = -(view * vec4(frag_pos, 1.0)).z;
+    uvec3 cell;
+    cell.xy = uvec2(gl_FragCoord.xy / cluster_tile_size);
+    cell.z = uint(max(log(depth) * cluster_scale + cluster_bias, 0.0));
+    cell = min(cell, cluster_grid - 1u);
+    return cell.x + cluster_grid.x * (cell.y + cluster_grid.y * cell.z);
+}
+
 vec3 calc_dir_light(DirLight light, vec3 normal, vec3 view_dir)
 {
     vec3 light_dir = normalize(-light.direction);
@@ -91,9 +208,9 @@ vec3 calc_dir_light(DirLight light, vec3 normal, vec3 view_dir)
     float spec = pow(max(dot(view_dir, reflect_dir), 0.0), material.shininess);
 
     // combine results
-    vec3 ambient  = light.ambient  * vec3(texture(texture_diffuse1, tex_coords));
-    vec3 diffuse  = light.diffuse  * diff * vec3(texture(texture_diffuse1, tex_coords));
-    vec3 specular = light.specular * spec * vec3(texture(texture_specular1, tex_coords));
+    vec3 ambient  = light.ambient  * diffuse_texel;
+    vec3 diffuse  = light.diffuse  * diff * diffuse_texel;
+    vec3 specular = light.specular * spec * specular_texel;
 
     return (ambient + diffuse + specular);
 }
@@ -113,11 +230,14 @@ vec3 calc_point_light(PointLight light, vec3 normal, vec3 frag_pos, vec3 view_di
     float distance    = length(light.position - frag_pos);
     float attenuation = 1.0 / (light.constant + light.linear * distance +
     light.quadratic * (distance * distance));
+    // fade out towards the radius the light was assigned to clusters with
+    float falloff = clamp(1.0 - pow(distance / light.radius, 4.0), 0.0, 1.0);
+    attenuation *= falloff * falloff;
 
     // combine results
-    vec3 ambient  = light.ambient  * vec3(texture(texture_diffuse1, tex_coords));
-    vec3 diffuse  = light.diffuse  * diff * vec3(texture(texture_diffuse1, tex_coords));
-    vec3 specular = light.specular * spec * vec3(texture(texture_specular1, tex_coords));
+    vec3 ambient  = light.ambient  * diffuse_texel;
+    vec3 diffuse  = light.diffuse  * diff * diffuse_texel;
+    vec3 specular = light.specular * spec * specular_texel;
 
     ambient  *= attenuation;
     diffuse  *= attenuation;
@@ -147,9 +267,9 @@ vec3 calc_spot_light(SpotLight light, vec3 normal, vec3 frag_pos, vec3 view_dir)
     float intensity = clamp((theta - light.outer_cut_off) / epsilon, 0.0, 1.0);
 
     // combine results
-    vec3 ambient = light.ambient * vec3(texture(texture_diffuse1, tex_coords));
-    vec3 diffuse = light.diffuse * diff * vec3(texture(texture_diffuse1, tex_coords));
-    vec3 specular = light.specular * spec * vec3(texture(texture_specular1, tex_coords));
+    vec3 ambient = light.ambient * diffuse_texel;
+    vec3 diffuse = light.diffuse * diff * diffuse_texel;
+    vec3 specular = light.specular * spec * specular_texel;
 
     ambient *= attenuation * intensity;
     diffuse *= attenuation * intensity;
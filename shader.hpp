@@ -5,43 +5,84 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "gl_state.hpp"
+
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+// GLSL type a C++ type is set on, samplers are set as int
+template <typename T> constexpr GLenum uniformType();
+template <> constexpr GLenum uniformType<bool>() { return GL_BOOL; }
+template <> constexpr GLenum uniformType<int>() { return GL_INT; }
+template <> constexpr GLenum uniformType<float>() { return GL_FLOAT; }
+template <> constexpr GLenum uniformType<glm::vec2>() { return GL_FLOAT_VEC2; }
+template <> constexpr GLenum uniformType<glm::vec3>() { return GL_FLOAT_VEC3; }
+template <> constexpr GLenum uniformType<glm::vec4>() { return GL_FLOAT_VEC4; }
+template <> constexpr GLenum uniformType<glm::mat2>() { return GL_FLOAT_MAT2; }
+template <> constexpr GLenum uniformType<glm::mat3>() { return GL_FLOAT_MAT3; }
+template <> constexpr GLenum uniformType<glm::mat4>() { return GL_FLOAT_MAT4; }
+
+// handle to a uniform resolved once with Shader::uniform(), setting it is at
+// most a single GL call without any name lookup, and none if the value didn't
+// change (see GLState). uniforms the linker dropped have location -1, setting
+// them does nothing.
+template <typename T> struct Uniform {
+  GLuint program = 0;
+  GLint location = -1;
+  UniformValue *cache = NULL;
+  // generation of the program when resolved, see GLState::forgetProgram()
+  const uint32_t *program_generation = NULL;
+  uint32_t generation = 0;
+
+  // false once the program is deleted, even if GL reuses its name
+  bool resolvedOn(GLuint id) const {
+    return program == id && id != 0 && program_generation != NULL &&
+           *program_generation == generation;
+  }
+
+  void set(const T &value) const {
+    if (program_generation == NULL || *program_generation != generation)
+      return;
+    GLState::shared().uniform(program, location, cache, value);
+  }
+};
 
 class Shader {
 public:
-  unsigned int ID;
+  unsigned int ID = 0;
   // constructor generates the shader on the fly
   // ------------------------------------------------------------------------
   void init(const char *vertexPath, const char *fragmentPath) {
     // 1. retrieve the vertex/fragment source code from filePath
-    std::string vertexCode;
-    std::string fragmentCode;
-    std::ifstream vShaderFile;
-    std::ifstream fShaderFile;
+    initSource(readSource(vertexPath), readSource(fragmentPath));
+  }
+
+  // the source code in a file, empty if it can't be read
+  static std::string readSource(const char *path) {
+    std::ifstream file;
     // ensure ifstream objects can throw exceptions:
-    vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    fShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
     try {
-      // open files
-      vShaderFile.open(vertexPath);
-      fShaderFile.open(fragmentPath);
-      std::stringstream vShaderStream, fShaderStream;
-      // read file's buffer contents into streams
-      vShaderStream << vShaderFile.rdbuf();
-      fShaderStream << fShaderFile.rdbuf();
-      // close file handlers
-      vShaderFile.close();
-      fShaderFile.close();
-      // convert stream into string
-      vertexCode = vShaderStream.str();
-      fragmentCode = fShaderStream.str();
+      file.open(path);
+      std::stringstream stream;
+      // read file's buffer contents into the stream
+      stream << file.rdbuf();
+      file.close();
+      return stream.str();
     } catch (std::ifstream::failure &e) {
       std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what()
                 << std::endl;
     }
+    return std::string();
+  }
+
+  // same as init() with the source code itself
+  void initSource(const std::string &vertexCode,
+                  const std::string &fragmentCode) {
     const char *vShaderCode = vertexCode.c_str();
     const char *fShaderCode = fragmentCode.c_str();
     // 2. compile shaders
@@ -58,6 +99,8 @@ public:
     checkCompileErrors(fragment, "FRAGMENT");
     // shader Program
     ID = glCreateProgram();
+    // the name may have belonged to a deleted program
+    GLState::shared().forgetProgram(ID);
     glAttachShader(ID, vertex);
     glAttachShader(ID, fragment);
     glLinkProgram(ID);
@@ -66,8 +109,29 @@ public:
     // necessary
     glDeleteShader(vertex);
     glDeleteShader(fragment);
+    // 3. remember where every uniform lives
+    introspectUniforms();
   }
 
+  // a compute program from a single file
+  void initCompute(const char *computePath) {
+    initComputeSource(readSource(computePath));
+  }
+  // same as initCompute() with the source code itself
+  void initComputeSource(const std::string &computeCode) {
+    const char *cShaderCode = computeCode.c_str();
+    unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(compute, 1, &cShaderCode, NULL);
+    glCompileShader(compute);
+    checkCompileErrors(compute, "COMPUTE");
+    ID = glCreateProgram();
+    GLState::shared().forgetProgram(ID);
+    glAttachShader(ID, compute);
+    glLinkProgram(ID);
+    checkCompileErrors(ID, "PROGRAM");
+    glDeleteShader(compute);
+    introspectUniforms();
+  }
   Shader(const char *vertexPath, const char *fragmentPath) {
     init(vertexPath, fragmentPath);
   }
@@ -76,59 +140,128 @@ public:
 
   // activate the shader
   // ------------------------------------------------------------------------
-  void use() const { glUseProgram(ID); }
-  // utility uniform functions
+  void use() const { GLState::shared().useProgram(ID); }
+
+  // returns a handle to the named uniform, resolve handles once and keep them
+  // around for anything set every frame
+  template <typename T> Uniform<T> uniform(const std::string &name) const {
+    Uniform<T> handle;
+    handle.program = ID;
+    handle.program_generation = GLState::shared().programGeneration(ID);
+    handle.generation = *handle.program_generation;
+    auto found = uniforms.find(name);
+    if (found == uniforms.end())
+      return handle;
+    handle.location = found->second.location;
+    handle.cache = GLState::shared().uniformCache(ID, handle.location);
+    // samplers are set with an int
+    const GLenum type = found->second.type;
+    if (type != uniformType<T>() &&
+        !(uniformType<T>() == GL_INT && isSampler(type)))
+      std::cout << "ERROR::SHADER::UNIFORM_TYPE_MISMATCH: " << name
+                << std::endl;
+    return handle;
+  }
+
+  // location of an active uniform from the table built at link time, -1 if
+  // there is none
+  GLint location(const std::string &name) const {
+    auto found = uniforms.find(name);
+    return found == uniforms.end() ? -1 : found->second.location;
+  }
+
+  // utility uniform functions, they look the name up in a hash table. use
+  // uniform() handles on hot paths. values go through GLState.
   // ------------------------------------------------------------------------
   void setBool(const std::string &name, bool value) const {
-    glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+    GLState::shared().uniform(ID, location(name), value);
   }
   // ------------------------------------------------------------------------
   void setInt(const std::string &name, int value) const {
-    glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+    GLState::shared().uniform(ID, location(name), value);
   }
   // ------------------------------------------------------------------------
   void setFloat(const std::string &name, float value) const {
-    glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+    GLState::shared().uniform(ID, location(name), value);
   }
   // ------------------------------------------------------------------------
   void setVec2(const std::string &name, const glm::vec2 &value) const {
-    glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+    GLState::shared().uniform(ID, location(name), value);
   }
   void setVec2(const std::string &name, float x, float y) const {
-    glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+    GLState::shared().uniform(ID, location(name), glm::vec2(x, y));
   }
   // ------------------------------------------------------------------------
   void setVec3(const std::string &name, const glm::vec3 &value) const {
-    glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+    GLState::shared().uniform(ID, location(name), value);
   }
   void setVec3(const std::string &name, float x, float y, float z) const {
-    glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+    GLState::shared().uniform(ID, location(name), glm::vec3(x, y, z));
   }
   // ------------------------------------------------------------------------
   void setVec4(const std::string &name, const glm::vec4 &value) const {
-    glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+    GLState::shared().uniform(ID, location(name), value);
   }
   void setVec4(const std::string &name, float x, float y, float z,
                float w) const {
-    glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+    GLState::shared().uniform(ID, location(name), glm::vec4(x, y, z, w));
   }
   // ------------------------------------------------------------------------
   void setMat2(const std::string &name, const glm::mat2 &mat) const {
-    glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE,
-                       &mat[0][0]);
+    GLState::shared().uniform(ID, location(name), mat);
   }
   // ------------------------------------------------------------------------
   void setMat3(const std::string &name, const glm::mat3 &mat) const {
-    glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE,
-                       &mat[0][0]);
+    GLState::shared().uniform(ID, location(name), mat);
   }
   // ------------------------------------------------------------------------
   void setMat4(const std::string &name, const glm::mat4 &mat) const {
-    glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE,
-                       &mat[0][0]);
+    GLState::shared().uniform(ID, location(name), mat);
   }
 
 private:
+  struct UniformInfo {
+    GLint location;
+    GLenum type;
+  };
+  // active uniforms outside of blocks by name, arrays are also listed under
+  // their name without "[0]"
+  std::unordered_map<std::string, UniformInfo> uniforms;
+
+  void introspectUniforms() {
+    uniforms.clear();
+    GLint count = 0;
+    glGetProgramInterfaceiv(ID, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+    GLint max_length = 0;
+    glGetProgramInterfaceiv(ID, GL_UNIFORM, GL_MAX_NAME_LENGTH, &max_length);
+    std::vector<GLchar> name(max_length + 1);
+
+    const GLenum properties[] = {GL_BLOCK_INDEX, GL_TYPE, GL_LOCATION};
+    for (GLint i = 0; i < count; i++) {
+      GLint values[3];
+      glGetProgramResourceiv(ID, GL_UNIFORM, i, 3, properties, 3, NULL,
+                             values);
+      // members of uniform blocks have no location
+      if (values[0] != -1)
+        continue;
+      glGetProgramResourceName(ID, GL_UNIFORM, i, name.size(), NULL,
+                               name.data());
+      UniformInfo info = {values[2], GLenum(values[1])};
+      std::string uniform_name(name.data());
+      uniforms[uniform_name] = info;
+      if (uniform_name.size() > 3 &&
+          uniform_name.compare(uniform_name.size() - 3, 3, "[0]") == 0)
+        uniforms[uniform_name.substr(0, uniform_name.size() - 3)] = info;
+    }
+  }
+
+  static bool isSampler(GLenum type) {
+    return type == GL_SAMPLER_2D || type == GL_SAMPLER_3D ||
+           type == GL_SAMPLER_CUBE || type == GL_SAMPLER_2D_ARRAY ||
+           type == GL_SAMPLER_2D_SHADOW || type == GL_SAMPLER_BUFFER ||
+           type == GL_UNSIGNED_INT_SAMPLER_2D || type == GL_INT_SAMPLER_2D;
+  }
+
   // utility function for checking shader compilation/linking errors.
   // ------------------------------------------------------------------------
   void checkCompileErrors(GLuint shader, std::string type) {
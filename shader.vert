@@ -3,20 +3,80 @@
 layout (location = 0) in vec3 a_pos;
 layout (location = 1) in vec3 a_normal;
 layout (location = 2) in vec2 a_tex_coords;
+// tangent frame quaternion of packed vertices
+layout (location = 3) in vec4 a_qtangent;
 
 layout (location = 0) out vec3 normal;
 layout (location = 1) out vec3 frag_pos;
 layout (location = 2) out vec2 tex_coords;
+layout (location = 3) flat out uint material_index;
 
-uniform mat4 model;
-uniform mat3 normal_matrix;
-uniform mat4 view;
-uniform mat4 projection;
+// the same depth as depth_prepass.vert, see depth_prepass.hpp
+invariant gl_Position;
+
+// per frame camera data, see CameraBlock in uniform_blocks.hpp
+layout (std140, binding = 0) uniform camera_block {
+    mat4 view;
+    mat4 projection;
+    vec3 camera_pos;
+};
+
+// vertex layout of the batch, see vertex_format.hpp
+uniform bool packed_vertex;
+
+// per mesh data, see MeshDrawData in mesh.hpp
+struct DrawData {
+    vec4 position_scale;
+    vec4 position_offset;
+    uint material;
+};
+
+layout (std430, binding = 0) readonly buffer draw_data_buffer {
+    DrawData draws[];
+};
+
+vec3 quat_rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+// per instance transforms, see InstanceData in mesh.hpp
+struct InstanceData {
+    mat4 model;
+    mat4 normal_matrix;
+};
+
+layout (std430, binding = 1) readonly buffer instance_data_buffer {
+    InstanceData instances[];
+};
+
+// draws of the GPU culling find their instances through the indices of the
+// ones left visible, see gpu_culling.hpp
+uniform bool gpu_culled;
+
+layout (std430, binding = 3) readonly buffer visible_instance_buffer {
+    uint visible_instances[];
+};
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(a_pos, 1.0);
-    normal = normal_matrix * a_normal;
-    frag_pos = vec3(model * vec4(a_pos, 1.0));
+    DrawData draw = draws[gl_BaseInstance];
+    uint instance_index = uint(gl_InstanceID);
+    if (gpu_culled)
+        instance_index = visible_instances[instance_index];
+    InstanceData instance = instances[instance_index];
+
+    vec3 pos = draw.position_offset.xyz + a_pos * draw.position_scale.xyz;
+    vec3 vertex_normal = a_normal;
+    if (packed_vertex) {
+        // the frame's z axis is the normal
+        vertex_normal = quat_rotate(normalize(a_qtangent), vec3(0.0, 0.0, 1.0));
+    }
+
+    vec4 world_pos = instance.model * vec4(pos, 1.0);
+    gl_Position = projection * view * world_pos;
+    normal = mat3(instance.normal_matrix) * vertex_normal;
+    frag_pos = vec3(world_pos);
     tex_coords = a_tex_coords;
+    material_index = draw.material;
 }
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "gl_state.hpp"
+#include "shader.hpp"
+
+#include <cstdint>
+#include <string>
+
+// features a program variant is compiled with, each bit is a #define the
+// shaders test with #ifdef. the frame picks the lights, meshes their
+// material maps.
+enum ShaderFeature : uint32_t {
+  SHADER_DIR_LIGHT = 1u << 0,
+  SHADER_POINT_LIGHTS = 1u << 1,
+  SHADER_SPOT_LIGHT = 1u << 2,
+  SHADER_SPECULAR_MAP = 1u << 3,
+};
+
+constexpr uint32_t SHADER_FEATURE_COUNT = 4;
+constexpr uint32_t SHADER_VARIANTS = 1u << SHADER_FEATURE_COUNT;
+constexpr uint32_t SHADER_LIGHT_FEATURES =
+    SHADER_DIR_LIGHT | SHADER_POINT_LIGHTS | SHADER_SPOT_LIGHT;
+constexpr uint32_t SHADER_MATERIAL_FEATURES = SHADER_SPECULAR_MAP;
+
+// the #define of every feature bit, lowest bit first
+constexpr const char *SHADER_FEATURE_DEFINES[SHADER_FEATURE_COUNT] = {
+    "DIR_LIGHT", "POINT_LIGHTS", "SPOT_LIGHT", "HAS_SPECULAR_MAP"};
+
+// Variants of one vertex and fragment shader pair, keyed by ShaderFeature
+// bitmask. The sources are read once by init(), a variant is compiled the
+// first time variant() asks for it, with the #defines of its features
+// injected after the #version line, and cached for the rest of the run.
+// Features the shaders don't test are left out of the key, so asking for
+// them never compiles the same program twice. Ask for exactly what is
+// needed: a variant without a feature doesn't pay for it at all, a variant
+// with one that isn't there still computes it.
+class ShaderPermutations {
+public:
+  // called once on every new variant, e.g. to set uniforms that never change
+  using SetupFunction = void (*)(const Shader &);
+
+  // features the shaders test, variants compiled so far
+  uint32_t used_features = 0;
+  uint32_t compiled = 0;
+
+  ShaderPermutations() {}
+  ShaderPermutations(const ShaderPermutations &) = delete;
+  ShaderPermutations &operator=(const ShaderPermutations &) = delete;
+
+  void init(const char *vertexPath, const char *fragmentPath,
+            uint32_t features, SetupFunction setup_function = NULL) {
+    vertex_code = Shader::readSource(vertexPath);
+    fragment_code = Shader::readSource(fragmentPath);
+    used_features = features;
+    setup = setup_function;
+  }
+
+  // the variant compiled with the used ones of features
+  const Shader &variant(uint32_t features) {
+    features &= used_features;
+    Shader &shader = variants[features];
+    if (shader.ID == 0) {
+      shader.initSource(preprocess(vertex_code, features),
+                        preprocess(fragment_code, features));
+      compiled++;
+      if (setup != NULL)
+        setup(shader);
+    }
+    return shader;
+  }
+
+  // source with a #define per feature after its #version line, and a #line
+  // so compile errors still point at the lines of the file
+  static std::string preprocess(const std::string &source,
+                                uint32_t features) {
+    size_t insert = 0;
+    const size_t version = source.find("#version");
+    if (version != std::string::npos) {
+      insert = source.find('\n', version);
+      insert = insert == std::string::npos ? source.size() : insert + 1;
+    }
+    std::string defines;
+    for (uint32_t i = 0; i < SHADER_FEATURE_COUNT; i++)
+      if (features & (1u << i))
+        defines += std::string("#define ") + SHADER_FEATURE_DEFINES[i] + "\n";
+    uint32_t line = 1;
+    for (size_t i = 0; i < insert; i++)
+      line += source[i] == '\n';
+    defines += "#line " + std::to_string(line) + "\n";
+    return source.substr(0, insert) + defines + source.substr(insert);
+  }
+
+  void release() {
+    for (Shader &shader : variants) {
+      if (shader.ID != 0)
+        GLState::shared().deleteProgram(shader.ID);
+      shader.ID = 0;
+    }
+    compiled = 0;
+  }
+
+private:
+  std::string vertex_code;
+  std::string fragment_code;
+  SetupFunction setup = NULL;
+  Shader variants[SHADER_VARIANTS];
+};
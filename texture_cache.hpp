@@ -0,0 +1,109 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "gl_state.hpp"
+#include "hash.hpp"
+#include "texture_loader.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Process wide, reference counted texture cache shared by every Model.
+// Textures are looked up by canonical path and, for paths seen for the first
+// time, by a hash of the file content, so the same image reached through a
+// different path or copied under another name is only uploaded once. The GL
+// texture is deleted when its last user releases it.
+class TextureCache {
+public:
+  TextureCache(const TextureCache &) = delete;
+  TextureCache &operator=(const TextureCache &) = delete;
+
+  static TextureCache &shared() {
+    static TextureCache cache;
+    return cache;
+  }
+
+  // returns the texture for the file, loading it if nobody holds it yet.
+  // every acquire has to be paired with a release. srgb is passed on to the
+  // loader, the first request for a file decides it.
+  uint32_t acquire(const std::string &filename, bool srgb = false) {
+    const std::string path = canonicalPath(filename);
+
+    auto by_path = paths.find(path);
+    if (by_path != paths.end()) {
+      entries[by_path->second].references++;
+      return by_path->second;
+    }
+
+    // new path, maybe the same content is already loaded under another one
+    const uint64_t content_hash = hashFile(path);
+    if (content_hash != 0) {
+      auto by_content = contents.find(content_hash);
+      if (by_content != contents.end()) {
+        Entry &entry = entries[by_content->second];
+        entry.references++;
+        entry.paths.push_back(path);
+        paths[path] = by_content->second;
+        return by_content->second;
+      }
+    }
+
+    const uint32_t id = TextureLoader::shared().load(path, srgb);
+    Entry &entry = entries[id];
+    entry.references = 1;
+    entry.content_hash = content_hash;
+    entry.paths.push_back(path);
+    paths[path] = id;
+    if (content_hash != 0)
+      contents[content_hash] = id;
+    return id;
+  }
+
+  // drops a reference, the texture is deleted once nobody uses it anymore
+  void release(uint32_t id) {
+    auto found = entries.find(id);
+    if (found == entries.end())
+      return;
+
+    Entry &entry = found->second;
+    if (--entry.references > 0)
+      return;
+
+    for (const std::string &path : entry.paths)
+      paths.erase(path);
+    if (entry.content_hash != 0)
+      contents.erase(entry.content_hash);
+    entries.erase(found);
+
+    TextureLoader::shared().cancel(id);
+    GLState::shared().deleteTextures(1, &id);
+  }
+
+  // number of distinct textures currently alive
+  size_t size() const { return entries.size(); }
+
+private:
+  struct Entry {
+    uint32_t references = 0;
+    uint64_t content_hash = 0;
+    // every path the texture was requested through
+    std::vector<std::string> paths;
+  };
+
+  std::unordered_map<uint32_t, Entry> entries;
+  std::unordered_map<std::string, uint32_t> paths;
+  std::unordered_map<uint64_t, uint32_t> contents;
+
+  TextureCache() {}
+
+  static std::string canonicalPath(const std::string &filename) {
+    std::error_code error;
+    std::filesystem::path path =
+        std::filesystem::weakly_canonical(filename, error);
+    return error ? filename : path.string();
+  }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stb_image.h>
+
+#include "block_compression.hpp"
+#include "compressed_texture.hpp"
+#include "mipmap.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Offline step that converts the texture maps referenced by a .mtl file into
+// block compressed DDS files with a full mip chain (see mipmap.hpp), stored
+// next to the source images where the TextureLoader picks them up instead of
+// the originals.
+
+// picks the block format for a map from the .mtl keyword that references it
+inline BlockFormat cookedFormatFor(const std::string &keyword,
+                                   const std::vector<uint8_t> &rgba) {
+  if (keyword == "map_Bump" || keyword == "map_bump" || keyword == "bump" ||
+      keyword == "norm")
+    return BlockFormat::BC5;
+  if (keyword == "map_d")
+    return BlockFormat::BC4;
+  // color maps only pay for an alpha channel if they actually use it
+  for (size_t i = 3; i < rgba.size(); i += 4)
+    if (rgba[i] != 255)
+      return BlockFormat::BC3;
+  return BlockFormat::BC1;
+}
+
+// encodes one image with its mip chain, returns false if it can't be read
+inline bool cookTexture(const std::string &filename, const std::string &keyword,
+                        size_t &source_bytes, size_t &cooked_bytes) {
+  int width, height, components;
+  unsigned char *pixels =
+      stbi_load(filename.c_str(), &width, &height, &components, 4);
+  if (!pixels) {
+    std::cout << "Texture failed to load at path: " << filename << std::endl;
+    return false;
+  }
+  std::vector<uint8_t> base(pixels, pixels + size_t(width) * height * 4);
+  stbi_image_free(pixels);
+
+  const BlockFormat format = cookedFormatFor(keyword, base);
+  // color maps are filtered in linear space
+  const TextureImage chain =
+      generateMipChain(base.data(), width, height, keyword == "map_Kd");
+  std::vector<std::vector<uint8_t>> levels;
+  for (const TextureImage::Level &level : chain.levels) {
+    levels.push_back(compressImage(format, chain.data.data() + level.offset,
+                                   level.width, level.height));
+    cooked_bytes += levels.back().size();
+    // what the same level costs uncompressed as RGBA8
+    source_bytes += level.size;
+  }
+
+  const std::string stem = filename.substr(0, filename.find_last_of('.'));
+  if (!writeDDS(stem + ".dds", format, width, height, levels)) {
+    std::cout << "ERROR::TEXTURE_COOKER:: failed to write " << stem << ".dds"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// cooks every texture map referenced by the material file, returns the
+// number of failures
+inline int cookMaterialTextures(const std::string &mtl_path) {
+  std::ifstream mtl(mtl_path);
+  if (!mtl) {
+    std::cout << "ERROR::TEXTURE_COOKER:: could not open " << mtl_path
+              << std::endl;
+    return 1;
+  }
+  const size_t slash = mtl_path.find_last_of('/');
+  const std::string directory =
+      slash == std::string::npos ? "." : mtl_path.substr(0, slash);
+
+  int failures = 0;
+  size_t source_bytes = 0, cooked_bytes = 0;
+  std::string line;
+  while (std::getline(mtl, line)) {
+    std::istringstream tokens(line);
+    std::string keyword, file;
+    tokens >> keyword;
+    if (keyword.rfind("map_", 0) != 0 && keyword != "bump" && keyword != "norm")
+      continue;
+    // options like "-bm 1.0" come before the file name, which is last
+    while (tokens >> file) {
+    }
+    if (file.empty())
+      continue;
+
+    if (cookTexture(directory + '/' + file, keyword, source_bytes,
+                    cooked_bytes))
+      std::cout << "TEXTURE_COOKER:: cooked " << directory << '/' << file
+                << std::endl;
+    else
+      failures++;
+  }
+
+  std::cout << "TEXTURE_COOKER:: " << source_bytes / (1024.0 * 1024.0)
+            << " MiB as RGBA8 -> " << cooked_bytes / (1024.0 * 1024.0)
+            << " MiB block compressed" << std::endl;
+  return failures;
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <stb_image.h>
+
+#include "compressed_texture.hpp"
+#include "gl_state.hpp"
+#include "hash.hpp"
+#include "mipmap.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Loads textures without blocking the render loop. load() only reads the
+// image header, allocates immutable storage for the whole mip chain and hands
+// out the texture name right away, swizzled to sample as white until the
+// image arrives. The file is decoded on the thread pool and poll() then
+// streams finished images to the GPU through a pixel unpack buffer, so
+// anything holding the id picks up the real image without having to be told.
+// A block compressed "<name>.ktx2" or "<name>.dds" next to the image (see
+// texture_cooker.hpp) is preferred over the image itself and uploaded with
+// all its mip levels as is. Otherwise the mip chain is built on the CPU (see
+// mipmap.hpp) and kept in "<name>.mips" for the next run.
+class TextureLoader {
+public:
+  // uploads per poll() are capped to this many bytes (at least one image
+  // is always uploaded) to keep frame times flat while textures arrive
+  constexpr static size_t DEFAULT_UPLOAD_BUDGET = 16 * 1024 * 1024;
+
+  TextureLoader(const TextureLoader &) = delete;
+  TextureLoader &operator=(const TextureLoader &) = delete;
+
+  ~TextureLoader() {
+    // no GL calls here, the context is gone by the time statics are
+    // destroyed, see shutdown()
+    waitForDecodes();
+  }
+
+  static TextureLoader &shared() {
+    static TextureLoader loader;
+    return loader;
+  }
+
+  // returns a texture sampling as white until the decoded image has been
+  // uploaded by poll(). the mip levels of srgb (color) maps are filtered in
+  // linear space.
+  uint32_t load(const std::string &filename, bool srgb = false) {
+    uint32_t textureID;
+    glGenTextures(1, &textureID);
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D, textureID);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // immutable storage has to be sized up front, the headers are small
+    // enough to read here
+    Decoded image;
+    image.texture = textureID;
+    image.filename = filename;
+    image.srgb = srgb;
+    if (!readCompressedSibling(filename, image.storage, true) ||
+        (isS3TC(image.storage.format) && !supportsS3TC())) {
+      image.storage = TextureImage();
+      int width, height, components;
+      if (stbi_info(filename.c_str(), &width, &height, &components)) {
+        image.storage.format = GL_RGBA8;
+        image.storage.levels.resize(mipLevelCount(width, height));
+        image.storage.levels[0].width = width;
+        image.storage.levels[0].height = height;
+      }
+    }
+
+    if (image.storage.format == 0) {
+      std::cout << "Texture failed to load at path: " << filename << std::endl;
+      const unsigned char white[4] = {255, 255, 255, 255};
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA,
+                   GL_UNSIGNED_BYTE, white);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      GLState::shared().bindTexture(0, GL_TEXTURE_2D, 0);
+      return textureID;
+    }
+
+    glTexStorage2D(GL_TEXTURE_2D, image.storage.levels.size(),
+                   image.storage.format, image.storage.levels[0].width,
+                   image.storage.levels[0].height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    // the storage contents are undefined until the upload
+    const GLint white[4] = {GL_ONE, GL_ONE, GL_ONE, GL_ONE};
+    glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, white);
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D, 0);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    image.ticket = next_ticket++;
+    in_flight[textureID] = image.ticket;
+    decodes.push_back(ThreadPool::shared().submit([this, image]() mutable {
+      decode(image);
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.push_back(std::move(image));
+    }));
+
+    return textureID;
+  }
+
+  // uploads decoded images, has to be called on the thread owning the
+  // context, once per frame
+  void poll(size_t budget = DEFAULT_UPLOAD_BUDGET) {
+    std::vector<Decoded> uploads;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      size_t bytes = 0;
+      size_t count = 0;
+      while (count < ready.size() && (count == 0 || bytes < budget)) {
+        bytes += ready[count].image.data.size();
+        count++;
+      }
+      uploads.assign(std::make_move_iterator(ready.begin()),
+                     std::make_move_iterator(ready.begin() + count));
+      ready.erase(ready.begin(), ready.begin() + count);
+
+      // drop images whose texture got deleted while they were decoding, the
+      // name may already belong to a newer load() with its own ticket
+      for (Decoded &image : uploads) {
+        auto found = in_flight.find(image.texture);
+        if (found == in_flight.end() || found->second != image.ticket) {
+          image.texture = 0;
+          continue;
+        }
+        in_flight.erase(found);
+      }
+
+      // forget about decode tasks that have finished
+      decodes.erase(
+          std::remove_if(decodes.begin(), decodes.end(),
+                         [](std::future<void> &decode) {
+                           return decode.wait_for(std::chrono::seconds(0)) ==
+                                  std::future_status::ready;
+                         }),
+          decodes.end());
+    }
+
+    for (Decoded &image : uploads)
+      if (image.texture != 0)
+        upload(image);
+  }
+
+  // has to be called before deleting a texture returned by load(), so a
+  // decode still in flight doesn't get uploaded into a recycled name
+  void cancel(uint32_t texture) {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight.erase(texture);
+  }
+
+  // true until poll() has uploaded the image of the texture (or given up on
+  // it)
+  bool loading(uint32_t texture) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return in_flight.count(texture) != 0;
+  }
+
+  // number of textures still showing their placeholder
+  size_t pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t count = ready.size();
+    for (std::future<void> &decode : decodes)
+      if (decode.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        count++;
+    return count;
+  }
+
+  // finishes outstanding work and frees the GL objects owned by the loader,
+  // call before the context is destroyed
+  void shutdown() {
+    waitForDecodes();
+    ready.clear();
+    in_flight.clear();
+    if (PBO != 0)
+      GLState::shared().deleteBuffers(1, &PBO);
+    PBO = 0;
+
+    std::cout << "TEXTURE_LOADER:: " << uploaded_bytes / (1024.0 * 1024.0)
+              << " MiB of texture memory uploaded, "
+              << rgba8_bytes / (1024.0 * 1024.0)
+              << " MiB as uncompressed RGBA8" << std::endl;
+  }
+
+private:
+  struct Decoded {
+    uint32_t texture;
+    // tells this load() apart from others that got the same texture name
+    uint64_t ticket;
+    std::string filename;
+    bool srgb;
+    // what load() allocated, format and level count plus the size of level 0
+    TextureImage storage;
+    // the whole decoded mip chain, format 0 if decoding failed
+    TextureImage image;
+  };
+
+  std::mutex mutex;
+  std::vector<std::future<void>> decodes;
+  std::vector<Decoded> ready;
+  // textures still waiting for their image, with the ticket of the load()
+  // that image has to come from. cancel() removes the texture, so a decode
+  // finishing after that matches no ticket and is dropped.
+  std::unordered_map<uint32_t, uint64_t> in_flight;
+  uint64_t next_ticket = 1;
+  // streaming buffer, orphaned on every upload so it never stalls on a
+  // transfer that is still in flight
+  uint32_t PBO = 0;
+  // -1 until queried
+  int s3tc_supported = -1;
+
+  // bytes of texture memory uploaded including mip chains, and what the
+  // same textures would take as RGBA8
+  size_t uploaded_bytes = 0;
+  size_t rgba8_bytes = 0;
+
+  TextureLoader() {
+    // make sure the pool outlives the loader, the destructor waits on it
+    ThreadPool::shared();
+  }
+
+  void waitForDecodes() {
+    std::vector<std::future<void>> pending;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.swap(decodes);
+    }
+    for (std::future<void> &decode : pending)
+      decode.wait();
+  }
+
+  // runs on a worker thread
+  static void decode(Decoded &image) {
+    if (image.storage.compressed()) {
+      readCompressedSibling(image.filename, image.image);
+      return;
+    }
+
+    const uint64_t source_hash = hashFile(image.filename);
+    if (source_hash != 0 &&
+        readMipCache(image.filename, source_hash, image.srgb, image.image))
+      return;
+
+    int width, height, components;
+    unsigned char *pixels =
+        stbi_load(image.filename.c_str(), &width, &height, &components, 4);
+    if (!pixels)
+      return;
+    image.image = generateMipChain(pixels, width, height, image.srgb);
+    stbi_image_free(pixels);
+
+    if (source_hash != 0)
+      writeMipCache(image.filename, source_hash, image.srgb, image.image);
+  }
+
+  static bool isS3TC(GLenum format) {
+    return format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ||
+           format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  }
+
+  bool supportsS3TC() {
+    if (s3tc_supported < 0) {
+      s3tc_supported = 0;
+      GLint count = 0;
+      glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+      for (GLint i = 0; i < count; i++) {
+        const char *name =
+            reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, i));
+        if (name && std::strcmp(name, "GL_EXT_texture_compression_s3tc") == 0)
+          s3tc_supported = 1;
+      }
+    }
+    return s3tc_supported == 1;
+  }
+
+  // copies data into the streaming buffer and leaves it bound, returns false
+  // (with nothing bound) if the buffer couldn't be mapped
+  bool stage(const void *data, size_t size) {
+    if (PBO == 0)
+      glGenBuffers(1, &PBO);
+
+    // copy the pixels into driver owned memory, the transfer to the texture
+    // then happens asynchronously
+    GLState::shared().bindBuffer(GL_PIXEL_UNPACK_BUFFER, PBO);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                    GL_MAP_WRITE_BIT |
+                                        GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!mapped) {
+      GLState::shared().bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      return false;
+    }
+    std::memcpy(mapped, data, size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    return true;
+  }
+
+  void upload(Decoded &decoded) {
+    const TextureImage &image = decoded.image;
+    const TextureImage &storage = decoded.storage;
+    if (image.format == 0) {
+      std::cout << "Texture failed to load at path: " << decoded.filename
+                << std::endl;
+      return;
+    }
+    // the storage is immutable, it can't follow a file that changed between
+    // load() reading its header and the decode
+    if (image.format != storage.format ||
+        image.levels.size() != storage.levels.size() ||
+        image.levels[0].width != storage.levels[0].width ||
+        image.levels[0].height != storage.levels[0].height) {
+      std::cout << "ERROR::TEXTURE_LOADER:: " << decoded.filename
+                << " changed while loading" << std::endl;
+      return;
+    }
+
+    // container files hold headers around the levels (and KTX2 stores the
+    // smallest level first), only the range covering the levels is staged
+    size_t begin = SIZE_MAX, end = 0;
+    for (const TextureImage::Level &level : image.levels) {
+      begin = std::min(begin, level.offset);
+      end = std::max(end, level.offset + level.size);
+    }
+    const bool staged = stage(image.data.data() + begin, end - begin);
+
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D, decoded.texture);
+    for (uint32_t i = 0; i < image.levels.size(); i++) {
+      const TextureImage::Level &level = image.levels[i];
+      const void *source =
+          staged ? reinterpret_cast<const void *>(level.offset - begin)
+                 : image.data.data() + level.offset;
+      if (image.compressed())
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, level.width,
+                                  level.height, image.format, level.size,
+                                  source);
+      else
+        glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, level.width, level.height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, source);
+      uploaded_bytes += level.size;
+      rgba8_bytes += size_t(level.width) * level.height * 4;
+    }
+    GLState::shared().bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    const GLint identity[4] = {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA};
+    glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, identity);
+    GLState::shared().bindTexture(0, GL_TEXTURE_2D, 0);
+
+    decoded.image = TextureImage();
+  }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// fixed size pool of worker threads for CPU side work that doesn't touch the
+// OpenGL context (mesh conversion, image decoding, ...)
+class ThreadPool {
+public:
+  explicit ThreadPool(uint32_t threadCount = defaultThreadCount()) {
+    for (uint32_t i = 0; i < threadCount; i++)
+      workers.emplace_back([this] { workerLoop(); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+  }
+
+  // pool shared by the whole process
+  static ThreadPool &shared() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  uint32_t size() const { return workers.size(); }
+
+  // queues a task, the returned future holds its result (or exception)
+  template <typename F> auto submit(F &&task) -> std::future<decltype(task())> {
+    using Result = decltype(task());
+    auto packaged =
+        std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+    std::future<Result> result = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push([packaged] { (*packaged)(); });
+    }
+    condition.notify_one();
+    return result;
+  }
+
+  // calls body(i) for every i in [0, count) spread over the pool and the
+  // calling thread, returns once all of them have finished
+  template <typename F> void parallelFor(size_t count, F &&body) {
+    if (count == 0)
+      return;
+
+    std::atomic<size_t> next(0);
+    auto run = [&next, &body, count] {
+      for (size_t i = next++; i < count; i = next++)
+        body(i);
+    };
+
+    // the calling thread takes part as well
+    size_t helpers = std::min<size_t>(workers.size(), count - 1);
+    std::vector<std::future<void>> pending;
+    pending.reserve(helpers);
+    for (size_t i = 0; i < helpers; i++)
+      pending.push_back(submit(run));
+
+    // every helper has to finish before the locals they reference go away,
+    // so exceptions are only rethrown once all of them are done
+    std::exception_ptr error;
+    try {
+      run();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    for (std::future<void> &done : pending) {
+      try {
+        done.get();
+      } catch (...) {
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+private:
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping = false;
+
+  static uint32_t defaultThreadCount() {
+    // leave one core for the thread that owns the context
+    uint32_t cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 1;
+  }
+
+  void workerLoop() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (stopping && tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "gl_state.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+// Per-frame data shared by every program through std140 uniform blocks at
+// fixed binding points. The structs mirror the GLSL blocks byte for byte:
+// every vec3 starts a 16 byte slot and is followed by a float (or padding),
+// the static_asserts below catch any drift from the std140 offsets.
+//
+//   layout (std140, binding = 0) uniform camera_block  -> CameraBlock
+//   layout (std140, binding = 1) uniform light_block   -> LightBlock
+constexpr uint32_t CAMERA_BLOCK_BINDING = 0;
+constexpr uint32_t LIGHT_BLOCK_BINDING = 1;
+
+struct CameraBlock {
+  glm::mat4 view;
+  glm::mat4 projection;
+  glm::vec3 camera_pos;
+  float padding;
+};
+
+struct DirLightBlock {
+  glm::vec3 direction;
+  float padding0;
+  glm::vec3 ambient;
+  float padding1;
+  glm::vec3 diffuse;
+  float padding2;
+  glm::vec3 specular;
+  float padding3;
+};
+
+struct PointLightBlock {
+  glm::vec3 position;
+  float constant;
+  glm::vec3 ambient;
+  float linear;
+  glm::vec3 diffuse;
+  float quadratic;
+  glm::vec3 specular;
+  // distance at which the light is cut off, see pointLightRadius()
+  float radius;
+};
+
+struct SpotLightBlock {
+  glm::vec3 position;
+  float cut_off;
+  glm::vec3 direction;
+  float outer_cut_off;
+  glm::vec3 ambient;
+  float constant;
+  glm::vec3 diffuse;
+  float linear;
+  glm::vec3 specular;
+  float quadratic;
+};
+
+// the point lights are in a storage buffer, light_block only has their
+// count and the cluster grid they are assigned to (see light_clusters.hpp)
+struct LightBlock {
+  DirLightBlock dir_light;
+  SpotLightBlock spot_light;
+  glm::uvec3 cluster_grid;
+  uint32_t point_light_count;
+  // pixels per cluster along x and y
+  glm::vec2 cluster_tile_size;
+  // the slice of a view space depth d is log(d) * scale + bias
+  float cluster_scale;
+  float cluster_bias;
+  // view space depth range the slices are spread over
+  float cluster_near;
+  float cluster_far;
+  float padding[2];
+};
+
+static_assert(sizeof(CameraBlock) == 144, "camera_block isn't std140");
+static_assert(offsetof(CameraBlock, camera_pos) == 128,
+              "camera_block isn't std140");
+static_assert(sizeof(DirLightBlock) == 64, "DirLight isn't std140");
+static_assert(sizeof(PointLightBlock) == 64, "PointLight isn't std140");
+static_assert(offsetof(PointLightBlock, constant) == 12,
+              "PointLight isn't std140");
+static_assert(sizeof(SpotLightBlock) == 80, "SpotLight isn't std140");
+static_assert(offsetof(SpotLightBlock, quadratic) == 76,
+              "SpotLight isn't std140");
+static_assert(offsetof(LightBlock, spot_light) == 64 &&
+                  offsetof(LightBlock, cluster_grid) == 144 &&
+                  offsetof(LightBlock, cluster_tile_size) == 160,
+              "light_block isn't std140");
+static_assert(sizeof(LightBlock) == 192, "light_block isn't std140");
+
+// a uniform buffer holding one T, bound to its binding point for as long as
+// it lives. update() replaces the whole contents with one call.
+template <typename T> class UniformBuffer {
+public:
+  uint32_t UBO = 0;
+
+  void init(uint32_t binding) {
+    glGenBuffers(1, &UBO);
+    GLState::shared().bindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(T), NULL, GL_DYNAMIC_DRAW);
+    GLState::shared().bindBuffer(GL_UNIFORM_BUFFER, 0);
+    GLState::shared().bindBufferRange(GL_UNIFORM_BUFFER, binding, UBO);
+  }
+
+  void update(const T &data) const {
+    GLState::shared().bindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+    GLState::shared().bindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+
+  void release() {
+    if (UBO != 0)
+      GLState::shared().deleteBuffers(1, &UBO);
+    UBO = 0;
+  }
+};
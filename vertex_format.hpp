@@ -0,0 +1,202 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "vertex_layout.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Compact GPU vertex layout for static meshes, 20 bytes instead of the 88 of
+// Vertex:
+//   position  3 x unorm16 inside the mesh bounds, dequantized in the shader
+//             with the bounds (position_offset + position * position_scale)
+//   qtangent  4 x snorm16 quaternion rotating the tangent frame, the sign of
+//             w holds the handedness of the bitangent
+//   uv        2 x half float
+// Bone ids and weights are left out, meshes using them stay on Vertex.
+struct PackedVertex {
+  uint16_t position[3];
+  uint16_t padding;
+  int16_t qtangent[4];
+  Half tex_coords[2];
+
+  // the tangent frame takes the tangent's location
+  static std::array<VertexAttribute, 3> attributes() {
+    return {attribute(0, &PackedVertex::position, GL_TRUE),
+            attribute(2, &PackedVertex::tex_coords),
+            attribute(3, &PackedVertex::qtangent, GL_TRUE)};
+  }
+};
+
+// the quantized position of a PackedVertex on its own, 8 bytes
+struct PackedPosition {
+  uint16_t position[3];
+  uint16_t padding;
+
+  static std::array<VertexAttribute, 1> attributes() {
+    return {attribute(0, &PackedPosition::position, GL_TRUE)};
+  }
+};
+
+inline PackedPosition positionOf(const PackedVertex &vertex) {
+  return {{vertex.position[0], vertex.position[1], vertex.position[2]}, 0};
+}
+
+enum class VertexFormat { Full, Packed };
+
+// layouts carrying everything PackedVertex encodes
+template <typename VertexT>
+constexpr bool is_packable_v =
+    has_Normal<VertexT>::value && has_TexCoords<VertexT>::value &&
+    has_Tangent<VertexT>::value && has_Bitangent<VertexT>::value;
+
+// texture coordinates outside this range lose more than one texel of a 1024
+// wide texture as half floats
+constexpr float PACKED_UV_RANGE = 2.0f;
+
+inline uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int32_t exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (exponent <= 0) {
+    // denormal or zero
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    const uint32_t shift = 14 - exponent;
+    return sign | ((mantissa + (1u << (shift - 1))) >> shift);
+  }
+  if (exponent >= 31)
+    // overflow, NaN isn't expected in vertex data
+    return sign | 0x7c00;
+  // round to nearest, a carry into the exponent is still correct
+  return sign | ((uint32_t(exponent) << 10) + ((mantissa + 0x1000) >> 13));
+}
+
+inline int16_t packSnorm16(float value) {
+  return int16_t(std::round(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+}
+
+// builds the quaternion of the tangent frame, the result always has w != 0 so
+// the sign can carry the bitangent handedness
+inline void packQTangent(const glm::vec3 &normal, const glm::vec3 &tangent,
+                         const glm::vec3 &bitangent, int16_t out[4]) {
+  glm::vec3 n = glm::length(normal) > 0.0f ? glm::normalize(normal)
+                                           : glm::vec3(0.0f, 0.0f, 1.0f);
+  // Gram-Schmidt, with any perpendicular vector for missing tangents
+  glm::vec3 t = tangent - n * glm::dot(n, tangent);
+  if (glm::length(t) < 1e-6f)
+    t = glm::cross(std::fabs(n.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f)
+                                         : glm::vec3(0.0f, 1.0f, 0.0f),
+                   n);
+  t = glm::normalize(t);
+  const glm::vec3 b = glm::cross(n, t);
+  const bool flipped = glm::dot(b, bitangent) < 0.0f;
+
+  // rotation matrix with columns t, b, n to quaternion
+  float q[4]; // x, y, z, w
+  const float trace = t.x + b.y + n.z;
+  if (trace > 0.0f) {
+    const float s = 0.5f / std::sqrt(trace + 1.0f);
+    q[3] = 0.25f / s;
+    q[0] = (b.z - n.y) * s;
+    q[1] = (n.x - t.z) * s;
+    q[2] = (t.y - b.x) * s;
+  } else if (t.x > b.y && t.x > n.z) {
+    const float s = 2.0f * std::sqrt(1.0f + t.x - b.y - n.z);
+    q[3] = (b.z - n.y) / s;
+    q[0] = 0.25f * s;
+    q[1] = (b.x + t.y) / s;
+    q[2] = (n.x + t.z) / s;
+  } else if (b.y > n.z) {
+    const float s = 2.0f * std::sqrt(1.0f + b.y - t.x - n.z);
+    q[3] = (n.x - t.z) / s;
+    q[0] = (b.x + t.y) / s;
+    q[1] = 0.25f * s;
+    q[2] = (n.y + b.z) / s;
+  } else {
+    const float s = 2.0f * std::sqrt(1.0f + n.z - t.x - b.y);
+    q[3] = (t.y - b.x) / s;
+    q[0] = (n.x + t.z) / s;
+    q[1] = (n.y + b.z) / s;
+    q[2] = 0.25f * s;
+  }
+
+  // q and -q are the same rotation, make w positive and at least one snorm16
+  // step so it has a sign
+  if (q[3] < 0.0f)
+    for (float &c : q)
+      c = -c;
+  constexpr float BIAS = 1.0f / 32767.0f;
+  if (q[3] < BIAS) {
+    const float scale = std::sqrt(1.0f - BIAS * BIAS);
+    for (int i = 0; i < 3; i++)
+      q[i] *= scale;
+    q[3] = BIAS;
+  }
+  if (flipped)
+    for (float &c : q)
+      c = -c;
+
+  for (int i = 0; i < 4; i++)
+    out[i] = packSnorm16(q[i]);
+}
+
+// picks the layout for a mesh: packed unless it is skinned or its texture
+// coordinates don't fit half floats
+template <typename VertexT>
+VertexFormat chooseVertexFormat(const std::vector<VertexT> &vertices) {
+  for (const VertexT &vertex : vertices) {
+    if constexpr (has_m_Weights<VertexT>::value)
+      for (float weight : vertex.m_Weights)
+        if (weight != 0.0f)
+          return VertexFormat::Full;
+    if (std::fabs(vertex.TexCoords.x) > PACKED_UV_RANGE ||
+        std::fabs(vertex.TexCoords.y) > PACKED_UV_RANGE)
+      return VertexFormat::Full;
+  }
+  return VertexFormat::Packed;
+}
+
+// packs the vertices, scale and offset receive the dequantization of the
+// positions
+template <typename VertexT>
+std::vector<PackedVertex> packVertices(const std::vector<VertexT> &vertices,
+                                       glm::vec3 &scale, glm::vec3 &offset) {
+  glm::vec3 lo(0.0f), hi(0.0f);
+  if (!vertices.empty())
+    lo = hi = vertices[0].Position;
+  for (const VertexT &vertex : vertices) {
+    lo = glm::min(lo, vertex.Position);
+    hi = glm::max(hi, vertex.Position);
+  }
+  offset = lo;
+  scale = hi - lo;
+  // flat meshes keep a non zero scale for the division below
+  for (int i = 0; i < 3; i++)
+    if (scale[i] <= 0.0f)
+      scale[i] = 1.0f;
+
+  std::vector<PackedVertex> packed(vertices.size());
+  for (size_t i = 0; i < vertices.size(); i++) {
+    const VertexT &vertex = vertices[i];
+    PackedVertex &out = packed[i];
+    for (int c = 0; c < 3; c++)
+      out.position[c] = uint16_t(std::round(
+          std::clamp((vertex.Position[c] - offset[c]) / scale[c], 0.0f, 1.0f) *
+          65535.0f));
+    out.padding = 0;
+    packQTangent(vertex.Normal, vertex.Tangent, vertex.Bitangent,
+                 out.qtangent);
+    out.tex_coords[0].bits = floatToHalf(vertex.TexCoords.x);
+    out.tex_coords[1].bits = floatToHalf(vertex.TexCoords.y);
+  }
+  return packed;
+}
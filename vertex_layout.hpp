@@ -0,0 +1,184 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#define MAX_BONE_INFLUENCE 4
+
+// Vertex layouts. Every layout is a plain struct that lists its attributes in
+// a static attributes() function, the GL format of each attribute (component
+// count, type, integer or float) is derived from the member's C++ type and
+// its offset from the member pointer, see setupVertexAttributes(). Attribute
+// locations are shared by all layouts and the shaders:
+//   0 position  1 normal  2 texture coords  3 tangent  4 bitangent
+//   5 bone ids  6 bone weights
+
+struct VertexAttribute {
+  uint32_t location;
+  GLint components;
+  GLenum type;
+  GLboolean normalized;
+  // integer attributes reach the shader as ints (glVertexAttribIPointer)
+  bool integer;
+  size_t offset;
+};
+
+// raw bits of a half float
+struct Half {
+  uint16_t bits;
+};
+
+// GL format of a member type
+template <typename T> struct AttributeFormat;
+template <> struct AttributeFormat<float> {
+  constexpr static GLint components = 1;
+  constexpr static GLenum type = GL_FLOAT;
+};
+template <> struct AttributeFormat<int32_t> {
+  constexpr static GLint components = 1;
+  constexpr static GLenum type = GL_INT;
+};
+template <> struct AttributeFormat<uint16_t> {
+  constexpr static GLint components = 1;
+  constexpr static GLenum type = GL_UNSIGNED_SHORT;
+};
+template <> struct AttributeFormat<int16_t> {
+  constexpr static GLint components = 1;
+  constexpr static GLenum type = GL_SHORT;
+};
+template <> struct AttributeFormat<Half> {
+  constexpr static GLint components = 1;
+  constexpr static GLenum type = GL_HALF_FLOAT;
+};
+template <> struct AttributeFormat<glm::vec2> {
+  constexpr static GLint components = 2;
+  constexpr static GLenum type = GL_FLOAT;
+};
+template <> struct AttributeFormat<glm::vec3> {
+  constexpr static GLint components = 3;
+  constexpr static GLenum type = GL_FLOAT;
+};
+template <> struct AttributeFormat<glm::vec4> {
+  constexpr static GLint components = 4;
+  constexpr static GLenum type = GL_FLOAT;
+};
+// arrays of scalars are vectors
+template <typename T, size_t N> struct AttributeFormat<T[N]> {
+  constexpr static GLint components = N;
+  constexpr static GLenum type = AttributeFormat<T>::type;
+};
+
+// describes the member of VertexT at the given location. normalized only
+// matters for integer members read as floats.
+template <typename VertexT, typename MemberT>
+VertexAttribute attribute(uint32_t location, MemberT VertexT::*member,
+                          GLboolean normalized = GL_FALSE) {
+  static const VertexT probe{};
+  VertexAttribute result;
+  result.location = location;
+  result.components = AttributeFormat<MemberT>::components;
+  result.type = AttributeFormat<MemberT>::type;
+  result.normalized = normalized;
+  result.integer = false;
+  result.offset = reinterpret_cast<const char *>(&(probe.*member)) -
+                  reinterpret_cast<const char *>(&probe);
+  return result;
+}
+
+// same as attribute() for members the shader reads as ints
+template <typename VertexT, typename MemberT>
+VertexAttribute integerAttribute(uint32_t location, MemberT VertexT::*member) {
+  VertexAttribute result = attribute(location, member);
+  result.integer = true;
+  return result;
+}
+
+// enables and points the attributes of VertexT at the buffer bound to
+// GL_ARRAY_BUFFER, for the currently bound VAO
+template <typename VertexT> void setupVertexAttributes() {
+  for (const VertexAttribute &a : VertexT::attributes()) {
+    glEnableVertexAttribArray(a.location);
+    if (a.integer)
+      glVertexAttribIPointer(a.location, a.components, a.type, sizeof(VertexT),
+                             (void *)a.offset);
+    else
+      glVertexAttribPointer(a.location, a.components, a.type, a.normalized,
+                            sizeof(VertexT), (void *)a.offset);
+  }
+}
+
+// depth only passes and the light cube
+struct PositionVertex {
+  glm::vec3 Position;
+
+  static std::array<VertexAttribute, 1> attributes() {
+    return {attribute(0, &PositionVertex::Position)};
+  }
+};
+
+// the position of a vertex of any layout on its own, the vertex of the
+// position only stream GeometryBuffer keeps for depth only passes. layouts
+// storing positions differently overload it.
+template <typename VertexT> PositionVertex positionOf(const VertexT &vertex) {
+  return {vertex.Position};
+}
+
+// static lit geometry without normal mapping
+struct PositionNormalUVVertex {
+  glm::vec3 Position;
+  glm::vec3 Normal;
+  glm::vec2 TexCoords;
+
+  static std::array<VertexAttribute, 3> attributes() {
+    return {attribute(0, &PositionNormalUVVertex::Position),
+            attribute(1, &PositionNormalUVVertex::Normal),
+            attribute(2, &PositionNormalUVVertex::TexCoords)};
+  }
+};
+
+// everything ASSIMP provides, including skinning
+struct Vertex {
+  // position
+  glm::vec3 Position;
+  // normal
+  glm::vec3 Normal;
+  // texCoords
+  glm::vec2 TexCoords;
+  // tangent
+  glm::vec3 Tangent;
+  // bitangent
+  glm::vec3 Bitangent;
+  // bone indexes which will influence this vertex
+  int m_BoneIDs[MAX_BONE_INFLUENCE];
+  // weights from each bone
+  float m_Weights[MAX_BONE_INFLUENCE];
+
+  static std::array<VertexAttribute, 7> attributes() {
+    return {attribute(0, &Vertex::Position),
+            attribute(1, &Vertex::Normal),
+            attribute(2, &Vertex::TexCoords),
+            attribute(3, &Vertex::Tangent),
+            attribute(4, &Vertex::Bitangent),
+            integerAttribute(5, &Vertex::m_BoneIDs),
+            attribute(6, &Vertex::m_Weights)};
+  }
+};
+
+// which attributes a layout has, for code filling vertices of any layout
+#define VERTEX_LAYOUT_HAS(member)                                              \
+  template <typename T, typename = void>                                       \
+  struct has_##member : std::false_type {};                                    \
+  template <typename T>                                                        \
+  struct has_##member<T, std::void_t<decltype(T::member)>> : std::true_type {};
+VERTEX_LAYOUT_HAS(Normal)
+VERTEX_LAYOUT_HAS(TexCoords)
+VERTEX_LAYOUT_HAS(Tangent)
+VERTEX_LAYOUT_HAS(Bitangent)
+VERTEX_LAYOUT_HAS(m_Weights)
+#undef VERTEX_LAYOUT_HAS